@@ -0,0 +1,235 @@
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "DnsListener.h"
+#include "util/Log.h"
+#include "util/Util.h"
+#include "util/ReusePort.h"
+
+// With reusePort, every worker process answers on the same port.
+
+DnsListener::DnsListener(boost::asio::io_service &io_service, Resolver &resolver, 
+			 int listenPort, bool reusePort)
+  : socket(io_service), resolver(resolver)
+{
+  ip::udp::endpoint endpoint(ip::address_v4::loopback(), listenPort);
+
+  socket.open(endpoint.protocol());
+
+#ifdef SO_REUSEPORT
+  if (reusePort) socket.set_option(reuse_port(true));
+#endif
+
+  socket.bind(endpoint);
+  receive();
+}
+
+void DnsListener::receive() {
+  socket.async_receive_from(buffer(data, sizeof(data)), sender,
+			    boost::bind(&DnsListener::receiveComplete, this,
+					placeholders::error, 
+					placeholders::bytes_transferred));
+}
+
+void DnsListener::receiveComplete(const boost::system::error_code &err, 
+				  std::size_t transferred)
+{
+  if (err) {
+    LOG(Log::WARNING) << "Error receiving DNS query: " << err;
+    receive();
+    return;
+  }
+
+  boost::shared_ptr<DnsQuery> query(new DnsQuery());
+  std::vector<ResolvedAnswer> noAnswers;
+
+  query->sender = sender;
+
+  if (!parseQuery(transferred, query)) {
+    if (transferred >= 2) sendResponse(query, FORMAT_ERROR, noAnswers);
+  } else if (query->type == A_TYPE || query->type == AAAA_TYPE) {
+    resolver.resolve(query->name, boost::bind(&DnsListener::resolveComplete, this,
+					      query, _1, _2));
+  } else if (query->type == PTR_TYPE && query->name.length() > 13 &&
+	     query->name.compare(query->name.length() - 13, 13, ".in-addr.arpa") == 0) 
+  {
+    resolver.resolve(query->name, boost::bind(&DnsListener::resolveComplete, this,
+					      query, _1, _2));
+  } else {
+    sendResponse(query, NOT_IMPL, noAnswers);
+  }
+
+  receive();
+}
+
+bool DnsListener::parseQuery(std::size_t length, boost::shared_ptr<DnsQuery> query) {
+  if (length >= 2) 
+    query->id = Util::bigEndianArrayToShort(data);
+
+  if (length < HEADER_LEN) return false;
+
+  query->flags = Util::bigEndianArrayToShort(data + 2);
+
+  // Responses, anything but a standard query, and anything with more
+  // than one question are not something we're going to answer.
+  if ((query->flags & 0x8000) || (query->flags & 0x7800)) return false;
+  if (Util::bigEndianArrayToShort(data + 4) != 1)         return false;
+
+  std::size_t offset = HEADER_LEN;
+
+  while (offset < length && data[offset] != 0) {
+    std::size_t labelLength = data[offset];
+
+    if ((labelLength & 0xC0) || offset + 1 + labelLength >= length) return false;
+
+    if (!query->name.empty()) query->name.append(".");
+    query->name.append((char*)data + offset + 1, labelLength);
+
+    offset += 1 + labelLength;
+  }
+
+  if (offset + 5 > length || query->name.empty()) return false;
+
+  query->type = Util::bigEndianArrayToShort(data + offset + 1);
+
+  if (Util::bigEndianArrayToShort(data + offset + 3) != IN_CLASS) return false;
+
+  query->question.assign(data + HEADER_LEN, data + offset + 5);
+
+  return true;
+}
+
+void DnsListener::resolveComplete(boost::shared_ptr<DnsQuery> query,
+				  std::vector<ResolvedAnswer> &answers,
+				  const boost::system::error_code &err)
+{
+  if      (err == boost::asio::error::host_not_found) sendResponse(query, NAME_ERROR, answers);
+  else if (err)                                       sendResponse(query, SERVER_FAIL, answers);
+  else                                                sendResponse(query, NO_ERROR, answers);
+}
+
+void DnsListener::sendResponse(boost::shared_ptr<DnsQuery> query, uint16_t responseCode,
+			       std::vector<ResolvedAnswer> &answers)
+{
+  boost::shared_ptr<std::vector<unsigned char> > response(new std::vector<unsigned char>());
+  std::vector<ResolvedAnswer>::iterator iter;
+  uint16_t answerCount = 0;
+
+  appendShort(*response, query->id);
+  appendShort(*response, 0x8080 | (query->flags & 0x0100) | responseCode);
+  appendShort(*response, query->question.empty() ? 0 : 1);
+  appendShort(*response, 0);
+  appendShort(*response, 0);
+  appendShort(*response, 0);
+
+  response->insert(response->end(), query->question.begin(), query->question.end());
+
+  for (iter = answers.begin(); iter != answers.end() && responseCode == NO_ERROR; iter++) {
+    std::vector<unsigned char> record;
+
+    // Every answer is for the one question, so its name is a pointer
+    // back to the question at the end of the header.
+    appendShort(record, 0xC000 | HEADER_LEN);
+
+    if (query->type == A_TYPE && iter->type == ResolvedAnswer::IPV4_TYPE) {
+      boost::array<unsigned char, 4> address = ip::address_v4::from_string(iter->value).to_bytes();
+      appendShort(record, A_TYPE);
+      appendShort(record, IN_CLASS);
+      appendInt(record, iter->ttl);
+      appendShort(record, address.size());
+      record.insert(record.end(), address.begin(), address.end());
+    } else if (query->type == AAAA_TYPE && iter->type == ResolvedAnswer::IPV6_TYPE) {
+      boost::array<unsigned char, 16> address = ip::address_v6::from_string(iter->value).to_bytes();
+      appendShort(record, AAAA_TYPE);
+      appendShort(record, IN_CLASS);
+      appendInt(record, iter->ttl);
+      appendShort(record, address.size());
+      record.insert(record.end(), address.begin(), address.end());
+    } else if (query->type == PTR_TYPE && iter->type == ResolvedAnswer::HOSTNAME_TYPE) {
+      std::vector<unsigned char> name;
+      appendName(name, iter->value);
+      appendShort(record, PTR_TYPE);
+      appendShort(record, IN_CLASS);
+      appendInt(record, iter->ttl);
+      appendShort(record, name.size());
+      record.insert(record.end(), name.begin(), name.end());
+    } else {
+      continue;
+    }
+
+    if (response->size() + record.size() > MAX_MESSAGE_LEN) break;
+
+    response->insert(response->end(), record.begin(), record.end());
+    answerCount++;
+  }
+
+  Util::int16ToArrayBigEndian(&(*response)[6], answerCount);
+
+  socket.async_send_to(buffer(*response), query->sender,
+		       boost::bind(&DnsListener::sendResponseComplete, this,
+				   response, placeholders::error));
+}
+
+void DnsListener::sendResponseComplete(boost::shared_ptr<std::vector<unsigned char> > response,
+				       const boost::system::error_code &err)
+{
+  if (err)
+    LOG(Log::DEBUG) << "Error sending DNS response: " << err;
+}
+
+void DnsListener::appendName(std::vector<unsigned char> &response, std::string &name) {
+  std::size_t start = 0;
+
+  while (start < name.length()) {
+    std::size_t end = name.find('.', start);
+
+    if (end == std::string::npos) end = name.length();
+
+    std::size_t labelLength = end - start > 63 ? 63 : end - start;
+
+    if (labelLength > 0) {
+      response.push_back((unsigned char)labelLength);
+      response.insert(response.end(), name.begin() + start, name.begin() + start + labelLength);
+    }
+
+    start = end + 1;
+  }
+
+  response.push_back(0);
+}
+
+void DnsListener::appendShort(std::vector<unsigned char> &response, uint16_t value) {
+  response.push_back((value >> 8) & 0xFF);
+  response.push_back(value & 0xFF);
+}
+
+void DnsListener::appendInt(std::vector<unsigned char> &response, uint32_t value) {
+  appendShort(response, (value >> 16) & 0xFFFF);
+  appendShort(response, value & 0xFFFF);
+}
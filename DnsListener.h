@@ -0,0 +1,106 @@
+#ifndef __DNS_LISTENER_H__
+#define __DNS_LISTENER_H__
+
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <boost/shared_ptr.hpp>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <string>
+#include <vector>
+
+#include "Resolver.h"
+
+using namespace boost::asio;
+
+struct DnsQuery {
+  ip::udp::endpoint sender;
+  uint16_t id;
+  uint16_t flags;
+  uint16_t type;
+  std::string name;
+  std::vector<unsigned char> question;
+};
+
+/***********
+ *
+ * DnsListener answers plain DNS queries over UDP on a local port, using
+ * the Resolver to look names up through the exit.  It only knows about
+ * A, AAAA, and in-addr.arpa PTR queries, which is what a stub resolver
+ * pointed at it will ask for.
+ *
+ **********/
+
+class DnsListener {
+
+ private:
+  static const int HEADER_LEN        = 12;
+  static const int MAX_MESSAGE_LEN   = 512;
+
+  static const uint16_t A_TYPE       = 1;
+  static const uint16_t PTR_TYPE     = 12;
+  static const uint16_t AAAA_TYPE    = 28;
+  static const uint16_t IN_CLASS     = 1;
+
+  static const uint16_t NO_ERROR     = 0;
+  static const uint16_t FORMAT_ERROR = 1;
+  static const uint16_t SERVER_FAIL  = 2;
+  static const uint16_t NAME_ERROR   = 3;
+  static const uint16_t NOT_IMPL     = 4;
+
+  ip::udp::socket socket;
+  Resolver &resolver;
+  ip::udp::endpoint sender;
+  unsigned char data[MAX_MESSAGE_LEN];
+
+  void receive();
+  void receiveComplete(const boost::system::error_code &err, std::size_t transferred);
+
+  bool parseQuery(std::size_t length, boost::shared_ptr<DnsQuery> query);
+  void resolveComplete(boost::shared_ptr<DnsQuery> query,
+		       std::vector<ResolvedAnswer> &answers,
+		       const boost::system::error_code &err);
+
+  void sendResponse(boost::shared_ptr<DnsQuery> query, uint16_t responseCode,
+		    std::vector<ResolvedAnswer> &answers);
+  void sendResponseComplete(boost::shared_ptr<std::vector<unsigned char> > response,
+			    const boost::system::error_code &err);
+
+  void appendName(std::vector<unsigned char> &response, std::string &name);
+  void appendShort(std::vector<unsigned char> &response, uint16_t value);
+  void appendInt(std::vector<unsigned char> &response, uint32_t value);
+
+ public:
+  DnsListener(boost::asio::io_service &io_service, Resolver &resolver, int listenPort,
+	      bool reusePort);
+
+};
+
+#endif
@@ -0,0 +1,108 @@
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "HttpListener.h"
+#include "util/Log.h"
+#include "util/ReusePort.h"
+
+using namespace boost::asio;
+
+const uint32_t HttpListener::REPORT_INTERVAL;
+
+// With reusePort, every worker process listens on the same port.
+
+HttpListener::HttpListener(boost::asio::io_service &io_service, TunnelPool &pool, 
+			   int listenPort, bool reusePort)
+  : acceptor(io_service),
+    backoff(io_service, boost::bind(&HttpListener::acceptIncomingConnection, this)),
+    pool(pool), reportedRequests(0), reportTimer(io_service)
+{
+  ip::tcp::endpoint endpoint(ip::tcp::v4(), listenPort);
+
+  acceptor.open(endpoint.protocol());
+  acceptor.set_option(ip::tcp::acceptor::reuse_address(true));
+
+#ifdef SO_REUSEPORT
+  if (reusePort) acceptor.set_option(reuse_port(true));
+#endif
+
+  acceptor.bind(endpoint);
+  acceptor.listen();
+  acceptIncomingConnection();
+  scheduleReport();
+}
+
+void HttpListener::acceptIncomingConnection() {
+  boost::shared_ptr<ip::tcp::socket> socket(new ip::tcp::socket(acceptor.get_io_service()));
+  acceptor.async_accept(*socket, boost::bind(&HttpListener::handleIncomingConnection,
+					     this, socket, placeholders::error));
+}
+
+void HttpListener::handleIncomingConnection(boost::shared_ptr<ip::tcp::socket> socket,
+					    const boost::system::error_code &err) 
+{
+  if (err) {
+    LOG(Log::WARNING) << "Error accepting HTTP proxy connection: " << err;
+    backoff.pause();
+    return;
+  }
+
+  boost::shared_ptr<HttpProxyConnection> connection(new HttpProxyConnection(socket, pool, 
+									    stats));
+  connection->start();
+
+  acceptIncomingConnection();
+}
+
+void HttpListener::scheduleReport() {
+  reportTimer.expires_from_now(boost::posix_time::seconds(REPORT_INTERVAL));
+  reportTimer.async_wait(boost::bind(&HttpListener::report, this, placeholders::error));
+}
+
+void HttpListener::report(const boost::system::error_code &err) {
+  if (err == boost::asio::error::operation_aborted) return;
+
+  // A quiet proxy doesn't need to say so every minute.
+  if (stats.requests != reportedRequests) {
+    uint64_t streams = stats.streamsOpened + stats.streamsReused;
+
+    LOG(Log::INFO) << "HTTP proxy: " << stats.requests << " requests"
+		   << " (" << stats.connects << " CONNECT)"
+		   << " streams opened: " << stats.streamsOpened
+		   << " reused: " << stats.streamsReused
+		   << " (" << (streams == 0 ? 0 : (stats.streamsReused * 100) / streams) << "%)"
+		   << " first byte: " 
+		   << (stats.latencySamples == 0 ? 0 : stats.latencyTotal / stats.latencySamples / 1000) 
+		   << "ms avg, " << stats.latencyMax / 1000 << "ms max";
+
+    reportedRequests = stats.requests;
+  }
+
+  scheduleReport();
+}
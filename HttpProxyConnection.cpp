@@ -0,0 +1,514 @@
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "HttpProxyConnection.h"
+#include "util/Log.h"
+#include "ProxyShuffler.h"
+#include "util/Util.h"
+
+#include <boost/lexical_cast.hpp>
+#include <cstdlib>
+#include <strings.h>
+
+using namespace boost::asio;
+
+HttpProxyConnection::HttpProxyConnection(boost::shared_ptr<ip::tcp::socket> socket,
+					 TunnelPool &pool, HttpProxyStats &stats)
+  : SocketStream(socket), pool(pool), stats(stats), streamPort(0),
+    bodyRemaining(0), requestStarted(0), raw(false), reading(false), writing(false),
+    writingClient(false), opening(false), tunneling(false), awaitingResponse(false), 
+    closed(false)
+{}
+
+boost::shared_ptr<HttpProxyConnection> HttpProxyConnection::self() {
+  return boost::static_pointer_cast<HttpProxyConnection>(shared_from_this());
+}
+
+void HttpProxyConnection::start() {
+  readClient();
+}
+
+void HttpProxyConnection::readClient() {
+  if (reading || closed || tunneling) return;
+
+  reading = true;
+  socket->async_read_some(buffer(clientData, sizeof(clientData)),
+			  boost::bind(&HttpProxyConnection::readClientComplete, self(),
+				      placeholders::error, placeholders::bytes_transferred));
+}
+
+void HttpProxyConnection::readClientComplete(const boost::system::error_code &err,
+					     std::size_t transferred)
+{
+  reading = false;
+
+  if (closed) return;
+
+  if (err) {
+    shutdown();
+    return;
+  }
+
+  pending.append((const char*)clientData, transferred);
+  processPending();
+}
+
+// Client bytes are either request body, which goes to the stream as it
+// is, or the start of the next request's header.  Only one write to the
+// stream is in flight at a time, and nothing is parsed while a stream
+// is being opened, so requests go out in the order they came in.
+
+void HttpProxyConnection::processPending() {
+  while (!closed && !writing && !opening && !tunneling) {
+    if (raw || bodyRemaining > 0) {
+      if (pending.empty()) break;
+
+      std::size_t length = pending.size();
+
+      if (!raw && bodyRemaining < length) 
+	length = bodyRemaining;
+
+      outgoing.assign(pending, 0, length);
+      pending.erase(0, length);
+
+      if (!raw) bodyRemaining -= length;
+
+      writeStream();
+      break;
+    }
+
+    std::size_t end = pending.find("\r\n\r\n");
+
+    if (end == std::string::npos) {
+      if (pending.size() > MAX_HEADER_LEN) 
+	respondError("431 Request Header Fields Too Large");
+
+      break;
+    }
+
+    std::string header = pending.substr(0, end + 2);
+    pending.erase(0, end + 4);
+
+    HttpRequest request;
+
+    if (!parseRequest(header, request)) {
+      respondError("400 Bad Request");
+      break;
+    }
+
+    stats.requests++;
+
+    if (request.method == "CONNECT") handleConnect(request);
+    else                             handleForward(request);
+  }
+
+  if (pending.size() < MAX_HEADER_LEN)
+    readClient();
+}
+
+bool HttpProxyConnection::parseRequest(std::string &header, HttpRequest &request) {
+  std::size_t lineEnd = header.find("\r\n");
+  std::string line    = header.substr(0, lineEnd);
+
+  std::size_t methodEnd = line.find(' ');
+  std::size_t targetEnd = (methodEnd == std::string::npos) ? 
+    std::string::npos : line.find(' ', methodEnd + 1);
+
+  if (methodEnd == 0 || targetEnd == std::string::npos || targetEnd == methodEnd + 1)
+    return false;
+
+  request.method  = line.substr(0, methodEnd);
+  request.target  = line.substr(methodEnd + 1, targetEnd - methodEnd - 1);
+  request.version = line.substr(targetEnd + 1);
+
+  if (request.version.compare(0, 5, "HTTP/") != 0)
+    return false;
+
+  std::size_t offset = lineEnd + 2;
+
+  while (offset < header.length()) {
+    lineEnd = header.find("\r\n", offset);
+    line    = header.substr(offset, lineEnd - offset);
+    offset  = lineEnd + 2;
+
+    std::size_t colon = line.find(':');
+
+    // Folded header lines went out with RFC 7230, and nothing we'd want
+    // to forward still sends them.
+    if (colon == std::string::npos || colon == 0 || line[0] == ' ' || line[0] == '\t')
+      return false;
+
+    std::size_t valueStart = line.find_first_not_of(" \t", colon + 1);
+    std::size_t valueEnd   = line.find_last_not_of(" \t");
+    std::string value      = (valueStart == std::string::npos) ? 
+      std::string() : line.substr(valueStart, valueEnd - valueStart + 1);
+
+    request.headers.push_back(std::make_pair(line.substr(0, colon), value));
+  }
+
+  return true;
+}
+
+bool HttpProxyConnection::parseAuthority(const std::string &authority, uint16_t defaultPort,
+					 std::string &host, uint16_t &port)
+{
+  std::string portString;
+
+  if (!authority.empty() && authority[0] == '[') {
+    std::size_t close = authority.find(']');
+
+    if (close == std::string::npos) 
+      return false;
+
+    host = authority.substr(1, close - 1);
+
+    if (close + 1 < authority.length()) {
+      if (authority[close + 1] != ':') return false;
+      portString = authority.substr(close + 2);
+    }
+  } else {
+    std::size_t colon = authority.rfind(':');
+
+    host = authority.substr(0, colon);
+
+    if (colon != std::string::npos)
+      portString = authority.substr(colon + 1);
+  }
+
+  if (host.empty()) 
+    return false;
+
+  if (portString.empty()) {
+    port = defaultPort;
+    return true;
+  }
+
+  if (portString.length() > 5 || portString.find_first_not_of("0123456789") != std::string::npos)
+    return false;
+
+  int value = atoi(portString.c_str());
+
+  if (value < 1 || value > 65535)
+    return false;
+
+  port = (uint16_t)value;
+  return true;
+}
+
+bool HttpProxyConnection::parseAbsoluteUri(const std::string &target, std::string &host,
+					   uint16_t &port, std::string &path)
+{
+  if (target.length() < 7 || !equalsIgnoreCase(target.substr(0, 7), "http://"))
+    return false;
+
+  std::size_t authorityEnd = target.find_first_of("/?", 7);
+  std::string authority    = target.substr(7, authorityEnd - 7);
+  std::size_t userInfo     = authority.rfind('@');
+
+  if (userInfo != std::string::npos)
+    authority = authority.substr(userInfo + 1);
+
+  if      (authorityEnd == std::string::npos) path = "/";
+  else if (target[authorityEnd] == '?')       path = "/" + target.substr(authorityEnd);
+  else                                        path = target.substr(authorityEnd);
+
+  return parseAuthority(authority, 80, host, port);
+}
+
+void HttpProxyConnection::handleConnect(HttpRequest &request) {
+  std::string host;
+  uint16_t port;
+
+  // Once the stream is up the client socket belongs to ProxyShuffler,
+  // so there mustn't be a read of ours still outstanding on it.
+  if (reading || !parseAuthority(request.target, 443, host, port)) {
+    respondError("400 Bad Request");
+    return;
+  }
+
+  closeStream();
+
+  stats.connects++;
+  stats.streamsOpened++;
+
+  tunneling      = true;
+  opening        = true;
+  requestStarted = Util::getTimeMicros();
+
+  pool.openStream(host, port, boost::bind(&HttpProxyConnection::connectStreamOpen, 
+					  self(), _1, _2));
+}
+
+void HttpProxyConnection::connectStreamOpen(boost::shared_ptr<TorTunnelStream> stream,
+					    const boost::system::error_code &err)
+{
+  opening = false;
+
+  if (closed) {
+    if (stream) stream->close();
+    return;
+  }
+
+  if (err) {
+    LOG(Log::DEBUG) << "Error opening stream: " << err;
+    respondError("502 Bad Gateway");
+    return;
+  }
+
+  stats.addLatency(Util::getTimeMicros() - requestStarted);
+
+  response = "HTTP/1.1 200 Connection established\r\n\r\n";
+
+  async_write(*socket, buffer(response), 
+	      boost::bind(&HttpProxyConnection::connectResponseComplete, self(),
+			  stream, placeholders::error));
+}
+
+void HttpProxyConnection::connectResponseComplete(boost::shared_ptr<TorTunnelStream> stream,
+						  const boost::system::error_code &err)
+{
+  if (err) {
+    stream->close();
+    shutdown();
+    return;
+  }
+
+  if (!pending.empty()) {
+    setPipelined((const unsigned char*)pending.data(), pending.size());
+    pending.clear();
+  }
+
+  boost::shared_ptr<ProxyShuffler> proxyShuffler(new ProxyShuffler(self(), stream));
+  proxyShuffler->shuffle();
+}
+
+void HttpProxyConnection::handleForward(HttpRequest &request) {
+  std::vector<std::pair<std::string, std::string> >::iterator iter;
+  std::string host, path;
+  uint16_t port;
+  bool hasHost = false;
+
+  if (!parseAbsoluteUri(request.target, host, port, path)) {
+    respondError("400 Bad Request");
+    return;
+  }
+
+  outgoing = request.method + " " + path + " " + request.version + "\r\n";
+
+  for (iter = request.headers.begin(); iter != request.headers.end(); iter++) {
+    if (equalsIgnoreCase(iter->first, "proxy-connection")    ||
+	equalsIgnoreCase(iter->first, "proxy-authorization") ||
+	equalsIgnoreCase(iter->first, "keep-alive"))
+      continue;
+
+    if (equalsIgnoreCase(iter->first, "host")) 
+      hasHost = true;
+    else if (equalsIgnoreCase(iter->first, "content-length"))
+      bodyRemaining = strtoull(iter->second.c_str(), NULL, 10);
+    else if (equalsIgnoreCase(iter->first, "transfer-encoding") ||
+	     equalsIgnoreCase(iter->first, "upgrade"))
+      raw = true;
+
+    outgoing += iter->first + ": " + iter->second + "\r\n";
+  }
+
+  // With a chunked body or a protocol upgrade there's no telling where
+  // this request ends, so the rest of the connection is passed through.
+  if (raw) bodyRemaining = 0;
+
+  if (!hasHost) {
+    std::string authority = (host.find(':') != std::string::npos) ? "[" + host + "]" : host;
+
+    if (port != 80) 
+      authority += ":" + boost::lexical_cast<std::string>(port);
+
+    outgoing += "Host: " + authority + "\r\n";
+  }
+
+  outgoing += "\r\n";
+
+  if (stream && streamHost == host && streamPort == port) {
+    stats.streamsReused++;
+
+    if (!awaitingResponse) {
+      awaitingResponse = true;
+      requestStarted   = Util::getTimeMicros();
+    }
+
+    writeStream();
+    return;
+  }
+
+  closeStream();
+  stats.streamsOpened++;
+
+  awaitingResponse = true;
+  requestStarted   = Util::getTimeMicros();
+  opening          = true;
+
+  pool.openStream(host, port, boost::bind(&HttpProxyConnection::forwardStreamOpen,
+					  self(), host, port, _1, _2));
+}
+
+void HttpProxyConnection::forwardStreamOpen(std::string host, uint16_t port,
+					    boost::shared_ptr<TorTunnelStream> stream,
+					    const boost::system::error_code &err)
+{
+  opening = false;
+
+  if (closed) {
+    if (stream) stream->close();
+    return;
+  }
+
+  if (err) {
+    LOG(Log::DEBUG) << "Error opening stream: " << err;
+    respondError("502 Bad Gateway");
+    return;
+  }
+
+  this->stream     = stream;
+  this->streamHost = host;
+  this->streamPort = port;
+
+  if (!writingClient) readStream(stream);
+  writeStream();
+}
+
+void HttpProxyConnection::writeStream() {
+  writing = true;
+  stream->write((unsigned char*)outgoing.data(), outgoing.length(),
+		boost::bind(&HttpProxyConnection::writeStreamComplete, self(), 
+			    placeholders::error));
+}
+
+void HttpProxyConnection::writeStreamComplete(const boost::system::error_code &err) {
+  writing = false;
+
+  if (closed) return;
+
+  if (err) {
+    shutdown();
+    return;
+  }
+
+  processPending();
+}
+
+void HttpProxyConnection::readStream(boost::shared_ptr<TorTunnelStream> stream) {
+  stream->readv(boost::bind(&HttpProxyConnection::readStreamComplete, self(),
+			    stream, _1, _2));
+}
+
+// The stream's buffers are only ours for the length of the callback, so
+// the response is copied out before it's written to the client.  That
+// leaves the stream free to be closed or replaced mid-write, but there's
+// only the one copy, so a replacement doesn't start reading until the
+// write is done.
+
+void HttpProxyConnection::readStreamComplete(boost::shared_ptr<TorTunnelStream> stream,
+					     StreamBuffers &buffers, int transferred)
+{
+  if (closed || stream != this->stream) return;
+
+  if (transferred == -1) {
+    shutdown();
+    return;
+  }
+
+  if (awaitingResponse) {
+    stats.addLatency(Util::getTimeMicros() - requestStarted);
+    awaitingResponse = false;
+  }
+
+  streamData.clear();
+
+  for (StreamBuffers::iterator iter = buffers.begin(); iter != buffers.end(); iter++) {
+    const unsigned char *data = buffer_cast<const unsigned char*>(*iter);
+    streamData.insert(streamData.end(), data, data + buffer_size(*iter));
+  }
+
+  writingClient = true;
+  async_write(*socket, buffer(streamData), 
+	      boost::bind(&HttpProxyConnection::writeClientComplete, self(),
+			  placeholders::error));
+}
+
+void HttpProxyConnection::writeClientComplete(const boost::system::error_code &err)
+{
+  writingClient = false;
+
+  if (closed) return;
+
+  if (err) {
+    shutdown();
+    return;
+  }
+
+  if (this->stream)
+    readStream(this->stream);
+}
+
+void HttpProxyConnection::respondError(const char *status) {
+  if (closed) return;
+
+  closeStream();
+  closed = true;
+
+  response = std::string("HTTP/1.1 ") + status + 
+    "\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+
+  async_write(*socket, buffer(response),
+	      boost::bind(&HttpProxyConnection::respondErrorComplete, self(),
+			  placeholders::error));
+}
+
+void HttpProxyConnection::respondErrorComplete(const boost::system::error_code &err) {
+  socket->close();
+}
+
+void HttpProxyConnection::closeStream() {
+  if (!stream) return;
+
+  stream->close();
+  stream.reset();
+  awaitingResponse = false;
+}
+
+void HttpProxyConnection::shutdown() {
+  if (closed) return;
+
+  closed = true;
+  closeStream();
+  socket->close();
+}
+
+bool HttpProxyConnection::equalsIgnoreCase(const std::string &a, const char *b) {
+  return strcasecmp(a.c_str(), b) == 0;
+}
@@ -0,0 +1,168 @@
+#ifndef __HTTP_PROXY_CONNECTION_H__
+#define __HTTP_PROXY_CONNECTION_H__
+
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <boost/shared_ptr.hpp>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <string>
+#include <vector>
+
+#include "TorTunnel.h"
+#include "TunnelPool.h"
+#include "SocketStream.h"
+
+using namespace boost::asio;
+
+struct HttpProxyStats {
+  uint64_t requests;
+  uint64_t connects;
+  uint64_t streamsOpened;
+  uint64_t streamsReused;
+
+  uint64_t latencyTotal;
+  uint64_t latencySamples;
+  uint64_t latencyMax;
+
+  HttpProxyStats() 
+    : requests(0), connects(0), streamsOpened(0), streamsReused(0),
+      latencyTotal(0), latencySamples(0), latencyMax(0)
+  {}
+
+  void addLatency(uint64_t micros) {
+    latencyTotal += micros;
+    latencySamples++;
+
+    if (micros > latencyMax) latencyMax = micros;
+  }
+};
+
+struct HttpRequest {
+  std::string method;
+  std::string target;
+  std::string version;
+  std::vector<std::pair<std::string, std::string> > headers;
+};
+
+/***********
+ *
+ * HttpProxyConnection serves one HTTP proxy client.  A CONNECT request
+ * gets a tunnel stream that's handed to ProxyShuffler once the client
+ * is told it's established.  Absolute-URI requests are rewritten into
+ * origin form and sent down a stream to the origin, and later requests
+ * on the same keep-alive connection to the same origin go down that
+ * same stream rather than each opening a new one.
+ *
+ * Responses are passed back as they come, without being parsed.  That
+ * means a request to a different origin closes the stream to the last
+ * one, so a client that pipelines requests across origins may see the
+ * earlier response cut short.
+ *
+ **********/
+
+class HttpProxyConnection : public SocketStream {
+
+ private:
+  static const std::size_t MAX_HEADER_LEN = 16 * 1024;
+  static const int READ_LEN               = 16 * 1024;
+
+  TunnelPool &pool;
+  HttpProxyStats &stats;
+
+  unsigned char clientData[READ_LEN];
+  std::string pending;
+  std::string outgoing;
+  std::string response;
+  std::vector<unsigned char> streamData;
+
+  boost::shared_ptr<TorTunnelStream> stream;
+  std::string streamHost;
+  uint16_t streamPort;
+
+  uint64_t bodyRemaining;
+  uint64_t requestStarted;
+
+  bool raw;
+  bool reading;
+  bool writing;
+  bool writingClient;
+  bool opening;
+  bool tunneling;
+  bool awaitingResponse;
+  bool closed;
+
+  boost::shared_ptr<HttpProxyConnection> self();
+
+  void readClient();
+  void readClientComplete(const boost::system::error_code &err, std::size_t transferred);
+  void processPending();
+
+  bool parseRequest(std::string &header, HttpRequest &request);
+  bool parseAuthority(const std::string &authority, uint16_t defaultPort,
+		      std::string &host, uint16_t &port);
+  bool parseAbsoluteUri(const std::string &target, std::string &host, 
+			uint16_t &port, std::string &path);
+
+  void handleConnect(HttpRequest &request);
+  void connectStreamOpen(boost::shared_ptr<TorTunnelStream> stream,
+			 const boost::system::error_code &err);
+  void connectResponseComplete(boost::shared_ptr<TorTunnelStream> stream,
+			       const boost::system::error_code &err);
+
+  void handleForward(HttpRequest &request);
+  void forwardStreamOpen(std::string host, uint16_t port,
+			 boost::shared_ptr<TorTunnelStream> stream,
+			 const boost::system::error_code &err);
+
+  void writeStream();
+  void writeStreamComplete(const boost::system::error_code &err);
+
+  void readStream(boost::shared_ptr<TorTunnelStream> stream);
+  void readStreamComplete(boost::shared_ptr<TorTunnelStream> stream,
+			  StreamBuffers &buffers, int transferred);
+  void writeClientComplete(const boost::system::error_code &err);
+
+  void respondError(const char *status);
+  void respondErrorComplete(const boost::system::error_code &err);
+
+  void closeStream();
+  void shutdown();
+
+  static bool equalsIgnoreCase(const std::string &a, const char *b);
+
+ public:
+  HttpProxyConnection(boost::shared_ptr<ip::tcp::socket> socket, TunnelPool &pool,
+		      HttpProxyStats &stats);
+
+  void start();
+};
+
+#endif
@@ -0,0 +1,130 @@
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "MetricsListener.h"
+#include "util/Metrics.h"
+#include "util/CellTrace.h"
+#include "util/LoopProfiler.h"
+#include "util/Log.h"
+
+#include <sstream>
+
+using namespace boost::asio;
+
+MetricsListener::MetricsListener(boost::asio::io_service &io_service, int listenPort)
+  : acceptor(io_service, ip::tcp::endpoint(ip::address_v4::loopback(), listenPort))
+{
+  acceptIncomingConnection();
+}
+
+void MetricsListener::acceptIncomingConnection() {
+  boost::shared_ptr<ip::tcp::socket> socket(new ip::tcp::socket(acceptor.get_io_service()));
+  acceptor.async_accept(*socket, boost::bind(&MetricsListener::handleIncomingConnection,
+					     this, socket, placeholders::error));
+}
+
+void MetricsListener::handleIncomingConnection(boost::shared_ptr<ip::tcp::socket> socket,
+					       const boost::system::error_code &err) 
+{
+  if (err) {
+    LOG(Log::WARNING) << "Error accepting metrics connection: " << err;
+    acceptIncomingConnection();
+    return;
+  }
+
+  boost::shared_ptr<boost::asio::streambuf> request(new boost::asio::streambuf(8192));
+
+  async_read_until(*socket, *request, "\r\n\r\n",
+		   boost::bind(&MetricsListener::readRequestComplete, this, 
+			       socket, request, placeholders::error));
+
+  acceptIncomingConnection();
+}
+
+// The request line is all that matters.  A GET for the root or /metrics
+// gets the registry, /trace gets a summary of the cell stage timings,
+// /profile gets the handler and loop lag report, and anything else is
+// a 404.
+
+void MetricsListener::readRequestComplete(boost::shared_ptr<ip::tcp::socket> socket,
+					  boost::shared_ptr<boost::asio::streambuf> request,
+					  const boost::system::error_code &err)
+{
+  if (err) {
+    socket->close();
+    return;
+  }
+
+  std::istream input(request.get());
+  std::string method, path;
+  std::ostringstream body, response;
+
+  input >> method >> path;
+
+  if (method == "GET" && (path == "/" || path == "/metrics")) {
+    Metrics::render(body);
+
+    response << "HTTP/1.0 200 OK\r\n"
+	     << "Content-Type: text/plain; version=0.0.4\r\n";
+  } else if (method == "GET" && path == "/trace") {
+    CellTrace::dump(body);
+
+    response << "HTTP/1.0 200 OK\r\n"
+	     << "Content-Type: text/plain\r\n";
+  } else if (method == "GET" && path == "/profile") {
+    LoopProfiler::report(body);
+
+    response << "HTTP/1.0 200 OK\r\n"
+	     << "Content-Type: text/plain\r\n";
+  } else {
+    body << "Not found.\n";
+
+    response << "HTTP/1.0 404 Not Found\r\n"
+	     << "Content-Type: text/plain\r\n";
+  }
+
+  response << "Content-Length: " << body.str().size() << "\r\n"
+	   << "Connection: close\r\n\r\n"
+	   << body.str();
+
+  boost::shared_ptr<std::string> buffer(new std::string(response.str()));
+
+  async_write(*socket, boost::asio::buffer(*buffer),
+	      boost::bind(&MetricsListener::writeResponseComplete, this,
+			  socket, buffer, placeholders::error));
+}
+
+void MetricsListener::writeResponseComplete(boost::shared_ptr<ip::tcp::socket> socket,
+					    boost::shared_ptr<std::string> response,
+					    const boost::system::error_code &err)
+{
+  boost::system::error_code ignored;
+  socket->shutdown(ip::tcp::socket::shutdown_both, ignored);
+  socket->close(ignored);
+}
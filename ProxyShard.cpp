@@ -0,0 +1,239 @@
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "ProxyShard.h"
+#include "util/Log.h"
+#include "util/Metrics.h"
+#include "util/LoopProfiler.h"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+using namespace boost::asio;
+
+static Gauge sessionsActive("tortunnel_sessions_active", "",
+			    "SOCKS sessions currently open.");
+
+HANDLER_TAG(socksRequestHandler, "socks.request");
+
+ProxyShard::ProxyShard(uint32_t index, Directory &source)
+  : index(index), work(NULL), thread(NULL), cpu(-1),
+    directory(io_service, source), pool(NULL), resolver(NULL), ready(false),
+    sessions(0), accepted(0), sockets(POOLED_OBJECTS), connections(POOLED_OBJECTS)
+{}
+
+void ProxyShard::setPool(TunnelPool *pool, Resolver *resolver) {
+  this->pool     = pool;
+  this->resolver = resolver;
+}
+
+void ProxyShard::start(int cpu) {
+  this->cpu  = cpu;
+  this->work = new boost::asio::io_service::work(io_service);
+  thread     = new boost::thread(boost::bind(&ProxyShard::run, this));
+}
+
+void ProxyShard::run() {
+#ifdef __linux__
+  if (cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+      LOG(Log::WARNING) << "Unable to pin shard " << index << " to CPU " << cpu << ".";
+  }
+#endif
+
+  io_service.run();
+}
+
+// Only the acceptor's thread looks at ready, so it needs no lock.
+
+void ProxyShard::setReady() {
+  ready = true;
+}
+
+bool ProxyShard::isReady() {
+  return ready;
+}
+
+// Called on the acceptor's thread.  The socket belongs to this shard's
+// io_service, and goes back into the pool once the session drops it.
+
+boost::shared_ptr<ip::tcp::socket> ProxyShard::acquireSocket() {
+  ip::tcp::socket *socket = sockets.acquire();
+
+  if (socket == NULL)
+    socket = new ip::tcp::socket(io_service);
+
+  return boost::shared_ptr<ip::tcp::socket>(socket, boost::bind(&ProxyShard::releaseSocket,
+								this, _1));
+}
+
+void ProxyShard::releaseSocket(ip::tcp::socket *socket) {
+  boost::system::error_code ignored;
+  socket->close(ignored);
+
+  sockets.release(socket);
+}
+
+// A pooled SocksConnection is reset onto its new socket, and dropping
+// the last reference to it is what ends the session.
+
+boost::shared_ptr<SocksConnection> 
+ProxyShard::acquireConnection(boost::shared_ptr<ip::tcp::socket> socket) {
+  SocksConnection *connection = connections.acquire();
+
+  if (connection == NULL) connection = new SocksConnection(socket);
+  else                    connection->reset(socket);
+
+  return boost::shared_ptr<SocksConnection>(connection, 
+					    boost::bind(&ProxyShard::releaseConnection,
+							this, _1));
+}
+
+void ProxyShard::releaseConnection(SocksConnection *connection) {
+  --sessions;
+  sessionsActive.decrement();
+
+  connection->reset(boost::shared_ptr<ip::tcp::socket>());
+  connections.release(connection);
+}
+
+// Called on the acceptor's thread.  The socket was already accepted onto
+// this shard's io_service, so everything from here on runs on the shard.
+
+void ProxyShard::dispatch(boost::shared_ptr<ip::tcp::socket> socket) {
+  ++sessions;
+  ++accepted;
+  sessionsActive.increment();
+
+  io_service.post(boost::bind(&ProxyShard::handleConnection, this, socket));
+}
+
+void ProxyShard::handleConnection(boost::shared_ptr<ip::tcp::socket> socket) {
+  boost::shared_ptr<SocksConnection> connection = acquireConnection(socket);
+  connection->getRequest(LoopProfiler::wrap(socksRequestHandler,
+					    boost::bind(&ProxyShard::handleSocksRequest, this,
+							connection, _1, _2, _3)));
+}
+
+void ProxyShard::handleSocksRequest(boost::shared_ptr<SocksConnection> connection,
+				    std::string &host,
+				    uint16_t port,
+				    const boost::system::error_code &err)
+{
+  if (err) {
+    connection->close();
+  } else if (connection->getCommand() == SocksConnection::RESOLVE_COMMAND) {
+    resolver->resolve(host, boost::bind(&ProxyShard::handleResolved, this, connection, _1, _2));
+  } else if (connection->getCommand() == SocksConnection::RESOLVE_PTR_COMMAND) {
+    resolver->resolveReverse(host, boost::bind(&ProxyShard::handleResolved, this, 
+					       connection, _1, _2));
+  } else {
+    pool->openStream(host, port, boost::bind(&ProxyShard::handleStreamOpen,
+					     this, connection, _1, _2));
+  }
+}
+
+void ProxyShard::handleResolved(boost::shared_ptr<SocksConnection> socks,
+				std::vector<ResolvedAnswer> &answers,
+				const boost::system::error_code &err)
+{
+  bool reverse = (socks->getCommand() == SocksConnection::RESOLVE_PTR_COMMAND);
+  std::vector<ResolvedAnswer>::iterator selected = answers.end();
+  std::vector<ResolvedAnswer>::iterator iter;
+
+  // Prefer IPv4 for forward lookups, since that's what most SOCKS
+  // clients asking for RESOLVE are ready to use.
+  for (iter = answers.begin(); iter != answers.end(); iter++) {
+    if (reverse && iter->type != ResolvedAnswer::HOSTNAME_TYPE) continue;
+    if (!reverse && iter->type == ResolvedAnswer::HOSTNAME_TYPE) continue;
+
+    if (selected == answers.end() || iter->type == ResolvedAnswer::IPV4_TYPE)
+      selected = iter;
+  }
+
+  if (err || selected == answers.end()) {
+    LOG(Log::DEBUG) << "Error resolving: " << err;
+    socks->respondConnectError();
+    socks->close();
+    return;
+  }
+
+  socks->respondResolved(*selected);
+}
+
+void ProxyShard::handleStreamOpen(boost::shared_ptr<SocksConnection> socks,
+				  boost::shared_ptr<TorTunnelStream> stream,
+				  const boost::system::error_code &err)
+{
+  if (err) {
+    LOG(Log::DEBUG) << "Error opening stream: " << err;
+    socks->respondConnectError();
+    socks->close();
+    return;
+  }
+
+  socks->respondConnected(stream->getLocalEndpoint());
+
+  boost::shared_ptr<ProxyShuffler> proxyShuffler(new ProxyShuffler(socks, stream));
+  proxyShuffler->shuffle();
+}
+
+boost::asio::io_service& ProxyShard::getIoService() {
+  return io_service;
+}
+
+Directory& ProxyShard::getDirectory() {
+  return directory;
+}
+
+TunnelPool* ProxyShard::getPool() {
+  return pool;
+}
+
+Resolver* ProxyShard::getResolver() {
+  return resolver;
+}
+
+uint32_t ProxyShard::getIndex() {
+  return index;
+}
+
+long ProxyShard::getSessions() {
+  return sessions;
+}
+
+long ProxyShard::getAccepted() {
+  return accepted;
+}
@@ -0,0 +1,127 @@
+#ifndef __PROXY_SHARD_H__
+#define __PROXY_SHARD_H__
+
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <boost/shared_ptr.hpp>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/detail/atomic_count.hpp>
+#include <string>
+#include <vector>
+
+#include "protocol/Directory.h"
+#include "TorTunnel.h"
+#include "TunnelPool.h"
+#include "Resolver.h"
+#include "SocksConnection.h"
+#include "ProxyShuffler.h"
+#include "util/ObjectPool.h"
+
+using namespace boost::asio;
+
+/***********
+ *
+ * A ProxyShard is one thread running its own io_service, with its own
+ * copy of the directory, its own tunnel pool, and the SOCKS sessions
+ * handed to it.  Nothing a shard owns is touched by any other thread,
+ * apart from its session counters, which the acceptor reads to decide
+ * which shard gets the next connection, and its socket pool, which the
+ * acceptor draws from.  Sockets and SOCKS sessions are pooled, so that
+ * a burst of connections doesn't mean a burst of allocations.
+ *
+ **********/
+
+class ProxyShard {
+
+ private:
+  static const std::size_t POOLED_OBJECTS = 128;
+
+  uint32_t index;
+  boost::asio::io_service io_service;
+  boost::asio::io_service::work *work;
+  boost::thread *thread;
+  int cpu;
+
+  Directory directory;
+  TunnelPool *pool;
+  Resolver *resolver;
+  bool ready;
+
+  boost::detail::atomic_count sessions;
+  boost::detail::atomic_count accepted;
+
+  ObjectPool<ip::tcp::socket> sockets;
+  ObjectPool<SocksConnection> connections;
+
+  void run();
+
+  void releaseSocket(ip::tcp::socket *socket);
+  void releaseConnection(SocksConnection *connection);
+  boost::shared_ptr<SocksConnection> acquireConnection(boost::shared_ptr<ip::tcp::socket> socket);
+
+  void handleConnection(boost::shared_ptr<ip::tcp::socket> socket);
+  void handleSocksRequest(boost::shared_ptr<SocksConnection> connection,
+			  std::string &host,
+			  uint16_t port,
+			  const boost::system::error_code &err);
+
+  void handleResolved(boost::shared_ptr<SocksConnection> socks,
+		      std::vector<ResolvedAnswer> &answers,
+		      const boost::system::error_code &err);
+
+  void handleStreamOpen(boost::shared_ptr<SocksConnection> socks,
+			boost::shared_ptr<TorTunnelStream> stream,
+			const boost::system::error_code &err);
+
+ public:
+  ProxyShard(uint32_t index, Directory &source);
+
+  void setPool(TunnelPool *pool, Resolver *resolver);
+  void start(int cpu);
+
+  void setReady();
+  bool isReady();
+
+  boost::shared_ptr<ip::tcp::socket> acquireSocket();
+  void dispatch(boost::shared_ptr<ip::tcp::socket> socket);
+
+  boost::asio::io_service& getIoService();
+  Directory& getDirectory();
+  TunnelPool* getPool();
+  Resolver* getResolver();
+
+  uint32_t getIndex();
+  long getSessions();
+  long getAccepted();
+};
+
+#endif
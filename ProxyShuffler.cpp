@@ -29,47 +29,101 @@
  */
 
 #include "ProxyShuffler.h"
+#include "util/CellTrace.h"
+#include "util/LoopProfiler.h"
 #include <boost/enable_shared_from_this.hpp>
 
 using namespace boost::asio;
 
+HANDLER_TAG(shuffleReadHandler, "shuffle.read");
+HANDLER_TAG(shuffleWriteHandler, "shuffle.write");
+
 ProxyShuffler::ProxyShuffler(boost::shared_ptr<ShuffleStream> socks,
-			     boost::shared_ptr<ShuffleStream> node)
-  : socks(socks), node(node), closed(false)
+			     boost::shared_ptr<ShuffleStream> node,
+			     std::size_t bufferCount, std::size_t bufferSize)
+  : socks(socks), node(node), upstream(socks, node), downstream(node, socks),
+    bufferCount(bufferCount), bufferSize(bufferSize),
+    highWatermark(bufferCount * bufferSize), lowWatermark((bufferCount * bufferSize) / 4),
+    closed(false)
 {}
 
 void ProxyShuffler::shuffle() {
-  socks->read(boost::bind(&ProxyShuffler::readComplete, shared_from_this(), 
-			  socks, node, socksReadBuffer, _1, _2));
+  startRead(&upstream);
+  startRead(&downstream);
+}
+
+// A source only takes one read at a time, so one that's already out
+// is left to finish rather than doubled up.
 
-  node->read(boost::bind(&ProxyShuffler::readComplete, shared_from_this(),
-			 node, socks, nodeReadBuffer, _1, _2));
+void ProxyShuffler::startRead(ShuffleDirection *direction) {
+  if (direction->reading) return;
+
+  direction->reading = true;
+  direction->source->readv(LoopProfiler::wrap(shuffleReadHandler,
+					      boost::bind(&ProxyShuffler::readComplete, 
+							  shared_from_this(), direction, _1, _2)));
 }
 
-void ProxyShuffler::readComplete(boost::shared_ptr<ShuffleStream> thisStream,
-				 boost::shared_ptr<ShuffleStream> thatStream,
-				 unsigned char* thisBuffer,
-				 unsigned char* buf, std::size_t transferred) 
+void ProxyShuffler::readComplete(ShuffleDirection *direction, 
+				 StreamBuffers &buffers, int transferred) 
 {
   if (closed) return;
 
+  direction->reading = false;
+
   if (transferred == -1) {
-    close();
+    direction->sourceClosed = true;
+
+    // Whatever was already read still goes out before we hang up.
+    if (!direction->writing) close();
     return;
   }
 
-  assert(transferred <= PROXY_BUF_SIZE);
+  // The source only promises its buffers until this handler returns, so
+  // they're copied out before anything else happens.
+  for (StreamBuffers::iterator iter = buffers.begin(); iter != buffers.end(); iter++)
+    queueData(direction, boost::asio::buffer_cast<const unsigned char*>(*iter),
+	      boost::asio::buffer_size(*iter));
+
+  // Only the oldest traced cell in the queue is followed out.
+  uint64_t traceTime = direction->source->takeTrace();
+
+  if (direction->traceQueued == 0)
+    direction->traceQueued = traceTime;
+
+  if (!direction->writing)
+    startWrite(direction);
 
-  memcpy(thisBuffer, buf, transferred);
+  if (direction->bufferedBytes < highWatermark) startRead(direction);
+  else                                          direction->paused = true;
+}
+
+void ProxyShuffler::startWrite(ShuffleDirection *direction) {
+  StreamBuffers buffers;
+  std::deque<ShuffleBuffer*>::iterator iter;
+
+  if (direction->queued.empty()) return;
+
+  for (iter = direction->queued.begin(); iter != direction->queued.end(); iter++)
+    buffers.push_back(boost::asio::const_buffer(&(*iter)->data[0], (*iter)->length));
+
+  direction->writingBuffers = direction->queued.size();
+  direction->writing        = true;
+  direction->traceWriting   = direction->traceQueued;
+  direction->traceQueued    = 0;
 
-  thatStream->write(thisBuffer, transferred,
-		    boost::bind(&ProxyShuffler::writeComplete, shared_from_this(),
-				thisStream, thatStream, thisBuffer, placeholders::error));
+  direction->sink->writev(buffers, LoopProfiler::wrap(shuffleWriteHandler,
+						      boost::bind(&ProxyShuffler::writeComplete, 
+								  shared_from_this(), direction, 
+								  placeholders::error)));
+
+  // Nothing more is waiting behind this write, so there's no point in
+  // the sink holding on to a short tail for more to arrive.
+  if (direction->source->available() == 0)
+    direction->sink->flush();
 }
 
-void ProxyShuffler::writeComplete(boost::shared_ptr<ShuffleStream> thisStream,
-				  boost::shared_ptr<ShuffleStream> thatStream,
-				  unsigned char *buf,
+void ProxyShuffler::writeComplete(ShuffleDirection *direction,
 				  const boost::system::error_code &err)
 {
   if (closed) return;
@@ -79,8 +133,80 @@ void ProxyShuffler::writeComplete(boost::shared_ptr<ShuffleStream> thisStream,
     return;
   }
 
-  thisStream->read(boost::bind(&ProxyShuffler::readComplete, shared_from_this(),
-			       thisStream, thatStream, buf, _1, _2));
+  direction->writing = false;
+
+  CellTrace::advance(CellTrace::DOWN_CLIENT_WRITE, direction->traceWriting);
+  direction->traceWriting = 0;
+
+  for (std::size_t i=0;i<direction->writingBuffers;i++) {
+    ShuffleBuffer *buffer = direction->queued.front();
+    direction->queued.pop_front();
+    direction->bufferedBytes -= buffer->length;
+    releaseBuffer(direction, buffer);
+  }
+
+  direction->writingBuffers = 0;
+
+  if (direction->paused && direction->bufferedBytes <= lowWatermark) {
+    direction->paused = false;
+    startRead(direction);
+  }
+
+  if      (!direction->queued.empty()) startWrite(direction);
+  else if (direction->sourceClosed)    close();
+}
+
+// New data tops up the last queued buffer if it isn't already being
+// written, so small reads don't each cost a buffer of their own.
+
+void ProxyShuffler::queueData(ShuffleDirection *direction, 
+			      const unsigned char *buf, std::size_t length)
+{
+  direction->bufferedBytes += length;
+
+  while (length > 0) {
+    ShuffleBuffer *buffer = NULL;
+
+    if (direction->queued.size() > direction->writingBuffers &&
+	direction->queued.back()->length < bufferSize)
+      {
+	buffer = direction->queued.back();
+      } 
+    else 
+      {
+	buffer = getBuffer(direction);
+	direction->queued.push_back(buffer);
+      }
+
+    std::size_t copied = bufferSize - buffer->length < length ? bufferSize - buffer->length : length;
+
+    memcpy(&buffer->data[buffer->length], buf, copied);
+
+    buffer->length += copied;
+    buf            += copied;
+    length         -= copied;
+  }
+}
+
+// The pool keeps up to bufferCount buffers around.  A single read can
+// hand back more than that (a tunnel stream returns everything it has
+// buffered), so extra buffers are allocated when needed and freed again
+// once they've been written.
+
+ShuffleBuffer* ProxyShuffler::getBuffer(ShuffleDirection *direction) {
+  if (direction->spare.empty())
+    return new ShuffleBuffer(bufferSize);
+
+  ShuffleBuffer *buffer = direction->spare.back();
+  direction->spare.pop_back();
+  buffer->length = 0;
+
+  return buffer;
+}
+
+void ProxyShuffler::releaseBuffer(ShuffleDirection *direction, ShuffleBuffer *buffer) {
+  if (direction->spare.size() < bufferCount) direction->spare.push_back(buffer);
+  else                                       delete buffer;
 }
 
 void ProxyShuffler::close() {
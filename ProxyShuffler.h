@@ -40,15 +40,56 @@
 #include <cassert>
 #include <iostream>
 #include <string>
-
-#define PROXY_BUF_SIZE 512
+#include <vector>
+#include <deque>
 
 /***********
  *
  * This class shuffles data back and forth between two ShuffleStreams.
+ * Each direction copies what it reads into a small pool of buffers and
+ * goes straight back to reading, while what's already been read is
+ * written out to the other side in gathered writes.  Reading stops when
+ * a direction has more than its high watermark buffered, and picks back
+ * up once writes have drained it below the low watermark.
  *
  **********/
 
+struct ShuffleBuffer {
+  std::vector<unsigned char> data;
+  std::size_t length;
+
+  ShuffleBuffer(std::size_t size) : data(size), length(0) {}
+};
+
+struct ShuffleDirection {
+  boost::shared_ptr<ShuffleStream> source;
+  boost::shared_ptr<ShuffleStream> sink;
+
+  std::deque<ShuffleBuffer*> queued;
+  std::vector<ShuffleBuffer*> spare;
+  std::size_t writingBuffers;
+  std::size_t bufferedBytes;
+
+  uint64_t traceQueued;
+  uint64_t traceWriting;
+
+  bool reading;
+  bool writing;
+  bool paused;
+  bool sourceClosed;
+
+  ShuffleDirection(boost::shared_ptr<ShuffleStream> source, 
+		   boost::shared_ptr<ShuffleStream> sink)
+    : source(source), sink(sink), writingBuffers(0), bufferedBytes(0),
+      traceQueued(0), traceWriting(0),
+      reading(false), writing(false), paused(false), sourceClosed(false)
+  {}
+
+  ~ShuffleDirection() {
+    while (!queued.empty()) { delete queued.front(); queued.pop_front(); }
+    while (!spare.empty())  { delete spare.back();   spare.pop_back();    }
+  }
+};
 
 class ProxyShuffler : public boost::enable_shared_from_this<ProxyShuffler> {
   
@@ -56,29 +97,38 @@ class ProxyShuffler : public boost::enable_shared_from_this<ProxyShuffler> {
   boost::shared_ptr<ShuffleStream> socks;
   boost::shared_ptr<ShuffleStream> node;
 
-  unsigned char socksReadBuffer[PROXY_BUF_SIZE];
-  unsigned char nodeReadBuffer[PROXY_BUF_SIZE];
+  ShuffleDirection upstream;
+  ShuffleDirection downstream;
+
+  std::size_t bufferCount;
+  std::size_t bufferSize;
+  std::size_t highWatermark;
+  std::size_t lowWatermark;
 
   bool closed;
 
-  void readComplete(boost::shared_ptr<ShuffleStream> thisStream,
-		    boost::shared_ptr<ShuffleStream> thatStream,
-		    unsigned char* thisBuffer,
-		    unsigned char* buf, std::size_t transferred);
+  void startRead(ShuffleDirection *direction);
+  void readComplete(ShuffleDirection *direction, StreamBuffers &buffers, int transferred);
+  void startWrite(ShuffleDirection *direction);
+  void writeComplete(ShuffleDirection *direction, const boost::system::error_code &err);
 
-  void writeComplete(boost::shared_ptr<ShuffleStream> thisStream,
-		     boost::shared_ptr<ShuffleStream> thatStream,
-		     unsigned char *buf,
-		     const boost::system::error_code &err);
+  void queueData(ShuffleDirection *direction, const unsigned char *buf, std::size_t length);
+  ShuffleBuffer* getBuffer(ShuffleDirection *direction);
+  void releaseBuffer(ShuffleDirection *direction, ShuffleBuffer *buffer);
 
   void close();
 
 
  public:
- ProxyShuffler(boost::shared_ptr<ShuffleStream> socks,
-	       boost::shared_ptr<ShuffleStream> node);
+  static const std::size_t DEFAULT_BUFFER_COUNT = 8;
+  static const std::size_t DEFAULT_BUFFER_SIZE  = 16 * 1024;
+
+  ProxyShuffler(boost::shared_ptr<ShuffleStream> socks,
+		boost::shared_ptr<ShuffleStream> node,
+		std::size_t bufferCount = DEFAULT_BUFFER_COUNT,
+		std::size_t bufferSize = DEFAULT_BUFFER_SIZE);
 
- void shuffle();
+  void shuffle();
   
 };
 
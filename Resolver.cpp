@@ -0,0 +1,213 @@
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "Resolver.h"
+#include "util/Util.h"
+
+#include <algorithm>
+#include <cctype>
+#include <sstream>
+
+const uint32_t Resolver::TIMEOUT;
+
+Resolver::Resolver(boost::asio::io_service &io_service, TunnelPool &pool) 
+  : io_service(io_service), pool(pool), hits(0), misses(0)
+{}
+
+void Resolver::resolve(std::string &name, ResolveHandler handler) {
+  std::string hostname(name);
+  std::transform(hostname.begin(), hostname.end(), hostname.begin(), ::tolower);
+
+  boost::system::error_code err;
+  ip::address address = ip::address::from_string(hostname, err);
+
+  // Nothing to look up if we were handed an address in the first place.
+  if (!err) {
+    std::vector<ResolvedAnswer> answers;
+    answers.push_back(ResolvedAnswer(address.is_v4() ? ResolvedAnswer::IPV4_TYPE : 
+				     ResolvedAnswer::IPV6_TYPE, 
+				     hostname, MAX_TTL));
+
+    io_service.post(boost::bind(handler, answers, boost::system::error_code()));
+    return;
+  }
+
+  std::map<std::string, ResolverCacheEntry>::iterator entry = cache.find(hostname);
+
+  if (entry != cache.end() && entry->second.expires > getNow()) {
+    hits++;
+    io_service.post(boost::bind(handler, entry->second.answers, entry->second.error));
+    return;
+  }
+
+  misses++;
+
+  ResolverLookup &lookup = pending[hostname];
+  lookup.waiting.push_back(handler);
+
+  if (lookup.waiting.size() > 1) return;
+
+  lookup.timer.reset(new deadline_timer(io_service));
+  lookup.timer->expires_from_now(boost::posix_time::seconds(TIMEOUT));
+  lookup.timer->async_wait(boost::bind(&Resolver::resolveTimeout, this, 
+				       hostname, lookup.timer, placeholders::error));
+
+  pool.resolve(hostname, boost::bind(&Resolver::resolveComplete, this, 
+				     hostname, lookup.timer, _1, _2));
+}
+
+// Reverse lookups go to the exit as in-addr.arpa names, and are cached
+// under that name like any other lookup.
+
+void Resolver::resolveReverse(std::string &address, ResolveHandler handler) {
+  boost::system::error_code err;
+  ip::address_v4 addressV4 = ip::address_v4::from_string(address, err);
+
+  if (err) {
+    std::vector<ResolvedAnswer> answers;
+    io_service.post(boost::bind(handler, answers, 
+				boost::system::error_code(boost::asio::error::invalid_argument)));
+    return;
+  }
+
+  boost::array<unsigned char, 4> bytes = addressV4.to_bytes();
+  std::ostringstream name;
+
+  name << (int)bytes[3] << "." << (int)bytes[2] << "." << (int)bytes[1] << "." 
+       << (int)bytes[0] << ".in-addr.arpa";
+
+  std::string hostname = name.str();
+  resolve(hostname, handler);
+}
+
+// The timer stands for the lookup it was started with, so an answer or
+// a timeout that turns up after that lookup is over, maybe with another
+// one for the same name under way, is let go.
+
+void Resolver::resolveComplete(std::string hostname,
+			       boost::shared_ptr<deadline_timer> timer,
+			       std::vector<ResolvedAnswer> &answers,
+			       const boost::system::error_code &err)
+{
+  std::map<std::string, ResolverLookup>::iterator lookup = pending.find(hostname);
+
+  if (lookup == pending.end() || lookup->second.timer != timer) return;
+
+  timer->cancel();
+
+  boost::system::error_code result = err;
+
+  for (std::vector<ResolvedAnswer>::iterator iter = answers.begin(); 
+       iter != answers.end() && !result; iter++)
+    {
+      if      (iter->type == ResolvedAnswer::TRANSIENT_ERROR_TYPE)    result = boost::asio::error::try_again;
+      else if (iter->type == ResolvedAnswer::NONTRANSIENT_ERROR_TYPE) result = boost::asio::error::host_not_found;
+    }
+
+  if (!result && answers.empty())
+    result = boost::asio::error::host_not_found;
+
+  if (result) answers.clear();
+
+  // Only answers the exit stands behind are worth remembering; a circuit
+  // failure or a transient error says nothing about the name itself.
+  if (!err && result != boost::asio::error::try_again)
+    cacheAnswers(hostname, answers, result);
+
+  completeLookup(hostname, answers, result);
+}
+
+void Resolver::resolveTimeout(std::string hostname, 
+			      boost::shared_ptr<deadline_timer> timer,
+			      const boost::system::error_code &err)
+{
+  if (err == boost::asio::error::operation_aborted) return;
+
+  std::map<std::string, ResolverLookup>::iterator lookup = pending.find(hostname);
+
+  if (lookup == pending.end() || lookup->second.timer != timer) return;
+
+  std::vector<ResolvedAnswer> answers;
+  completeLookup(hostname, answers, boost::asio::error::timed_out);
+}
+
+void Resolver::completeLookup(std::string &hostname, std::vector<ResolvedAnswer> &answers,
+			      const boost::system::error_code &err)
+{
+  std::list<ResolveHandler> waiting;
+  waiting.swap(pending[hostname].waiting);
+  pending.erase(hostname);
+
+  for (std::list<ResolveHandler>::iterator iter = waiting.begin(); iter != waiting.end(); iter++)
+    (*iter)(answers, err);
+}
+
+void Resolver::cacheAnswers(std::string &hostname, std::vector<ResolvedAnswer> &answers,
+			    const boost::system::error_code &err)
+{
+  uint32_t now = getNow();
+  uint32_t ttl = err ? NEGATIVE_TTL : MAX_TTL;
+
+  for (std::vector<ResolvedAnswer>::iterator iter = answers.begin(); iter != answers.end(); iter++)
+    if (iter->ttl < ttl) ttl = iter->ttl;
+
+  if (ttl < MIN_TTL) ttl = MIN_TTL;
+
+  if (cache.size() >= MAX_ENTRIES) 
+    expireEntries(now);
+
+  if (cache.size() >= MAX_ENTRIES)
+    cache.erase(cache.begin());
+
+  ResolverCacheEntry &entry = cache[hostname];
+  entry.answers = answers;
+  entry.error   = err;
+  entry.expires = now + ttl;
+}
+
+void Resolver::expireEntries(uint32_t now) {
+  std::map<std::string, ResolverCacheEntry>::iterator iter = cache.begin();
+
+  while (iter != cache.end()) {
+    if (iter->second.expires <= now) cache.erase(iter++);
+    else                             iter++;
+  }
+}
+
+uint32_t Resolver::getNow() {
+  return Util::getTimeMicros() / 1000000;
+}
+
+uint32_t Resolver::getHits() {
+  return hits;
+}
+
+uint32_t Resolver::getMisses() {
+  return misses;
+}
@@ -0,0 +1,113 @@
+#ifndef __RESOLVER_H__
+#define __RESOLVER_H__
+
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <boost/function.hpp>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+
+#include "TunnelPool.h"
+#include "protocol/RelayResolvedCell.h"
+
+typedef boost::function<void (std::vector<ResolvedAnswer> &answers, 
+			      const boost::system::error_code &error)> ResolveHandler;
+
+struct ResolverCacheEntry {
+  std::vector<ResolvedAnswer> answers;
+  boost::system::error_code error;
+  uint32_t expires;
+};
+
+struct ResolverLookup {
+  std::list<ResolveHandler> waiting;
+  boost::shared_ptr<boost::asio::deadline_timer> timer;
+};
+
+/***********
+ *
+ * The Resolver looks hostnames up through an exit node with RELAY_RESOLVE
+ * and keeps the answers for as long as their TTLs allow.  Lookups for a
+ * name that's already on its way to the exit wait on that request rather
+ * than sending another one, but only for so long, in case the exit never
+ * answers.  Names are looked up and cached in lower case, since that's
+ * how DNS compares them.
+ *
+ **********/
+
+class Resolver {
+
+ private:
+  static const uint32_t MIN_TTL      = 60;
+  static const uint32_t MAX_TTL      = 1800;
+  static const uint32_t NEGATIVE_TTL = 60;
+  static const uint32_t MAX_ENTRIES  = 4096;
+  static const uint32_t TIMEOUT      = 15;
+
+  boost::asio::io_service &io_service;
+  TunnelPool &pool;
+
+  std::map<std::string, ResolverCacheEntry> cache;
+  std::map<std::string, ResolverLookup> pending;
+
+  uint32_t hits;
+  uint32_t misses;
+
+  void resolveComplete(std::string hostname,
+		       boost::shared_ptr<boost::asio::deadline_timer> timer,
+		       std::vector<ResolvedAnswer> &answers,
+		       const boost::system::error_code &err);
+  void resolveTimeout(std::string hostname,
+		      boost::shared_ptr<boost::asio::deadline_timer> timer,
+		      const boost::system::error_code &err);
+  void completeLookup(std::string &hostname, std::vector<ResolvedAnswer> &answers,
+		      const boost::system::error_code &err);
+
+  void cacheAnswers(std::string &hostname, std::vector<ResolvedAnswer> &answers,
+		    const boost::system::error_code &err);
+  void expireEntries(uint32_t now);
+  uint32_t getNow();
+
+ public:
+  Resolver(boost::asio::io_service &io_service, TunnelPool &pool);
+
+  void resolve(std::string &hostname, ResolveHandler handler);
+  void resolveReverse(std::string &address, ResolveHandler handler);
+
+  uint32_t getHits();
+  uint32_t getMisses();
+};
+
+#endif
@@ -31,17 +31,28 @@
 
 #include <boost/asio.hpp>
 #include <boost/function.hpp>
+#include <stdint.h>
+#include <vector>
 
 /***********
  *
  * This class provides an interface that classes can implement
- * to allow for data to be shuffled by ProxyShuffler.
+ * to allow for data to be shuffled by ProxyShuffler.  readv() hands
+ * back everything a stream has ready as a list of buffers, which are
+ * only valid until the handler returns, so a reader copies out what it
+ * means to keep.  A stream that holds back small
+ * writes should send them on flush(), and a stream that can tell how
+ * much more is already waiting to be read reports it from available().
+ * A stream that traces cells hands back, from takeTrace(), when the
+ * last traced cell it read out went to its reader.
  *
  **********/
 
 
 typedef boost::function<void (const boost::system::error_code &error)> StreamWriteHandler;
 typedef boost::function<void (unsigned char* buf, int read)> StreamReadHandler;
+typedef std::vector<boost::asio::const_buffer> StreamBuffers;
+typedef boost::function<void (StreamBuffers &buffers, int read)> StreamReadvHandler;
 
 
 class ShuffleStream {
@@ -49,8 +60,14 @@ class ShuffleStream {
  public:
   virtual void read(StreamReadHandler handler) = 0;
   virtual void write(unsigned char* buf, int length, StreamWriteHandler handler) = 0;
+  virtual void readv(StreamReadvHandler handler) = 0;
+  virtual void writev(StreamBuffers &buffers, StreamWriteHandler handler) = 0;
   virtual void close() = 0;
 
+  virtual void flush() {}
+  virtual std::size_t available() { return 0; }
+  virtual uint64_t takeTrace() { return 0; }
+
 };
 
 
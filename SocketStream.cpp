@@ -0,0 +1,138 @@
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "SocketStream.h"
+
+using namespace boost::asio;
+
+SocketStream::SocketStream(boost::shared_ptr<ip::tcp::socket> socket) 
+  : socket(socket)
+{}
+
+void SocketStream::reset(boost::shared_ptr<ip::tcp::socket> socket) {
+  this->socket = socket;
+  pipelined.clear();
+}
+
+void SocketStream::setPipelined(const unsigned char *buf, std::size_t length) {
+  pipelined.assign(buf, buf + length);
+}
+
+void SocketStream::deliverPipelined(StreamReadHandler handler) {
+  std::size_t length = std::min(pipelined.size(), sizeof(readBuffer));
+
+  memcpy(readBuffer, &pipelined[0], length);
+  pipelined.erase(pipelined.begin(), pipelined.begin() + length);
+
+  handler(readBuffer, length);
+}
+
+void SocketStream::deliverPipelinedv(StreamReadvHandler handler) {
+  StreamBuffers buffers;
+  std::size_t length = std::min(pipelined.size(), sizeof(readBuffer));
+
+  memcpy(readBuffer, &pipelined[0], length);
+  pipelined.erase(pipelined.begin(), pipelined.begin() + length);
+
+  buffers.push_back(const_buffer(readBuffer, length));
+  handler(buffers, length);
+}
+
+void SocketStream::read(StreamReadHandler handler) {
+  if (!pipelined.empty()) {
+    socket->get_io_service().post(boost::bind(&SocketStream::deliverPipelined,
+					      shared_from_this(), handler));
+    return;
+  }
+
+  socket->async_read_some(buffer(readBuffer, sizeof(readBuffer)), 
+			  boost::bind(&SocketStream::dataReadComplete, shared_from_this(), 
+				      handler, 
+				      placeholders::bytes_transferred, 
+				      placeholders::error));
+}
+
+void SocketStream::dataReadComplete(StreamReadHandler handler, 
+				    std::size_t transferred,
+				    const boost::system::error_code &err)
+{
+  if (err) handler(readBuffer, -1);
+  else     handler(readBuffer, transferred);
+}
+
+void SocketStream::write(unsigned char* buf, int length, StreamWriteHandler handler)
+{
+  async_write(*socket, buffer(buf, length), boost::bind(handler, placeholders::error));
+}
+
+void SocketStream::readv(StreamReadvHandler handler) {
+  if (!pipelined.empty()) {
+    socket->get_io_service().post(boost::bind(&SocketStream::deliverPipelinedv,
+					      shared_from_this(), handler));
+    return;
+  }
+
+  socket->async_read_some(buffer(readBuffer, sizeof(readBuffer)), 
+			  boost::bind(&SocketStream::dataReadvComplete, shared_from_this(), 
+				      handler, 
+				      placeholders::bytes_transferred, 
+				      placeholders::error));
+}
+
+void SocketStream::dataReadvComplete(StreamReadvHandler handler, 
+				     std::size_t transferred,
+				     const boost::system::error_code &err)
+{
+  StreamBuffers buffers;
+
+  if (err) {
+    handler(buffers, -1);
+    return;
+  }
+
+  buffers.push_back(const_buffer(readBuffer, transferred));
+  handler(buffers, transferred);
+}
+
+// Everything a tunnel stream had buffered goes out in one gathered write.
+
+void SocketStream::writev(StreamBuffers &buffers, StreamWriteHandler handler) {
+  async_write(*socket, buffers, boost::bind(handler, placeholders::error));
+}
+
+std::size_t SocketStream::available() {
+  boost::system::error_code err;
+  std::size_t waiting = socket->available(err);
+
+  return (err ? 0 : waiting) + pipelined.size();
+}
+
+void SocketStream::close() {
+  socket->close();
+}
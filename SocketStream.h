@@ -0,0 +1,92 @@
+#ifndef __SOCKET_STREAM_H__
+#define __SOCKET_STREAM_H__
+
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/asio.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/bind.hpp>
+#include <algorithm>
+#include <vector>
+
+#include "ShuffleStream.h"
+
+/***********
+ *
+ * SocketStream is a ShuffleStream over a local client's TCP socket.
+ * Front-ends that read a request off the socket before handing it to
+ * ProxyShuffler can pass whatever they read past the request to
+ * setPipelined(), and it will be delivered by the first read.  A
+ * stream can be reset() onto a new socket so that it can be pooled.
+ *
+ **********/
+
+using namespace boost::asio;
+
+class SocketStream : public ShuffleStream, public boost::enable_shared_from_this<SocketStream> {
+
+ private:
+  static const int READ_BUFFER_LEN = 16 * 1024;
+
+  unsigned char readBuffer[READ_BUFFER_LEN];
+  std::vector<unsigned char> pipelined;
+
+  void deliverPipelined(StreamReadHandler handler);
+  void deliverPipelinedv(StreamReadvHandler handler);
+
+  void dataReadComplete(StreamReadHandler handler, 
+			std::size_t transferred,
+			const boost::system::error_code &err);
+
+  void dataReadvComplete(StreamReadvHandler handler, 
+			 std::size_t transferred,
+			 const boost::system::error_code &err);
+
+ protected:
+  boost::shared_ptr<ip::tcp::socket> socket;
+
+  void setPipelined(const unsigned char *buf, std::size_t length);
+
+ public:
+  SocketStream(boost::shared_ptr<ip::tcp::socket> socket);
+  virtual ~SocketStream() {}
+
+  virtual void reset(boost::shared_ptr<ip::tcp::socket> socket);
+
+  void read(StreamReadHandler handler);
+  void write(unsigned char* buf, int length, StreamWriteHandler handler);
+  void readv(StreamReadvHandler handler);
+  void writev(StreamBuffers &buffers, StreamWriteHandler handler);
+  std::size_t available();
+  void close();
+};
+
+#endif
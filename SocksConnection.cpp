@@ -28,245 +28,422 @@
  */
 
 #include "SocksConnection.h"
+#include "util/Metrics.h"
+#include "util/Probes.h"
 
 using namespace boost::asio;
 
+static Counter requestsParsed("tortunnel_socks_requests_total", "",
+			      "SOCKS requests read from clients.");
+static Counter handshakeErrors("tortunnel_socks_errors_total", "stage=\"handshake\"",
+			       "SOCKS sessions that ended in an error.");
+static Counter connectErrors("tortunnel_socks_errors_total", "stage=\"connect\"",
+			     "SOCKS sessions that ended in an error.");
+
 SocksConnection::SocksConnection(boost::shared_ptr<ip::tcp::socket> socket) 
-  : socket(socket)
+  : SocketStream(socket), state(PARSE_GREETING), version(0), command(0), port(0),
+    requestLength(0), requestOffset(0)
 {}
 				 
+void SocksConnection::reset(boost::shared_ptr<ip::tcp::socket> socket) {
+  SocketStream::reset(socket);
+
+  state         = PARSE_GREETING;
+  parseError    = boost::system::error_code();
+  version       = 0;
+  command       = 0;
+  port          = 0;
+  requestLength = 0;
+  requestOffset = 0;
+
+  host.clear();
+}
+
 void SocksConnection::getRequest(SocksRequestHandler handler) {
-  boost::asio::async_read(*socket, buffer(data, VERSION_HEADER_LEN),
-			  boost::bind(&SocksConnection::readVersionHeaderComplete,
-				      shared_from_this(), handler, 
+  state         = PARSE_GREETING;
+  requestLength = 0;
+  requestOffset = 0;
+
+  readRequest(handler);
+}
+
+void SocksConnection::readRequest(SocksRequestHandler handler) {
+  if (requestLength == sizeof(request)) {
+    handshakeErrors.increment();
+    handler(host, port, boost::asio::error::message_size);
+    return;
+  }
+
+  socket->async_read_some(buffer(request + requestLength, sizeof(request) - requestLength),
+			  boost::bind(&SocksConnection::readRequestComplete,
+				      self(), handler, 
 				      placeholders::error,
 				      placeholders::bytes_transferred));
 }
 
-void SocksConnection::readVersionHeaderComplete(SocksRequestHandler handler, 
-						const boost::system::error_code &err, 
-						std::size_t transferred)
+void SocksConnection::readRequestComplete(SocksRequestHandler handler,
+					  const boost::system::error_code &err,
+					  std::size_t transferred) 
 {
   if (err) {
     handler(host, port, err);
     return;
   }
 
-  assert(transferred == VERSION_HEADER_LEN);
+  requestLength += transferred;
+
+  switch (parseRequest()) {
+  case PARSE_INCOMPLETE: readRequest(handler);                  break;
+  case PARSE_ERROR:      
+    handshakeErrors.increment();
+    handler(host, port, parseError);
+    break;
+  case PARSE_COMPLETE:   
+    state = PARSE_DONE;
+    requestsParsed.increment();
+    PROBE3(socks_request, socket->native(), host.c_str(), port);
+
+    // Whatever the client sent behind its request goes to the first read.
+    if (requestOffset < requestLength)
+      setPipelined(request + requestOffset, requestLength - requestOffset);
+
+    handler(host, port, boost::system::error_code());
+    break;
+  }
+}
+
+// Each parse step either consumes a complete message from the request
+// buffer and advances requestOffset past it, or leaves everything in
+// place and asks for more bytes.
 
-  version     = data[0];
-  methodCount = data[1];
+SocksConnection::ParseResult SocksConnection::parseRequest() {
+  if (state == PARSE_GREETING) {
+    if (requestLength - requestOffset < 1)
+      return PARSE_INCOMPLETE;
 
-  if (version != 0x05) {
-    handler(host, port, boost::asio::error::access_denied);
-    return;
+    version = request[requestOffset];
+
+    if (version == SOCKS4_VERSION) 
+      return parseSocks4Request();
+
+    if (version != SOCKS5_VERSION) {
+      parseError = boost::asio::error::invalid_argument;
+      return PARSE_ERROR;
+    }
+
+    ParseResult result = parseSocks5Greeting();
+
+    if (result != PARSE_COMPLETE)
+      return result;
+
+    state = PARSE_REQUEST;
   }
 
-  assert(methodCount < sizeof(data));
+  return parseSocks5Request();
+}
+
+const unsigned char* SocksConnection::findTerminator(std::size_t offset) {
+  if (offset >= requestLength) return NULL;
 
-  boost::asio::async_read(*socket, buffer(data, methodCount),
-			  boost::bind(&SocksConnection::readMethodComplete,
-				      shared_from_this(), handler, 
-				      placeholders::error,
-				      placeholders::bytes_transferred));  
+  return (const unsigned char*)memchr(request + offset, 0x00, requestLength - offset);
 }
 
-void SocksConnection::readMethodComplete(SocksRequestHandler handler, 
-					 const boost::system::error_code &err, 
-					 std::size_t transferred)
-{
-  if (err) {
-    handler(host, port, err);
-    return;
+// SOCKS4 is VN CD DSTPORT DSTIP USERID NUL, and SOCKS4a signals a
+// hostname by giving a DSTIP of 0.0.0.x, with the hostname and another
+// NUL following the user ID.
+
+SocksConnection::ParseResult SocksConnection::parseSocks4Request() {
+  const unsigned char *message = request + requestOffset;
+  std::size_t length           = requestLength - requestOffset;
+
+  if (length < 8)
+    return PARSE_INCOMPLETE;
+
+  const unsigned char *userEnd = findTerminator(requestOffset + 8);
+  const unsigned char *end     = userEnd;
+
+  if (userEnd == NULL) 
+    return PARSE_INCOMPLETE;
+
+  command = message[1];
+  port    = Util::bigEndianArrayToShort((unsigned char*)message + 2);
+
+  if (message[4] == 0 && message[5] == 0 && message[6] == 0 && message[7] != 0) {
+    end = findTerminator((userEnd + 1) - request);
+
+    if (end == NULL)
+      return PARSE_INCOMPLETE;
+
+    host = std::string((const char*)userEnd + 1, end - (userEnd + 1));
+  } else {
+    boost::array<unsigned char, 4> hostBytes = {{message[4], message[5], message[6], message[7]}};
+    host = ip::address_v4(hostBytes).to_string();
   }
-  
-  assert(transferred == methodCount);
 
-  int i;
-  for (i=0;i<methodCount;i++) {
-    if (data[i] == 0x00) {
-      sendValidMethodResponse(handler);
-      return;
-    }
+  requestOffset = (end + 1) - request;
+
+  if (host.empty()) {
+    respondSocks4(SOCKS4_REJECTED, NULL, 0);
+    parseError = boost::asio::error::invalid_argument;
+    return PARSE_ERROR;
   }
 
-  handler(host, port, boost::asio::error::access_denied);  
+  if (command != CONNECT_COMMAND && command != RESOLVE_COMMAND) {
+    respondSocks4(SOCKS4_REJECTED, NULL, 0);
+    parseError = boost::asio::error::operation_not_supported;
+    return PARSE_ERROR;
+  }
+
+  return PARSE_COMPLETE;
 }
 
-void SocksConnection::sendValidMethodResponse(SocksRequestHandler handler) {
-  data[0] = 0x05;
-  data[1] = 0x00;
+SocksConnection::ParseResult SocksConnection::parseSocks5Greeting() {
+  const unsigned char *message = request + requestOffset;
+  std::size_t length           = requestLength - requestOffset;
 
-  async_write(*socket, boost::asio::buffer(data, METHOD_RESPONSE_LEN),
-	      boost::bind(&SocksConnection::methodResponseComplete, shared_from_this(),
-			  handler, placeholders::error, placeholders::bytes_transferred));
-}
+  if (length < 2)
+    return PARSE_INCOMPLETE;
 
-void SocksConnection::methodResponseComplete(SocksRequestHandler handler, 
-					     const boost::system::error_code &err,
-					     std::size_t transferred) 
-{
-  
+  std::size_t methodCount = message[1];
 
-  if (err) handler(host, port, err);
-  else     getConnectionRequest(handler);
-}
+  if (length < 2 + methodCount)
+    return PARSE_INCOMPLETE;
 
+  requestOffset += 2 + methodCount;
 
-void SocksConnection::getConnectionRequest(SocksRequestHandler handler) {
-  async_read(*socket, boost::asio::buffer(data, REQUEST_HEADER_LEN),
-	     boost::bind(&SocksConnection::readRequestComplete, shared_from_this(),
-			 handler, placeholders::error, placeholders::bytes_transferred));
+  for (std::size_t i=0;i<methodCount;i++) {
+    if (message[2 + i] == NO_AUTH_METHOD) {
+      sendMethodResponse(NO_AUTH_METHOD);
+      return PARSE_COMPLETE;
+    }
+  }
+
+  sendMethodResponse(NO_METHOD);
+  parseError = boost::asio::error::access_denied;
+  return PARSE_ERROR;
 }
 
+SocksConnection::ParseResult SocksConnection::parseSocks5Request() {
+  const unsigned char *message = request + requestOffset;
+  std::size_t length           = requestLength - requestOffset;
+  std::size_t addressLength;
 
-void SocksConnection::readRequestComplete(SocksRequestHandler handler,
-					  const boost::system::error_code &err,
-					  std::size_t transferred) 
-{
-  if (err) {
-    handler(host, port, err);
-    return;
+  if (length < 4)
+    return PARSE_INCOMPLETE;
+
+  if (message[0] != SOCKS5_VERSION || message[2] != 0x00) {
+    sendSocks5Error(SOCKS5_GENERAL_FAILURE);
+    parseError = boost::asio::error::invalid_argument;
+    return PARSE_ERROR;
   }
-  
-  assert(transferred == REQUEST_HEADER_LEN);
-  assert(data[0] == 0x05);
-  assert(data[2] == 0x00);
 
-  command     = data[1];
-  addressType = data[3];
+  command = message[1];
   
-  if (command != 0x01) {
-    handler(host, port, boost::asio::error::access_denied);
-    return;
-  }  
+  // Besides CONNECT we take Tor's RESOLVE and RESOLVE_PTR extensions,
+  // which ask for a name lookup through the exit instead of a stream.
+  if (command != CONNECT_COMMAND && command != RESOLVE_COMMAND && 
+      command != RESOLVE_PTR_COMMAND) 
+    {
+      sendSocks5Error(SOCKS5_COMMAND_UNSUPPORTED);
+      parseError = boost::asio::error::operation_not_supported;
+      return PARSE_ERROR;
+    }  
+
+  switch (message[3]) {
+  case IPV4_ADDRESS:
+    addressLength = 4;
+    break;
+  case IPV6_ADDRESS:
+    addressLength = 16;
+    break;
+  case DOMAIN_ADDRESS:
+    if (length < 5) 
+      return PARSE_INCOMPLETE;
+
+    addressLength = 1 + message[4];
+
+    if (addressLength == 1) {
+      sendSocks5Error(SOCKS5_GENERAL_FAILURE);
+      parseError = boost::asio::error::invalid_argument;
+      return PARSE_ERROR;
+    }
 
-  if      (addressType == 0x01) readIPv4Address(handler);
-  else if (addressType == 0x03) readDomainAddress(handler);
-  else                          handler(host, port, boost::asio::error::access_denied);  
-}
+    break;
+  default:
+    sendSocks5Error(SOCKS5_ADDRESS_UNSUPPORTED);
+    parseError = boost::asio::error::operation_not_supported;
+    return PARSE_ERROR;
+  }
 
-void SocksConnection::readDomainAddressComplete(SocksRequestHandler handler,
-						const boost::system::error_code &err,
-						std::size_t transferred)
-{
-  if (err) {
-    handler(host, port, err);
-    return;
+  if (length < 4 + addressLength + 2)
+    return PARSE_INCOMPLETE;
+
+  const unsigned char *address = message + 4;
+
+  if (message[3] == IPV4_ADDRESS) {
+    boost::array<unsigned char, 4> hostBytes;
+    memcpy(hostBytes.data(), address, hostBytes.size());
+    host = ip::address_v4(hostBytes).to_string();
+  } else if (message[3] == IPV6_ADDRESS) {
+    boost::array<unsigned char, 16> hostBytes;
+    memcpy(hostBytes.data(), address, hostBytes.size());
+    host = ip::address_v6(hostBytes).to_string();
+  } else {
+    host = std::string((const char*)address + 1, addressLength - 1);
   }
 
-  assert(transferred == domainAddressLength + 2);
+  port           = Util::bigEndianArrayToShort((unsigned char*)address + addressLength);
+  requestOffset += 4 + addressLength + 2;
 
-  host = std::string((const char*)data, (std::size_t)domainAddressLength);
-  port = Util::bigEndianArrayToShort(data+domainAddressLength);
+  return PARSE_COMPLETE;
+}
 
-  handler(host, port, err);
+void SocksConnection::sendMethodResponse(unsigned char method) {
+  methodResponse[0] = SOCKS5_VERSION;
+  methodResponse[1] = method;
+
+  async_write(*socket, boost::asio::buffer(methodResponse, sizeof(methodResponse)),
+	      boost::bind(&SocksConnection::methodResponseComplete, self(),
+			  placeholders::error));
 }
 
-void SocksConnection::readDomainAddressHeaderComplete(SocksRequestHandler handler,
-						      const boost::system::error_code &err,
-						      std::size_t transferred)
-{
-  if (err) {
-    handler(host, port, err);
-    return;
-  }
+// A failed method response shows up as an error on the next read or
+// write, so there's nothing to do with it here.
 
-  assert(transferred == DOMAIN_ADDRESS_HEADER_LEN);
+void SocksConnection::methodResponseComplete(const boost::system::error_code &err) {}
 
-  domainAddressLength = data[0];
+void SocksConnection::sendSocks5Error(unsigned char reply) {
+  memset(data, 0, 10);
+  data[0] = SOCKS5_VERSION;
+  data[1] = reply;
+  data[3] = IPV4_ADDRESS;
 
-  async_read(*socket, buffer(data, domainAddressLength + 2),
-	     boost::bind(&SocksConnection::readDomainAddressComplete, shared_from_this(),
-			 handler, placeholders::error, placeholders::bytes_transferred));
+  async_write(*socket, buffer(data, 10), 
+	      boost::bind(&SocksConnection::respondComplete,
+			  self(), placeholders::error));
 }
 
-void SocksConnection::readDomainAddress(SocksRequestHandler handler) {
-  async_read(*socket, buffer(data, DOMAIN_ADDRESS_HEADER_LEN), 
-	     boost::bind(&SocksConnection::readDomainAddressHeaderComplete, shared_from_this(),
-			 handler, placeholders::error, placeholders::bytes_transferred));
+boost::shared_ptr<SocksConnection> SocksConnection::self() {
+  return boost::static_pointer_cast<SocksConnection>(shared_from_this());
 }
 
-void SocksConnection::readIPv4Address(SocksRequestHandler handler) {
-  async_read(*socket, buffer(data, IPV4_ADDRESS_LEN), 
-	     boost::bind(&SocksConnection::readIPv4AddressComplete,
-			 shared_from_this(), handler, 
-			 placeholders::error, 
-			 placeholders::bytes_transferred));
-}
-				      
-void SocksConnection::readIPv4AddressComplete(SocksRequestHandler handler,
-					      const boost::system::error_code &err,
-					      std::size_t transferred) 
+void SocksConnection::respondComplete(const boost::system::error_code &err) {}
+
+void SocksConnection::respondSocks4(unsigned char status, const unsigned char *address, 
+				    uint16_t port) 
 {
-  if (err) {
-    handler(host, port, err);
+  data[0] = 0x00;
+  data[1] = status;
+
+  Util::int16ToArrayBigEndian(data+2, port);
+
+  if (address != NULL) memcpy(data+4, address, 4);
+  else                 memset(data+4, 0, 4);
+
+  async_write(*socket, buffer(data, 8), 
+	      boost::bind(&SocksConnection::respondComplete,
+			  self(), placeholders::error));
+}
+
+void SocksConnection::respondConnected(ip::tcp::endpoint local) {
+  int length = 4;
+
+  if (version == SOCKS4_VERSION) {
+    boost::array<unsigned char, 4> localAddress = {{0, 0, 0, 0}};
+
+    if (local.address().is_v4()) 
+      localAddress = local.address().to_v4().to_bytes();
+
+    respondSocks4(SOCKS4_GRANTED, localAddress.data(), local.port());
     return;
   }
 
-  assert(transferred == IPV4_ADDRESS_LEN);
+  data[0] = SOCKS5_VERSION;
+  data[1] = 0x00;
+  data[2] = 0x00;
 
-  boost::array<unsigned char, 4> hostBytes = {data[0], data[1], data[2], data[3]};
-  host                                     = ip::address_v4(hostBytes).to_string();
-  port                                     = Util::bigEndianArrayToShort(data+4);
+  if (local.address().is_v6()) {
+    boost::array<unsigned char, 16> localAddress = local.address().to_v6().to_bytes();
+    data[3] = IPV6_ADDRESS;
+    memcpy(data + length, localAddress.data(), localAddress.size());
+    length += localAddress.size();
+  } else {
+    boost::array<unsigned char, 4> localAddress = local.address().to_v4().to_bytes();
+    data[3] = IPV4_ADDRESS;
+    memcpy(data + length, localAddress.data(), localAddress.size());
+    length += localAddress.size();
+  }
 
-  handler(host, port, err);
-}
+  Util::int16ToArrayBigEndian(data + length, local.port());
+  length += 2;
 
-void SocksConnection::read(StreamReadHandler handler) {
-  socket->async_read_some(buffer(data, sizeof(data)), 
-			  boost::bind(&SocksConnection::dataReadComplete, shared_from_this(), 
-				      handler, 
-				      placeholders::bytes_transferred, 
-				      placeholders::error));
+  async_write(*socket, buffer(data, length), 
+	      boost::bind(&SocksConnection::respondComplete,
+			  self(), placeholders::error));  
 }
 
-void SocksConnection::dataReadComplete(StreamReadHandler handler, 
-				       std::size_t transferred,
-				       const boost::system::error_code &err)
-{
-  if (err) handler(data, -1);
-  else     handler(data, transferred);
-}
 
-void SocksConnection::write(unsigned char* buf, int length, StreamWriteHandler handler)
-{
-  async_write(*socket, buffer(buf, length), boost::bind(handler, placeholders::error));
+unsigned char SocksConnection::getCommand() {
+  return command;
 }
 
-void SocksConnection::close() {
-  socket->close();
-}
+void SocksConnection::respondResolved(ResolvedAnswer &answer) {
+  int length = 4;
 
-void SocksConnection::respondConnectedComplete(const boost::system::error_code &err) {}
+  // SOCKS4a can only carry an IPv4 answer back in its reply.
+  if (version == SOCKS4_VERSION) {
+    if (answer.type != ResolvedAnswer::IPV4_TYPE) {
+      respondSocks4(SOCKS4_REJECTED, NULL, 0);
+      return;
+    }
 
-void SocksConnection::respondConnected(ip::tcp::endpoint local) {
-  data[0] = 0x05;
+    boost::array<unsigned char, 4> address = ip::address_v4::from_string(answer.value).to_bytes();
+    respondSocks4(SOCKS4_GRANTED, address.data(), 0);
+    return;
+  }
+
+  data[0] = SOCKS5_VERSION;
   data[1] = 0x00;
   data[2] = 0x00;
-  data[3] = 0x01;
 
-  boost::array< unsigned char, 4 > localAddress = local.address().to_v4().to_bytes();
-  data[4] = localAddress[0];
-  data[5] = localAddress[1];
-  data[6] = localAddress[2];
-  data[7] = localAddress[3];
+  if (answer.type == ResolvedAnswer::IPV4_TYPE) {
+    boost::array<unsigned char, 4> address = ip::address_v4::from_string(answer.value).to_bytes();
+    data[3] = IPV4_ADDRESS;
+    memcpy(data + length, address.data(), address.size());
+    length += address.size();
+  } else if (answer.type == ResolvedAnswer::IPV6_TYPE) {
+    boost::array<unsigned char, 16> address = ip::address_v6::from_string(answer.value).to_bytes();
+    data[3] = IPV6_ADDRESS;
+    memcpy(data + length, address.data(), address.size());
+    length += address.size();
+  } else {
+    std::size_t nameLength = answer.value.length() > 255 ? 255 : answer.value.length();
+    data[3] = DOMAIN_ADDRESS;
+    data[4] = (unsigned char)nameLength;
+    memcpy(data + 5, answer.value.data(), nameLength);
+    length += 1 + nameLength;
+  }
 
-  Util::int16ToArrayBigEndian(data+8, local.port());
+  Util::int16ToArrayBigEndian(data + length, 0);
+  length += 2;
 
-  async_write(*socket, buffer(data, 10), 
-	      boost::bind(&SocksConnection::respondConnectedComplete,
-			  shared_from_this(), placeholders::error));  
+  async_write(*socket, buffer(data, length), 
+	      boost::bind(&SocksConnection::respondComplete,
+			  self(), placeholders::error));  
 }
 
+void SocksConnection::respondConnectError() {
+  connectErrors.increment();
 
-void SocksConnection::respondConnectErrorComplete(const boost::system::error_code &err) {}
+  if (version == SOCKS4_VERSION) {
+    respondSocks4(SOCKS4_REJECTED, NULL, 0);
+    return;
+  }
 
-void SocksConnection::respondConnectError() {
-  data[0] = 0x05;
-  data[1] = 0x04;
+  data[0] = SOCKS5_VERSION;
+  data[1] = SOCKS5_HOST_UNREACHABLE;
   data[2] = 0x00;
-  data[3] = 0x01;
+  data[3] = IPV4_ADDRESS;
   data[4] = 0x7F;
   data[5] = 0x00;
   data[6] = 0x00;
@@ -275,6 +452,6 @@ void SocksConnection::respondConnectError() {
   data[9] = 0x00;
 
   async_write(*socket, buffer(data, 10), 
-	      boost::bind(&SocksConnection::respondConnectErrorComplete,
-			  shared_from_this(), placeholders::error));
+	      boost::bind(&SocksConnection::respondComplete,
+			  self(), placeholders::error));
 }
@@ -35,16 +35,20 @@
 #include <boost/asio.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/bind.hpp>
-#include <cassert>
 #include <iostream>
 #include <string>
 
 #include "util/Util.h"
-#include "ShuffleStream.h"
+#include "SocketStream.h"
+#include "protocol/RelayResolvedCell.h"
 
 /***********
  *
  * This class implements a SOCKS connection to a requesting client.
+ * SOCKS4, SOCKS4a, and SOCKS5 handshakes are parsed incrementally out
+ * of a single buffer, so a client that sends its greeting and request
+ * (and even its first data) together is handled in one read.  Anything
+ * the client sent past its request is handed to the first read().
  *
  **********/
 
@@ -52,77 +56,89 @@ using namespace boost::asio;
 
 typedef boost::function<void (std::string &host, uint16_t port, const boost::system::error_code &error)> SocksRequestHandler;
 
-class SocksConnection : public ShuffleStream, public boost::enable_shared_from_this<SocksConnection> {
+class SocksConnection : public SocketStream {
 
  private:
-  boost::shared_ptr<ip::tcp::socket> socket;
+  static const int REQUEST_BUFFER_LEN        = 1024;
 
-  static const int VERSION_HEADER_LEN        = 2;
-  static const int METHOD_RESPONSE_LEN       = 2;
-  static const int REQUEST_HEADER_LEN        = 4;
-  static const int DOMAIN_ADDRESS_HEADER_LEN = 1;
-  static const int IPV4_ADDRESS_LEN          = 6;
+  static const unsigned char SOCKS4_VERSION  = 0x04;
+  static const unsigned char SOCKS5_VERSION  = 0x05;
 
+  static const unsigned char NO_AUTH_METHOD  = 0x00;
+  static const unsigned char NO_METHOD       = 0xFF;
+
+  static const unsigned char IPV4_ADDRESS    = 0x01;
+  static const unsigned char DOMAIN_ADDRESS  = 0x03;
+  static const unsigned char IPV6_ADDRESS    = 0x04;
+
+  static const unsigned char SOCKS5_GENERAL_FAILURE       = 0x01;
+  static const unsigned char SOCKS5_HOST_UNREACHABLE      = 0x04;
+  static const unsigned char SOCKS5_COMMAND_UNSUPPORTED   = 0x07;
+  static const unsigned char SOCKS5_ADDRESS_UNSUPPORTED   = 0x08;
+
+  static const unsigned char SOCKS4_GRANTED  = 0x5A;
+  static const unsigned char SOCKS4_REJECTED = 0x5B;
+
+  enum ParseState {
+    PARSE_GREETING,
+    PARSE_REQUEST,
+    PARSE_DONE
+  };
+
+  enum ParseResult {
+    PARSE_INCOMPLETE,
+    PARSE_COMPLETE,
+    PARSE_ERROR
+  };
+
+  ParseState state;
+  boost::system::error_code parseError;
   unsigned char version;
-  unsigned char methodCount;
   unsigned char command;
-  unsigned char addressType;
-  unsigned char domainAddressLength;
   
   std::string host;
   uint16_t port;
-  unsigned char data[512];
-
-  void readVersionHeaderComplete(SocksRequestHandler handler, 
-				 const boost::system::error_code &err, 
-				 std::size_t transferred);
 
-  void readMethodComplete(SocksRequestHandler handler, 
-			  const boost::system::error_code &err, 
-			  std::size_t transferred);
+  unsigned char request[REQUEST_BUFFER_LEN];
+  std::size_t requestLength;
+  std::size_t requestOffset;
 
-  void sendValidMethodResponse(SocksRequestHandler handler);
+  unsigned char methodResponse[2];
+  unsigned char data[512];
 
-  void methodResponseComplete(SocksRequestHandler handler, 
-			      const boost::system::error_code &err,
-			      std::size_t transferred); 
+  void readRequest(SocksRequestHandler handler);
   void readRequestComplete(SocksRequestHandler handler,
 			   const boost::system::error_code &err,
 			   std::size_t transferred);
 
-  void getConnectionRequest(SocksRequestHandler handler);
-
-  void readDomainAddressComplete(SocksRequestHandler handler,
-				 const boost::system::error_code &err,
-				 std::size_t transferred);
-
-  void readDomainAddressHeaderComplete(SocksRequestHandler handler,
-				       const boost::system::error_code &err,
-				       std::size_t transferred);
-
-  void readDomainAddress(SocksRequestHandler handler);
-  void readIPv4Address(SocksRequestHandler handler);
+  ParseResult parseRequest();
+  ParseResult parseSocks4Request();
+  ParseResult parseSocks5Greeting();
+  ParseResult parseSocks5Request();
+  const unsigned char* findTerminator(std::size_t offset);
 
-  void readIPv4AddressComplete(SocksRequestHandler handler,
-			       const boost::system::error_code &err,
-			       std::size_t transferred);
+  void sendMethodResponse(unsigned char method);
+  void methodResponseComplete(const boost::system::error_code &err);
+  void sendSocks5Error(unsigned char reply);
 
-  void read(StreamReadHandler handler);
+  boost::shared_ptr<SocksConnection> self();
 
-  void dataReadComplete(StreamReadHandler handler, 
-			std::size_t transferred,
-			const boost::system::error_code &err);
-
-  void write(unsigned char* buf, int length, StreamWriteHandler handler);
-  void respondConnectErrorComplete(const boost::system::error_code &err);
-  void respondConnectedComplete(const boost::system::error_code &err);
+  void respondComplete(const boost::system::error_code &err);
+  void respondSocks4(unsigned char status, const unsigned char *address, uint16_t port);
 
  public:
+  static const unsigned char CONNECT_COMMAND     = 0x01;
+  static const unsigned char RESOLVE_COMMAND     = 0xF0;
+  static const unsigned char RESOLVE_PTR_COMMAND = 0xF1;
+
   SocksConnection(boost::shared_ptr<ip::tcp::socket> socket);
   void getRequest(SocksRequestHandler handler);
+  unsigned char getCommand();
   void respondConnectError();
   void respondConnected(ip::tcp::endpoint local);
-  void close();
+  void respondResolved(ResolvedAnswer &answer);
+
+  void reset(boost::shared_ptr<ip::tcp::socket> socket);
 };
 
 
@@ -0,0 +1,136 @@
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "Supervisor.h"
+#include "util/Log.h"
+
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <cstdlib>
+#include <iostream>
+
+volatile sig_atomic_t Supervisor::stopping = 0;
+
+Supervisor::Supervisor(uint32_t workerCount, WorkerFunction worker)
+  : workerCount(workerCount), worker(worker)
+{}
+
+void Supervisor::handleSignal(int signal) {
+  stopping = signal;
+}
+
+bool Supervisor::startWorker() {
+  Log::stop();
+
+  pid_t pid = fork();
+
+  Log::start();
+
+  if (pid < 0) {
+    LOG(Log::ERROR) << "Unable to fork worker: " << strerror(errno);
+    return false;
+  }
+
+  if (pid == 0) {
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    exit(worker());
+  }
+
+  LOG(Log::INFO) << "Started worker " << pid << ".";
+  workers[pid] = time(NULL);
+
+  return true;
+}
+
+void Supervisor::stopWorkers(int signal) {
+  std::map<pid_t, time_t>::iterator iter;
+
+  for (iter = workers.begin(); iter != workers.end(); iter++)
+    kill(iter->first, signal);
+
+  while (!workers.empty()) {
+    pid_t pid = waitpid(-1, NULL, 0);
+
+    if      (pid > 0)          workers.erase(pid);
+    else if (errno != EINTR)   break;
+  }
+}
+
+int Supervisor::run() {
+  struct sigaction action;
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = handleSignal;
+  sigemptyset(&action.sa_mask);
+
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  for (uint32_t i=0;i<workerCount;i++)
+    startWorker();
+
+  while (!stopping) {
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+
+    if (pid < 0) {
+      if (errno == EINTR) continue;
+
+      LOG(Log::ERROR) << "Lost track of workers: " << strerror(errno);
+      return 1;
+    }
+
+    std::map<pid_t, time_t>::iterator iter = workers.find(pid);
+
+    if (iter == workers.end()) continue;
+
+    time_t started = iter->second;
+    workers.erase(iter);
+
+    if (WIFSIGNALED(status)) LOG(Log::WARNING) << "Worker " << pid << " killed by signal " 
+					       << WTERMSIG(status) << ", restarting.";
+    else                     LOG(Log::WARNING) << "Worker " << pid << " exited with status " 
+					       << WEXITSTATUS(status) << ", restarting.";
+
+    if (time(NULL) - started < (time_t)MIN_WORKER_LIFETIME)
+      sleep(RESTART_DELAY);
+
+    if (!stopping) startWorker();
+  }
+
+  LOG(Log::INFO) << "Stopping workers...";
+  stopWorkers(stopping);
+
+  return 0;
+}
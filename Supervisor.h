@@ -0,0 +1,75 @@
+#ifndef __SUPERVISOR_H__
+#define __SUPERVISOR_H__
+
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <boost/function.hpp>
+#include <sys/types.h>
+#include <signal.h>
+#include <time.h>
+#include <stdint.h>
+#include <map>
+
+/***********
+ *
+ * Supervisor forks a number of worker processes, each of which runs
+ * the worker function and exits with what it returns, and replaces
+ * any worker that dies.  A worker that dies right after starting is
+ * replaced after a pause, so a worker that can't start doesn't spin.
+ * SIGINT or SIGTERM to the supervisor is passed on to the workers.
+ *
+ **********/
+
+typedef boost::function<int ()> WorkerFunction;
+
+class Supervisor {
+
+ private:
+  static const uint32_t MIN_WORKER_LIFETIME = 5;
+  static const uint32_t RESTART_DELAY       = 1;
+
+  static volatile sig_atomic_t stopping;
+
+  uint32_t workerCount;
+  WorkerFunction worker;
+  std::map<pid_t, time_t> workers;
+
+  bool startWorker();
+  void stopWorkers(int signal);
+
+  static void handleSignal(int signal);
+
+ public:
+  Supervisor(uint32_t workerCount, WorkerFunction worker);
+
+  int run();
+};
+
+#endif
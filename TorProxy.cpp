@@ -29,111 +29,288 @@
 
 #include "TorProxy.h"
 
+#ifdef __linux__
+#include <netinet/tcp.h>
+#endif
+
 using namespace boost::asio;
 
-TorProxy::TorProxy(TorTunnel *tunnel, io_service &io_service, int listenPort)
-  : acceptor(io_service, ip::tcp::endpoint(ip::tcp::v4(), listenPort)),
-    tunnel(tunnel)
+static const uint64_t BURST_BUCKETS[] = {1, 2, 4, 8, 16, 32, 64};
+
+static Counter connectionsAccepted("tortunnel_connections_accepted_total", "",
+				   "SOCKS connections accepted.");
+static Counter acceptFailures("tortunnel_accept_errors_total", "",
+			      "Failed accepts on the SOCKS port.");
+static Histogram acceptBursts("tortunnel_accept_burst", "",
+			      "Connections taken off the listen queue per wakeup.",
+			      BURST_BUCKETS, sizeof(BURST_BUCKETS) / sizeof(uint64_t));
+
+HANDLER_TAG(acceptHandler, "proxy.accept");
+
+const uint32_t TorProxy::REPORT_INTERVAL;
+const uint32_t TorProxy::MAX_DRAIN;
+
+// With reusePort, several worker processes each bind their own acceptor
+// to the same port, and the kernel spreads new connections among them.
+
+TorProxy::TorProxy(io_service &io_service, int listenPort, bool reusePort,
+		   uint32_t acceptCount)
+  : acceptor(io_service), nextShard(0), acceptCount(acceptCount), accepting(false), 
+    backoff(io_service, boost::bind(&TorProxy::acceptIncomingConnection, this)),
+    reportTimer(io_service), reportedAccepted(0), acceptErrors(0),
+    maxBurst(0), maxBacklog(-1)
 {
-  acceptIncomingConnection();
+  ip::tcp::endpoint endpoint(ip::tcp::v4(), listenPort);
+
+  acceptor.open(endpoint.protocol());
+  acceptor.set_option(ip::tcp::acceptor::reuse_address(true));
+
+#ifdef SO_REUSEPORT
+  if (reusePort) acceptor.set_option(reuse_port(true));
+#endif
+
+  acceptor.bind(endpoint);
+  acceptor.listen();
+
+  // The listener is left non-blocking so that drainIncomingConnections()
+  // can accept until the queue is empty without ever waiting on it.
+  int flags = fcntl(acceptor.native(), F_GETFL, 0);
+  fcntl(acceptor.native(), F_SETFL, flags | O_NONBLOCK);
+}
+
+bool TorProxy::isReusePortSupported() {
+#ifdef SO_REUSEPORT
+  return true;
+#else
+  return false;
+#endif
+}
+
+void TorProxy::addShard(ProxyShard *shard) {
+  shards.push_back(shard);
+}
+
+// Connections are only accepted once there's a shard with a tunnel up
+// to take them.
+
+void TorProxy::shardReady(ProxyShard *shard) {
+  shard->setReady();
+
+  if (accepting) return;
+
+  accepting = true;
+
+  for (uint32_t i=0;i<acceptCount;i++)
+    acceptIncomingConnection();
+
+  scheduleReport();
+}
+
+ProxyShard* TorProxy::selectShard() {
+  ProxyShard *selected = NULL;
+
+  // Starting the scan somewhere different each time spreads connections
+  // across shards that are equally loaded.
+  for (uint32_t i=0;i<shards.size();i++) {
+    ProxyShard *shard = shards[(nextShard + i) % shards.size()];
+
+    if (!shard->isReady()) continue;
+
+    if (selected == NULL || shard->getSessions() < selected->getSessions())
+      selected = shard;
+  }
+
+  nextShard = (nextShard + 1) % shards.size();
+
+  return selected;
+}
+
+// Returns the number of connections waiting in the listen queue, or -1
+// where the platform won't say.
+
+int TorProxy::getBacklog() {
+#if defined(__linux__) && defined(TCP_INFO)
+  struct tcp_info info;
+  socklen_t length = sizeof(info);
+
+  if (getsockopt(acceptor.native(), IPPROTO_TCP, TCP_INFO, &info, &length) == 0)
+    return info.tcpi_unacked;
+#endif
+
+  return -1;
 }
 
 void TorProxy::acceptIncomingConnection() {
-  boost::shared_ptr<ip::tcp::socket> socket(new ip::tcp::socket(acceptor.get_io_service()));
-  acceptor.async_accept(*socket, boost::bind(&TorProxy::handleIncomingConnection,
-					     this, socket, placeholders::error));
+  ProxyShard *shard = selectShard();
+
+  boost::shared_ptr<ip::tcp::socket> socket = shard->acquireSocket();
+  acceptor.async_accept(*socket, LoopProfiler::wrap(acceptHandler,
+						    boost::bind(&TorProxy::handleIncomingConnection,
+								this, shard, socket, 
+								placeholders::error)));
 }
 
-void TorProxy::handleIncomingConnection(boost::shared_ptr<ip::tcp::socket> socket,
+void TorProxy::handleIncomingConnection(ProxyShard *shard,
+					boost::shared_ptr<ip::tcp::socket> socket,
 					const boost::system::error_code &err) 
 {
   if (err) {
-    std::cerr << "Error accepting incoming connection: " << err << std::endl;
-    acceptIncomingConnection();
+    LOG(Log::WARNING) << "Error accepting incoming connection: " << err;
+    acceptErrors++;
+    acceptFailures.increment();
+    backoff.pause();
     return;
   }
 
-  std::cerr << "Got SOCKS Connection..." << std::endl;
+  int backlog = getBacklog();
+
+  if (backlog > maxBacklog) 
+    maxBacklog = backlog;
 
-  boost::shared_ptr<SocksConnection> connection(new SocksConnection(socket));
-  connection->getRequest(boost::bind(&TorProxy::handleSocksRequest, this,
-				     connection, _1, _2, _3));
+  PROBE2(socks_accept, socket->native(), backlog);
+  shard->dispatch(socket);
+  drainIncomingConnections();
 
   acceptIncomingConnection();
 }
 
-void TorProxy::handleSocksRequest(boost::shared_ptr<SocksConnection> connection,
-				  std::string &host,
-				  uint16_t port,
-				  const boost::system::error_code &err)
-{
-  std::cerr << "Got SOCKS Request: " << host << ":" << port << std::endl;
+// During a burst, the reactor would otherwise go around once for every
+// queued connection.  Taking them straight off the listener here costs
+// one failed accept() when there's nothing else waiting.  MAX_DRAIN
+// keeps a storm from starving everything else on this io_service.
+
+void TorProxy::drainIncomingConnections() {
+  uint32_t burst = 1;
+
+  while (burst < MAX_DRAIN) {
+    int fd = ::accept(acceptor.native(), NULL, NULL);
+
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+	LOG(Log::WARNING) << "Error accepting incoming connection: " << strerror(errno);
+	acceptErrors++;
+	acceptFailures.increment();
+      }
+
+      break;
+    }
+
+    ProxyShard *shard = selectShard();
+    boost::shared_ptr<ip::tcp::socket> socket = shard->acquireSocket();
+    boost::system::error_code err;
+
+    socket->assign(ip::tcp::v4(), fd, err);
 
-  if (err) connection->close();
-  else     tunnel->openStream(host, port, boost::bind(&TorProxy::handleStreamOpen,
-						      this, connection, _1, _2));
+    if (err) {
+      LOG(Log::WARNING) << "Error accepting incoming connection: " << err;
+      acceptErrors++;
+      acceptFailures.increment();
+      ::close(fd);
+      continue;
+    }
+
+    PROBE2(socks_accept, fd, -1);
+    shard->dispatch(socket);
+    burst++;
+  }
+
+  connectionsAccepted.increment(burst);
+  acceptBursts.observe(burst);
+
+  if (burst > maxBurst) 
+    maxBurst = burst;
 }
 
-void TorProxy::handleStreamOpen(boost::shared_ptr<SocksConnection> socks,
-				boost::shared_ptr<TorTunnelStream> stream,
-				const boost::system::error_code &err)
-{
-  if (err) {
-    std::cerr << "Error opening stream: " << err << std::endl;
-    socks->respondConnectError();
-    socks->close();
-    return;
+void TorProxy::scheduleReport() {
+  reportTimer.expires_from_now(boost::posix_time::seconds(REPORT_INTERVAL));
+  reportTimer.async_wait(boost::bind(&TorProxy::report, this, placeholders::error));
+}
+
+void TorProxy::report(const boost::system::error_code &err) {
+  if (err == boost::asio::error::operation_aborted) return;
+
+  long accepted = 0;
+
+  for (uint32_t i=0;i<shards.size();i++)
+    accepted += shards[i]->getAccepted();
+
+  if (accepted != reportedAccepted) {
+    LOG(Log::INFO) << "Accepted connections"
+		   << Log::field("pid", getpid())
+		   << Log::field("total", accepted)
+		   << Log::field("rate", (accepted - reportedAccepted) / (long)REPORT_INTERVAL)
+		   << Log::field("burst", maxBurst)
+		   << Log::field("backlog", maxBacklog)
+		   << Log::field("errors", acceptErrors);
   }
 
-  std::cerr << "Successfully opened Tor exit Node stream..." << std::endl;
+  if (shards.size() > 1 && accepted != reportedAccepted) {
+    for (uint32_t i=0;i<shards.size();i++) {
+      LOG(Log::INFO) << "Shard " << shards[i]->getIndex() << ": "
+		     << shards[i]->getSessions() << " sessions, "
+		     << shards[i]->getAccepted() << " accepted"
+		     << (shards[i]->isReady() ? "" : ", not ready");
+    }
+  }
 
-  socks->respondConnected(stream->getLocalEndpoint());
+  reportedAccepted = accepted;
+  maxBurst         = 0;
+  maxBacklog       = -1;
 
-  boost::shared_ptr<ProxyShuffler> proxyShuffler(new ProxyShuffler(socks, stream));
-  proxyShuffler->shuffle();
+  scheduleReport();
 }
 
 ///////////////////////////////
 // Setup
 
-void torTunnelError(const boost::system::error_code &err) {
-  std::cerr << "Error with TorTunnel, exiting..." << std::endl;
+void tunnelPoolError(const boost::system::error_code &err) {
+  LOG(Log::ERROR) << "Error with tunnel pool, exiting...";
   exit(0);
 }
 
-void nodeConnectionComplete(TorTunnel *nodeTunnel, 
-			    boost::asio::io_service &io_service, 
-			    Arguments &arguments,
-			    const boost::system::error_code &err) 
+// Called on the shard's own thread.  Shard 0 also runs the DNS, HTTP,
+// and transparent listeners.
+
+void tunnelPoolReady(TorProxy *proxy, ProxyShard *shard,
+		     boost::asio::io_service &io_service, 
+		     Arguments &arguments,
+		     const boost::system::error_code &err) 
 {
-  if (err) {
-    std::cerr << "Error Connecting to Exit Node: " << err << std::endl;
-    exit(0);
+  io_service.post(boost::bind(&TorProxy::shardReady, proxy, shard));
+
+  if (shard->getIndex() != 0) {
+    LOG(Log::INFO) << "Shard " << shard->getIndex() << " connected to exit node.";
+    return;
   }
 
-  TorProxy *proxy = new TorProxy(nodeTunnel, io_service, arguments.port);
+  // Worker processes each run their own listeners, all on the same ports.
+  bool reusePort = arguments.workers > 0;
 
-  std::cerr << "Connected to Exit Node.  SOCKS proxy ready on " << arguments.port << "." << std::endl;
-}
+  if (arguments.dnsPort != 0) {
+    DnsListener *dnsListener = new DnsListener(shard->getIoService(), *shard->getResolver(), 
+					       arguments.dnsPort, reusePort);
+    LOG(Log::INFO) << "DNS resolver ready on " << arguments.dnsPort << ".";
+  }
 
-void getServerListingComplete(boost::asio::io_service &io_service,
-			      Arguments &arguments,
-			      boost::shared_ptr<ServerListing> serverListing,
-			      const boost::system::error_code &err)
-{
-  if (err) {
-    std::cerr << "Error Retrieving Directory: " << err << std::endl;
-    exit(0);
+  if (arguments.transparentPort != 0) {
+    TransparentListener *transparentListener = new TransparentListener(shard->getIoService(),
+								       *shard->getPool(), 
+								       arguments.transparentPort,
+								       reusePort);
+    LOG(Log::INFO) << "Transparent proxy ready on " << arguments.transparentPort << ".";
   }
 
-  std::cerr << "Connecting to exit node: " << serverListing->getAddress() 
-	    << ":" << serverListing->getPort() << std::endl;
-  
-  TorTunnel *nodeTunnel = new TorTunnel(io_service, serverListing, 
-					boost::bind(torTunnelError, placeholders::error));
-  nodeTunnel->connect(boost::bind(nodeConnectionComplete, nodeTunnel,
-				  boost::ref(io_service), arguments,
-				  placeholders::error));
+  if (arguments.httpPort != 0) {
+    HttpListener *httpListener = new HttpListener(shard->getIoService(), *shard->getPool(),
+						  arguments.httpPort, reusePort);
+    LOG(Log::INFO) << "HTTP proxy ready on " << arguments.httpPort << ".";
+  }
+
+  LOG(Log::INFO) << "Connected to Exit Node.  SOCKS proxy ready on " << arguments.port << ".";
+  LOG(Log::INFO) << "Startup complete."
+		 << Log::field("start", arguments.warmStart ? "warm" : "cold")
+		 << Log::field("ms", (Util::getTimeMicros() - arguments.startTime) / 1000);
 }
 
 void getDirectoryListingComplete(boost::asio::io_service &io_service,
@@ -141,17 +318,51 @@ void getDirectoryListingComplete(boost::asio::io_service &io_service,
 				 Arguments &arguments,
 				 const boost::system::error_code &er)
 {
+  std::string exitHost;
+
+  if (directory.isCached())
+    arguments.warmStart = 1;
+
+  if (!arguments.random)
+    exitHost = arguments.host;
+
+  uint32_t cores  = boost::thread::hardware_concurrency();
+  uint32_t count  = arguments.shards;
+
+  if (cores == 0) cores = 1;
+  if (count == 0) count = cores;
+
+  SslLocking::initialize();
+
+  TorProxy *proxy = new TorProxy(io_service, arguments.port, arguments.workers > 0,
+				 arguments.accepts);
 
-  if (arguments.random) {
-    directory.getRandomServerListing(boost::bind(getServerListingComplete,
-						 boost::ref(io_service),
-						 arguments,
-						 _1, _2));
-  } else {
-    directory.getServerListingFor(arguments.host, boost::bind(getServerListingComplete,
-							      boost::ref(io_service),
-							      arguments,
-							      _1, _2));
+  for (uint32_t i=0;i<count;i++) {
+    ProxyShard *shard  = new ProxyShard(i, directory);
+    LoopProfiler::watch(shard->getIoService());
+
+    TunnelPool *pool   = new TunnelPool(shard->getIoService(), shard->getDirectory(), exitHost, 
+					    arguments.tunnels, arguments.policy, 
+					    arguments.congestionControl, arguments.optimisticData, 
+					    arguments.buildTimeout);
+    Resolver *resolver = new Resolver(shard->getIoService(), *pool);
+
+    pool->setCoalesceDelay(arguments.coalesceDelay);
+    pool->setStandby(arguments.standby);
+
+    shard->setPool(pool, resolver);
+    proxy->addShard(shard);
+
+    // A lone shard is left wherever the scheduler puts it.
+    shard->start(count > 1 ? (int)(i % cores) : -1);
+
+    TunnelPoolHandler readyHandler = boost::bind(tunnelPoolReady, proxy, shard, 
+						 boost::ref(io_service), 
+						 boost::ref(arguments), placeholders::error);
+    TunnelPoolHandler errorHandler = boost::bind(tunnelPoolError, placeholders::error);
+
+    shard->getIoService().post(boost::bind(&TunnelPool::build, pool, 
+					   readyHandler, errorHandler));
   }
 }
 
@@ -161,6 +372,23 @@ void printUsage(char *name) {
 	    << "-n <Exit node IP> -- Specify an exit node to use." << std::endl
 	    << "-r                -- Use a randomly selected exit node." << std::endl
 	    << "-p <local port>   -- Local port for SOCKS proxy interface." << std::endl
+	    << "-a <count>        -- Number of accepts to keep outstanding on the SOCKS port (default 4)." << std::endl
+	    << "-c                -- Use RTT-based congestion control on the circuit." << std::endl
+	    << "-d <local port>   -- Local UDP port for a DNS resolver that uses the exit." << std::endl
+	    << "-H <local port>   -- Local port for an HTTP proxy interface." << std::endl
+	    << "-m <local port>   -- Loopback port serving Prometheus metrics." << std::endl
+	    << "-L <interval>     -- Trace one cell in this many through each stage (needs -m)." << std::endl
+	    << "-e <milliseconds> -- Time event handlers and probe event loop lag at this interval." << std::endl
+	    << "-T <local port>   -- Local port for iptables-redirected connections (Linux only)." << std::endl
+	    << "-o                -- Send client data before the exit confirms the stream." << std::endl
+	    << "-f <milliseconds> -- How long to hold a short cell for more data (default 5, 0 disables)." << std::endl
+	    << "-P <count>        -- Run this many worker processes sharing the SOCKS port." << std::endl
+	    << "-s <count>        -- Number of proxy threads, each with its own tunnels (0 for one per core, default 1)." << std::endl
+	    << "-t <count>        -- Number of tunnels to different exit nodes (default 1)." << std::endl
+	    << "-l <policy>       -- Stream placement across tunnels: queued, streams, or fastest." << std::endl
+	    << "-b                -- Keep a standby tunnel built to take over if a tunnel fails." << std::endl
+	    << "-v                -- Log every connection and stream, for debugging." << std::endl
+	    << "-q                -- Only log warnings and errors." << std::endl
 	    << "-h                -- Print this help message." << std::endl << std::endl;
   
 
@@ -169,12 +397,30 @@ void printUsage(char *name) {
 
 int parseOptions(int argc, char **argv, Arguments *arguments) {
   int c;
-  arguments->port   = 5060;
-  arguments->random = 0;
+  arguments->port              = 5060;
+  arguments->accepts           = 4;
+  arguments->random            = 0;
+  arguments->congestionControl = 0;
+  arguments->optimisticData    = 0;
+  arguments->coalesceDelay     = COALESCE_DELAY;
+  arguments->standby           = 0;
+  arguments->logLevel          = Log::INFO;
+  arguments->dnsPort           = 0;
+  arguments->transparentPort   = 0;
+  arguments->httpPort          = 0;
+  arguments->metricsPort       = 0;
+  arguments->traceInterval     = 0;
+  arguments->profileInterval   = 0;
+  arguments->shards            = 1;
+  arguments->workers           = 0;
+  arguments->tunnels           = 1;
+  arguments->policy            = POLICY_LEAST_QUEUED;
+  arguments->startTime         = Util::getTimeMicros();
+  arguments->warmStart         = 0;
 
   opterr = 0;
      
-  while ((c = getopt (argc, argv, "n:p:rh")) != -1) {
+  while ((c = getopt (argc, argv, "n:p:a:rcod:T:H:m:L:e:f:P:s:t:l:bvqh")) != -1) {
     switch (c) {
     case 'n':
       arguments->host = optarg;
@@ -182,13 +428,77 @@ int parseOptions(int argc, char **argv, Arguments *arguments) {
     case 'p':
       arguments->port = atoi(optarg);
       break;
+    case 'a':
+      arguments->accepts = atoi(optarg);
+      break;
     case 'r':
       arguments->random = 1;
       break;
+    case 'c':
+      arguments->congestionControl = 1;
+      break;
+    case 'd':
+      arguments->dnsPort = atoi(optarg);
+      break;
+    case 'T':
+      if (!TransparentListener::isSupported()) {
+	LOG(Log::ERROR) << "Transparent proxying isn't supported on this platform.";
+	printUsage(argv[0]);
+      }
+
+      arguments->transparentPort = atoi(optarg);
+      break;
+    case 'H':
+      arguments->httpPort = atoi(optarg);
+      break;
+    case 'm':
+      arguments->metricsPort = atoi(optarg);
+      break;
+    case 'L':
+      arguments->traceInterval = atoi(optarg);
+      break;
+    case 'e':
+      arguments->profileInterval = atoi(optarg);
+      break;
+    case 'o':
+      arguments->optimisticData = 1;
+      break;
+    case 'f':
+      arguments->coalesceDelay = atoi(optarg);
+      break;
+    case 'P':
+      if (!TorProxy::isReusePortSupported()) {
+	LOG(Log::ERROR) << "Worker processes need SO_REUSEPORT, which this platform lacks.";
+	printUsage(argv[0]);
+      }
+
+      arguments->workers = atoi(optarg);
+      break;
+    case 's':
+      arguments->shards = atoi(optarg);
+      break;
+    case 't':
+      arguments->tunnels = atoi(optarg);
+      break;
+    case 'l':
+      if (!TunnelPool::parsePolicy(optarg, &arguments->policy)) {
+	LOG(Log::ERROR) << "Unknown tunnel policy: " << optarg;
+	printUsage(argv[0]);
+      }
+      break;
+    case 'b':
+      arguments->standby = 1;
+      break;
+    case 'v':
+      arguments->logLevel = Log::DEBUG;
+      break;
+    case 'q':
+      arguments->logLevel = Log::WARNING;
+      break;
     case 'h':
       printUsage(argv[0]);
     default:
-      std::cerr << "Unknown option: " << c << std::endl;
+      LOG(Log::ERROR) << "Unknown option: " << c;
       printUsage(argv[0]);
     }     
   }
@@ -197,9 +507,110 @@ int parseOptions(int argc, char **argv, Arguments *arguments) {
     return 0;
   }
 
+  if (arguments->coalesceDelay < 0) {
+    return 0;
+  }
+
+  // Every worker would want the same metrics port, and a scrape would
+  // only ever see one of them.
+  if (arguments->metricsPort != 0 && arguments->workers > 0) {
+    LOG(Log::ERROR) << "Metrics aren't available with worker processes.";
+    return 0;
+  }
+
+  // Traces are only ever read back from the metrics port.
+  if (arguments->traceInterval != 0 && arguments->metricsPort == 0) {
+    LOG(Log::ERROR) << "Cell tracing needs a metrics port to report on.";
+    return 0;
+  }
+
+  if (arguments->tunnels < 1 || arguments->shards < 0 || arguments->workers < 0 ||
+      arguments->accepts < 1 || arguments->traceInterval < 0 || 
+      arguments->profileInterval < 0) {
+    return 0;
+  }
+
+  // There's only one exit to build tunnels to when it's named explicitly.
+  if (arguments->random == 0 && arguments->tunnels > 1) {
+    LOG(Log::WARNING) << "Only one tunnel can be built to a specific exit node.";
+    arguments->tunnels = 1;
+  }
+
   return 1;
 }
 
+// A worker picks up the directory the supervisor already downloaded,
+// rather than every worker fetching its own, so its startup is timed
+// from its own fork and always counts as warm.
+
+int runWorker(Arguments &arguments, std::string directoryPath) {
+  arguments.startTime = Util::getTimeMicros();
+  arguments.warmStart = 1;
+
+  boost::asio::io_service io_service;
+  CircuitBuildTimeout buildTimeout(CircuitBuildTimeout::getDefaultStatePath());
+  arguments.buildTimeout = &buildTimeout;
+
+  LoopProfiler::watch(io_service);
+
+  Directory directory(io_service);
+
+  if (!directory.loadDirectoryListing(directoryPath)) {
+    LOG(Log::ERROR) << "Unable to load directory listing from " << directoryPath;
+    return 1;
+  }
+
+  io_service.post(boost::bind(getDirectoryListingComplete,
+			      boost::ref(io_service),
+			      boost::ref(directory),
+			      boost::ref(arguments),
+			      boost::system::error_code()));
+
+  io_service::work work(io_service);
+  io_service.run();
+
+  return 0;
+}
+
+void supervisorDirectoryComplete(boost::system::error_code *result, 
+				 const boost::system::error_code &err)
+{
+  *result = err;
+}
+
+int runSupervisor(Arguments &arguments) {
+  boost::system::error_code err = boost::asio::error::would_block;
+  boost::asio::io_service io_service;
+  Directory directory(io_service);
+  std::string directoryPath = Directory::getDefaultCachePath();
+
+  // Workers are forked off the copy on disk, so a background refresh of
+  // a stale cache is left to finish before they start.  When nothing new
+  // has been published, that's one round trip.
+
+  directory.retrieveCachedDirectoryListing(directoryPath,
+					   boost::bind(supervisorDirectoryComplete, &err,
+						       placeholders::error));
+  io_service.run();
+
+  if (err) {
+    LOG(Log::ERROR) << "Error retrieving directory listing: " << err;
+    return 1;
+  }
+
+  if (!directory.saveDirectoryListing(directoryPath)) {
+    LOG(Log::ERROR) << "Unable to save directory listing to " << directoryPath;
+    return 1;
+  }
+
+  LOG(Log::INFO) << "Starting " << arguments.workers << " workers on port " 
+		 << arguments.port << ".";
+
+  Supervisor supervisor(arguments.workers, boost::bind(runWorker, boost::ref(arguments), 
+						       directoryPath));
+  return supervisor.run();
+}
+
 int main(int argc, char** argv) {
   Arguments arguments;
 
@@ -208,17 +619,37 @@ int main(int argc, char** argv) {
     return 2;
   }
 
-  std::cerr << "torproxy " << VERSION << " by Moxie Marlinspike." << std::endl;
-  std::cerr << "Retrieving directory listing..." << std::endl;
+  Log::setLevel(arguments.logLevel);
+  Log::start();
+
+  if (arguments.profileInterval > 0)
+    LoopProfiler::start(arguments.profileInterval);
+
+  LOG(Log::INFO) << "torproxy " << VERSION << " by Moxie Marlinspike.";
+  LOG(Log::INFO) << "Retrieving directory listing...";
+
+  if (arguments.workers > 0)
+    return runSupervisor(arguments);
 
   boost::asio::io_service io_service;
+  CircuitBuildTimeout buildTimeout(CircuitBuildTimeout::getDefaultStatePath());
+  arguments.buildTimeout = &buildTimeout;
+
+  if (arguments.metricsPort != 0) {
+    MetricsListener *metricsListener = new MetricsListener(io_service, arguments.metricsPort);
+    LOG(Log::INFO) << "Metrics ready on 127.0.0.1:" << arguments.metricsPort << ".";
+  }
+
+  CellTrace::setInterval(arguments.traceInterval);
+  LoopProfiler::watch(io_service);
 
   Directory directory(io_service);
-  directory.retrieveDirectoryListing(boost::bind(getDirectoryListingComplete,
-						 boost::ref(io_service),
-						 boost::ref(directory),
-						 boost::ref(arguments),
-						 placeholders::error));  
+  directory.retrieveCachedDirectoryListing(Directory::getDefaultCachePath(),
+					   boost::bind(getDirectoryListingComplete,
+						       boost::ref(io_service),
+						       boost::ref(directory),
+						       boost::ref(arguments),
+						       placeholders::error));  
 
   io_service::work work(io_service);
   io_service.run();
@@ -36,18 +36,44 @@
 #include <cassert>
 #include <iostream>
 #include <string>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
 
 #include "TorTunnel.h"
+#include "TunnelPool.h"
+#include "Resolver.h"
+#include "DnsListener.h"
+#include "TransparentListener.h"
+#include "HttpListener.h"
+#include "MetricsListener.h"
 #include "SocksConnection.h"
 #include "ProxyShuffler.h"
+#include "ProxyShard.h"
+#include "Supervisor.h"
+#include "util/SslLocking.h"
+#include "util/Log.h"
+#include "util/Metrics.h"
+#include "util/CellTrace.h"
+#include "util/Probes.h"
+#include "util/LoopProfiler.h"
+#include "util/AcceptBackoff.h"
+#include "util/ReusePort.h"
 
 using namespace boost::asio;
 
 /***********
  *
- * TorProxy builds a tor tunnel directly to an exit node and
- * sets up a SOCKS proxy to shuttle requests into it.  Most useful
- * for running existing applications through a tor tunnel.
+ * TorProxy builds tor tunnels directly to one or more exit nodes and
+ * sets up a SOCKS proxy to shuttle requests into them.  Most useful
+ * for running existing applications through a tor tunnel.  Each new
+ * connection is accepted straight onto the least loaded proxy shard,
+ * which handles it from then on.  Several accepts are kept outstanding,
+ * and each completed one drains whatever else is already waiting in
+ * the listen queue before going back to the reactor.  An accept that
+ * fails, usually for want of file descriptors, waits a moment before
+ * trying again rather than spinning on the error.
  *
  **********/
 
@@ -55,32 +81,70 @@ using namespace boost::asio;
 class TorProxy {
 
  private:
+  static const uint32_t REPORT_INTERVAL = 60;
+  static const uint32_t MAX_DRAIN       = 64;
+
   ip::tcp::acceptor acceptor;
-  TorTunnel *tunnel;
+  std::vector<ProxyShard*> shards;
+  uint32_t nextShard;
+  uint32_t acceptCount;
+  bool accepting;
+
+  AcceptBackoff backoff;
+
+  deadline_timer reportTimer;
+  long reportedAccepted;
+  long acceptErrors;
+  uint32_t maxBurst;
+  int maxBacklog;
+
+  ProxyShard* selectShard();
+  int getBacklog();
 
   void acceptIncomingConnection();
-  void handleIncomingConnection(boost::shared_ptr<ip::tcp::socket> socket,
+  void handleIncomingConnection(ProxyShard *shard,
+				boost::shared_ptr<ip::tcp::socket> socket,
 				const boost::system::error_code &err);
-  
-  void handleSocksRequest(boost::shared_ptr<SocksConnection> connection,
-			  std::string &host,
-			  uint16_t port,
-			  const boost::system::error_code &err);
+  void drainIncomingConnections();
 
-  void handleStreamOpen(boost::shared_ptr<SocksConnection> socks,
-			boost::shared_ptr<TorTunnelStream> stream,
-			const boost::system::error_code &err);
+  void scheduleReport();
+  void report(const boost::system::error_code &err);
 
  public:
 
-  TorProxy(TorTunnel *tunnel, boost::asio::io_service &io_service, int listenPort);
+  TorProxy(boost::asio::io_service &io_service, int listenPort, bool reusePort,
+	   uint32_t acceptCount);
+
+  void addShard(ProxyShard *shard);
+  void shardReady(ProxyShard *shard);
+
+  static bool isReusePortSupported();
     
 };
 
 typedef struct {
   std::string host;
   int port;
+  int accepts;
   int random;
+  int congestionControl;
+  int optimisticData;
+  int coalesceDelay;
+  int standby;
+  Log::Level logLevel;
+  int dnsPort;
+  int transparentPort;
+  int httpPort;
+  int metricsPort;
+  int traceInterval;
+  int profileInterval;
+  int shards;
+  int workers;
+  int tunnels;
+  TunnelPoolPolicy policy;
+  CircuitBuildTimeout *buildTimeout;
+  uint64_t startTime;
+  int warmStart;
 } Arguments;
 
 
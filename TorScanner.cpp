@@ -28,28 +28,30 @@
  */
 
 #include "TorScanner.h"
+#include "util/Log.h"
+#include "util/LoopProfiler.h"
 
 #include <cstdlib>
+#include <unistd.h>
 
 using namespace boost::asio;
 
+HANDLER_TAG(descriptorsHandler, "scanner.descriptors");
+
 TorScanner::TorScanner(boost::asio::io_service &io_service, 
 		       std::string &destinationHost, 
 		       std::string &destinationPort,
 		       std::string &request) 
   : io_service(io_service), destinationHost(destinationHost), 
-    destinationPort(atoi(destinationPort.c_str())), request(request)
+    destinationPort(atoi(destinationPort.c_str())), request(request),
+    buildTimeout(CircuitBuildTimeout::getDefaultStatePath()), directory(io_service)
 {}
 
-void TorScanner::readComplete(TorTunnel *tunnel,
+void TorScanner::readComplete(boost::shared_ptr<TorTunnel> tunnel,
 			      boost::shared_ptr<TorTunnelStream> stream,
 			      unsigned char *buf, std::size_t transferred)
 {
-  if (transferred == -1) {
-    tunnel->close();
-    delete tunnel;
-    return;
-  }
+  if (transferred == -1) return;
 
   std::string response((const char*)buf, transferred);
   std::cout << "Read from (" << stream->getRemoteNodeAddress() << "):" 
@@ -58,7 +60,7 @@ void TorScanner::readComplete(TorTunnel *tunnel,
   stream->read(boost::bind(&TorScanner::readComplete, this, tunnel, stream, _1, _2));
 }
 
-void TorScanner::requestSent(TorTunnel *tunnel,
+void TorScanner::requestSent(boost::shared_ptr<TorTunnel> tunnel,
 			     boost::shared_ptr<TorTunnelStream> stream,
 			     unsigned char *buf,
 			     const boost::system::error_code &err)
@@ -66,7 +68,6 @@ void TorScanner::requestSent(TorTunnel *tunnel,
   free(buf);
 
   if (err) {
-    delete tunnel;
     std::cout << "Error sending request: " << err << std::endl;
     return;
   }
@@ -74,18 +75,16 @@ void TorScanner::requestSent(TorTunnel *tunnel,
   stream->read(boost::bind(&TorScanner::readComplete, this, tunnel, stream, _1, _2));
 }
 
-void TorScanner::tunnelStreamOpen(TorTunnel *tunnel, 
+void TorScanner::tunnelStreamOpen(boost::shared_ptr<TorTunnel> tunnel, 
 				  boost::shared_ptr<TorTunnelStream> stream,
 				  const boost::system::error_code &err)
 {
   if (err) {
     std::cout << "Error opening stream: " << err << " " << &(tunnel->nodeConnection) << std::endl;
-    tunnel->close();
-    delete tunnel;
     return;
   }
 
-  std::cerr << "Connected to: " << stream->getRemoteNodeAddress() << std::endl;
+  LOG(Log::INFO) << "Connected to: " << stream->getRemoteNodeAddress();
   
   std::string fullRequest("GET ");
   fullRequest.append(request);
@@ -98,11 +97,10 @@ void TorScanner::tunnelStreamOpen(TorTunnel *tunnel,
 						     tunnel, stream, buf, placeholders::error));
 }
 
-void TorScanner::tunnelConnectionComplete(TorTunnel *tunnel, 
+void TorScanner::tunnelConnectionComplete(boost::shared_ptr<TorTunnel> tunnel, 
 					  const boost::system::error_code &err)
 {
   if (err) {
-    delete tunnel;
     std::cout << "Error connecting: " << err << " " << &(tunnel->nodeConnection) << std::endl;
     return;
   }
@@ -112,14 +110,14 @@ void TorScanner::tunnelConnectionComplete(TorTunnel *tunnel,
 }
 
 void TorScanner::torTunnelError(const boost::system::error_code &err) {
-  std::cerr << "Error with tor tunnel: " << err << std::endl;
+  LOG(Log::ERROR) << "Error with tor tunnel: " << err;
 }
 
 void TorScanner::serverDescriptorsComplete(boost::shared_ptr<ServerListingGroup> group,
 					   const boost::system::error_code &err)
 {
   if (err) {
-    std::cerr << "Error retrieving Exit Node descriptors: " << err << std::endl;
+    LOG(Log::ERROR) << "Error retrieving Exit Node descriptors: " << err;
     return;
   }
 
@@ -127,24 +125,24 @@ void TorScanner::serverDescriptorsComplete(boost::shared_ptr<ServerListingGroup>
   boost::shared_ptr<ServerListing> exitNode;
 
   while ((exitNode = iterator.next()) != NULL) {
-    TorTunnel *tunnel = new TorTunnel(io_service, exitNode, 
-				      boost::bind(&TorScanner::torTunnelError, this, 
-						  placeholders::error));
+    boost::shared_ptr<TorTunnel> tunnel = TorTunnel::create(io_service, exitNode, 
+							    boost::bind(&TorScanner::torTunnelError,
+									this, placeholders::error));
+    tunnel->setBuildTimeout(&buildTimeout);
     tunnel->connect(boost::bind(&TorScanner::tunnelConnectionComplete, this,
 				tunnel, placeholders::error));
   }
 }
 			       
 
-void TorScanner::directoryListingComplete(Directory *directory, 
-					  const boost::system::error_code &err) 
+void TorScanner::directoryListingComplete(const boost::system::error_code &err) 
 {  
   if (err) {
-    std::cerr << "Error retrieving directory listing: " << err << std::endl;
+    LOG(Log::ERROR) << "Error retrieving directory listing: " << err;
     return;
   }
 
-  ExitNodeIterator iterator(*directory);
+  ExitNodeIterator iterator(directory);
   boost::shared_ptr<ServerListing> exitNode = iterator.next();
 
   while (exitNode != NULL) {
@@ -158,7 +156,7 @@ void TorScanner::directoryListingComplete(Directory *directory,
       identityList.push_back(identityStr);
       free(identity);
       
-      std::cerr << "Added: " << identityStr << std::endl;
+      LOG(Log::DEBUG) << "Added: " << identityStr;
       exitNode = iterator.next();
 
       if (count++ == 50)
@@ -167,26 +165,45 @@ void TorScanner::directoryListingComplete(Directory *directory,
 
     boost::shared_ptr<ServerListingGroup> group(new ServerListingGroup(io_service, 
 								       identityList));
-    group->retrieveGroupList(boost::bind(&TorScanner::serverDescriptorsComplete, this,
-					 group, placeholders::error));    
+    group->retrieveGroupList(LoopProfiler::wrap(descriptorsHandler,
+						boost::bind(&TorScanner::serverDescriptorsComplete, 
+							    this, group, placeholders::error)));
   }
-
-  delete directory;
 }
 
+// The directory outlives the scan's use of it, since a stale cached
+// copy may still be refreshing in the background.
+
 void TorScanner::scan() {
-  Directory *directory = new Directory(io_service);
-  directory->retrieveDirectoryListing(boost::bind(&TorScanner::directoryListingComplete,
-						  this, directory, placeholders::error));
+  directory.retrieveCachedDirectoryListing(Directory::getDefaultCachePath(),
+					   boost::bind(&TorScanner::directoryListingComplete,
+						       this, placeholders::error));
 }
 
+// -e <milliseconds> turns on the event loop profiler, the same as for
+// torproxy, and SIGUSR1 logs its report.
+
 int main(int argc, char** argv) {
-  std::string destinationHost(argv[1]);
-  std::string destinationPort(argv[2]);
-  std::string request(argv[3]);
+  int c;
+
+  while ((c = getopt(argc, argv, "e:")) != -1) {
+    if (c == 'e' && atoi(optarg) > 0) LoopProfiler::start(atoi(optarg));
+  }
+
+  if (argc - optind < 3) {
+    std::cerr << "Usage: " << argv[0] << " [-e <milliseconds>] <host> <port> <path>" << std::endl;
+    return 2;
+  }
+
+  std::string destinationHost(argv[optind]);
+  std::string destinationPort(argv[optind + 1]);
+  std::string request(argv[optind + 2]);
 
   boost::asio::io_service io_service;
 
+  Log::start();
+  LoopProfiler::watch(io_service);
+
   TorScanner scanner(io_service, destinationHost, destinationPort, request);
   scanner.scan();
 
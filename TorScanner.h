@@ -59,24 +59,30 @@ class TorScanner {
   std::string &destinationHost;
   uint16_t destinationPort;
   std::string &request;
+  CircuitBuildTimeout buildTimeout;
+  Directory directory;
 
   void torTunnelError(const boost::system::error_code &err);
 
-  void readComplete(TorTunnel *tunnel, boost::shared_ptr<TorTunnelStream> stream,
+  void readComplete(boost::shared_ptr<TorTunnel> tunnel, 
+		    boost::shared_ptr<TorTunnelStream> stream,
 		    unsigned char *buf, std::size_t transferred);
 
-  void requestSent(TorTunnel *tunnel, boost::shared_ptr<TorTunnelStream> stream,
+  void requestSent(boost::shared_ptr<TorTunnel> tunnel, 
+		   boost::shared_ptr<TorTunnelStream> stream,
 		   unsigned char *buf, const boost::system::error_code &err);
 
-  void tunnelStreamOpen(TorTunnel *tunnel, boost::shared_ptr<TorTunnelStream> stream,
+  void tunnelStreamOpen(boost::shared_ptr<TorTunnel> tunnel, 
+			boost::shared_ptr<TorTunnelStream> stream,
 			const boost::system::error_code &err);
 
-  void tunnelConnectionComplete(TorTunnel *tunnel, const boost::system::error_code &err);
+  void tunnelConnectionComplete(boost::shared_ptr<TorTunnel> tunnel, 
+				const boost::system::error_code &err);
 
   void serverDescriptorsComplete(boost::shared_ptr<ServerListingGroup> group,
 				 const boost::system::error_code &err);
 			       
-  void directoryListingComplete(Directory *directory, const boost::system::error_code &err);
+  void directoryListingComplete(const boost::system::error_code &err);
 
 
  public:
@@ -28,54 +28,209 @@
  */
 
 #include "TorTunnel.h"
+#include "util/Log.h"
+#include "util/LoopProfiler.h"
 #include "util/Util.h"
 
 #include <boost/lexical_cast.hpp>
+#include <algorithm>
+
+// Setting up a circuit generates its DH keys, which is slow enough to
+// be worth watching.
+HANDLER_TAG(connectedHandler, "tunnel.connected");
 
 TorTunnel::TorTunnel(boost::asio::io_service &io_service,
 		     boost::shared_ptr<ServerListing> serverListing,
 		     TorTunnelErrorHandler errorHandler) :
   io_service(io_service), serverListing(serverListing), errorHandler(errorHandler),
+  congestionControl(false), optimisticData(false), coalesceDelay(COALESCE_DELAY),
+  buildTimeout(NULL), buildTimer(io_service),
+  connectStarted(0), createStarted(0), building(false), buildAbandoned(false),
   nodeConnection(io_service, serverListing->getAddress(), serverListing->getPort())
 {}
 
+boost::shared_ptr<TorTunnel> TorTunnel::create(boost::asio::io_service &io_service,
+					       boost::shared_ptr<ServerListing> serverListing,
+					       TorTunnelErrorHandler errorHandler)
+{
+  return boost::shared_ptr<TorTunnel>(new TorTunnel(io_service, serverListing, errorHandler),
+				      &TorTunnel::release);
+}
+
+// Whatever was still outstanding when the last owner let go completes
+// with an error once it's closed, so those handlers run before the
+// delete does.
+
+void TorTunnel::release(TorTunnel *tunnel) {
+  tunnel->close();
+  tunnel->io_service.post(boost::bind(&TorTunnel::destroy, tunnel));
+}
+
+void TorTunnel::destroy(TorTunnel *tunnel) {
+  delete tunnel;
+}
+
 void TorTunnel::close() {
-  circuit->close();
+  building = false;
+  buildTimer.cancel();
+
+  if (circuit) circuit->close();
   nodeConnection.close();
 }
 
+void TorTunnel::setCongestionControl(bool enabled) {
+  congestionControl = enabled;
+}
+
+void TorTunnel::setOptimisticData(bool enabled) {
+  optimisticData = enabled;
+}
+
+void TorTunnel::setCoalesceDelay(uint32_t milliseconds) {
+  coalesceDelay = milliseconds;
+}
+
+void TorTunnel::setBuildTimeout(CircuitBuildTimeout *buildTimeout) {
+  this->buildTimeout = buildTimeout;
+}
+
 void TorTunnel::connect(TunnelConnectHandler handler) {
-  nodeConnection.connect(boost::bind(&TorTunnel::nodeConnectionComplete, 
-				     this, handler, placeholders::error));
+  connectStarted = Util::getTimeMicros();
+  building       = true;
+  buildAbandoned = false;
+
+  if (buildTimeout != NULL)
+    startBuildTimer(buildTimeout->getSetupTimeout());
+
+  nodeConnection.connect(LoopProfiler::wrap(connectedHandler,
+					    boost::bind(&TorTunnel::nodeConnectionComplete, 
+							this, handler, placeholders::error)));
 }
 
 void TorTunnel::nodeConnectionComplete(TunnelConnectHandler handler,
 				       const boost::system::error_code &err) 
 {
   if (err) {
-    handler(err);
+    building = false;
+    buildTimer.cancel();
+    handler(buildAbandoned ? boost::asio::error::timed_out : err);
     return;
   }
 
-  std::cerr << "SSL Connection to node complete.  Setting up circuit." << std::endl;
+  LOG(Log::DEBUG) << "SSL Connection to node complete.  Setting up circuit.";
 
   RSA *onionKey      = serverListing->getOnionKey();
   uint16_t circuitId = Util::getRandomId();
   circuit            = boost::shared_ptr<Circuit>(new Circuit(nodeConnection, onionKey, 
 							      circuitId, this));
 
-  circuit->create(boost::bind(handler, placeholders::error));
+  if (congestionControl)
+    circuit->enableCongestionControl();
+
+  circuit->setCoalesceDelay(coalesceDelay);
+
+  createStarted = Util::getTimeMicros();
+
+  // The CREATE exchange gets its own, usually much tighter, deadline, but
+  // never more time than is left of the overall setup deadline.
+
+  if (buildTimeout != NULL) {
+    uint32_t setupRemaining = buildTimeout->getSetupTimeout() - 
+      std::min(getElapsedMillis(connectStarted), buildTimeout->getSetupTimeout());
+
+    startBuildTimer(std::min(buildTimeout->getCreateTimeout(), setupRemaining));
+  }
+
+  circuit->create(boost::bind(&TorTunnel::circuitCreateComplete, this, 
+			      handler, placeholders::error));
+}
+
+void TorTunnel::circuitCreateComplete(TunnelConnectHandler handler,
+				      const boost::system::error_code &err)
+{
+  building = false;
+  buildTimer.cancel();
+
+  if (buildAbandoned) {
+    handler(boost::asio::error::timed_out);
+    return;
+  }
+
+  if (!err && buildTimeout != NULL) {
+    buildTimeout->recordCreateTime(getElapsedMillis(createStarted));
+    buildTimeout->recordSetupTime(getElapsedMillis(connectStarted));
+  }
+
+  handler(err);
+}
+
+void TorTunnel::startBuildTimer(uint32_t milliseconds) {
+  buildTimer.expires_from_now(boost::posix_time::milliseconds(milliseconds));
+  buildTimer.async_wait(boost::bind(&TorTunnel::buildTimerExpired, this, 
+				    placeholders::error));
+}
+
+void TorTunnel::buildTimerExpired(const boost::system::error_code &err) {
+  if (err == boost::asio::error::operation_aborted) return;
+  if (!building)                                    return;
+
+  LOG(Log::WARNING) << "Circuit build to " << serverListing->getAddress() 
+		    << " timed out, abandoning.";
+
+  buildAbandoned = true;
+  building       = false;
+
+  if (createStarted != 0) buildTimeout->recordCreateAbandoned(getElapsedMillis(createStarted));
+  buildTimeout->recordSetupAbandoned(getElapsedMillis(connectStarted));
+
+  // Closing the socket fails whatever read or write the build is waiting
+  // on, which unwinds back to the connect handler with timed_out.
+
+  nodeConnection.close();
+}
+
+uint32_t TorTunnel::getElapsedMillis(uint64_t started) {
+  return (Util::getTimeMicros() - started) / 1000;
 }
 
 void TorTunnel::openStream(std::string &host, uint16_t port, TunnelStreamHandler handler) {
-  uint16_t streamId  = Util::getRandomId();
+  uint16_t streamId  = circuit->allocateStream();
+
+  if (streamId == 0) {
+    io_service.post(boost::bind(&TorTunnel::openStreamComplete, shared_from_this(), 
+				handler, streamId,
+				boost::system::error_code(boost::asio::error::no_buffer_space)));
+    return;
+  }
+
   std::string destination(host);
+
+  // IPv6 literals are bracketed so the port can be told apart.
+  if (host.find(':') != std::string::npos)
+    destination = "[" + host + "]";
+
   destination.append(":");
   destination.append(boost::lexical_cast<std::string>(port));
 
-  circuit->connect(streamId, destination, boost::bind(&TorTunnel::openStreamComplete,
-						      this, handler, streamId,
-						      placeholders::error));
+  CircuitConnectHandler connectHandler = boost::bind(&TorTunnel::openStreamComplete,
+						     shared_from_this(), handler, streamId,
+						     placeholders::error);
+
+  if (optimisticData) circuit->connectOptimistic(streamId, destination, connectHandler);
+  else                circuit->connect(streamId, destination, connectHandler);
+}
+
+void TorTunnel::resolve(std::string &host, CircuitResolveHandler handler) {
+  uint16_t streamId = circuit->allocateStream();
+
+  if (streamId == 0) {
+    std::vector<ResolvedAnswer> answers;
+    io_service.post(boost::bind(handler, answers,
+				boost::system::error_code(boost::asio::error::no_buffer_space)));
+    return;
+  }
+
+  circuit->resolve(streamId, host, handler);
 }
 
 void TorTunnel::openStreamComplete(TunnelStreamHandler handler, uint16_t streamId,
@@ -88,17 +243,37 @@ void TorTunnel::openStreamComplete(TunnelStreamHandler handler, uint16_t streamI
     return;
   }
 
-  stream = boost::shared_ptr<TorTunnelStream>(new TorTunnelStream(streamId, this));
+  stream = boost::shared_ptr<TorTunnelStream>(new TorTunnelStream(streamId, shared_from_this()));
   handler(stream, err);
 }
 
 void TorTunnel::handleConnectionError(const boost::system::error_code &err) {
-  std::cerr << "Error with connection to Exit Node: " << err << std::endl;
+  LOG(Log::WARNING) << "Error with connection to Exit Node: " << err;
   errorHandler(err);
 }
 
 void TorTunnel::handleCircuitDestroyed() {
-  std::cerr << "Exit Node circuit destroyed." << std::endl;
+  LOG(Log::WARNING) << "Exit Node circuit destroyed.";
   errorHandler(boost::system::error_code());
 }
 
+
+uint32_t TorTunnel::getActiveStreams() {
+  return circuit ? circuit->getStreams().getActiveStreams() : 0;
+}
+
+uint32_t TorTunnel::getLostStreams() {
+  return circuit ? circuit->getLostStreams() : 0;
+}
+
+uint64_t TorTunnel::getFailedAt() {
+  return circuit ? circuit->getFailedAt() : 0;
+}
+
+uint32_t TorTunnel::getQueuedBytes() {
+  return circuit ? circuit->getQueuedBytes() : 0;
+}
+
+uint64_t TorTunnel::getBytesTransferred() {
+  return circuit ? circuit->getBytesRead() + circuit->getBytesWritten() : 0;
+}
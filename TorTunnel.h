@@ -32,6 +32,8 @@
 
 #include <boost/function.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
 #include <cassert>
@@ -43,6 +45,7 @@
 #include "protocol/ServerListing.h"
 #include "protocol/Connection.h"
 #include "protocol/Circuit.h"
+#include "protocol/CircuitBuildTimeout.h"
 
 using namespace boost::asio;
 
@@ -52,7 +55,20 @@ typedef boost::function<void (const boost::system::error_code &error)> TunnelCon
 typedef boost::function<void (boost::shared_ptr<TorTunnelStream> stream, const boost::system::error_code &error)> TunnelStreamHandler;
 typedef boost::function<void (const boost::system::error_code &error)> TorTunnelErrorHandler;
 
-class TorTunnel : public CircuitErrorListener {
+/***********
+ *
+ * A TorTunnel is only ever owned through the shared_ptr that create()
+ * hands back.  Letting go of the last one closes it, but the delete is
+ * posted, since that can happen from inside one of its own handlers
+ * and closing it queues the handlers of whatever it still had
+ * outstanding.  Its streams only hold it weakly, and act closed once
+ * it's gone.
+ *
+ **********/
+
+class TorTunnel : public CircuitErrorListener, 
+		  public boost::enable_shared_from_this<TorTunnel> 
+{
 
   friend class TorTunnelStream;
 
@@ -62,6 +78,23 @@ class TorTunnel : public CircuitErrorListener {
   boost::shared_ptr<Circuit> circuit;
 
   TorTunnelErrorHandler errorHandler;
+  bool congestionControl;
+  bool optimisticData;
+  uint32_t coalesceDelay;
+
+  CircuitBuildTimeout *buildTimeout;
+  deadline_timer buildTimer;
+  uint64_t connectStarted;
+  uint64_t createStarted;
+  bool building;
+  bool buildAbandoned;
+
+  void startBuildTimer(uint32_t milliseconds);
+  void buildTimerExpired(const boost::system::error_code &err);
+  uint32_t getElapsedMillis(uint64_t started);
+
+  void circuitCreateComplete(TunnelConnectHandler handler,
+			     const boost::system::error_code &err);
 
   void nodeConnectionComplete(TunnelConnectHandler handler,
 			      const boost::system::error_code &err);
@@ -72,17 +105,35 @@ class TorTunnel : public CircuitErrorListener {
   void directoryListingComplete(TunnelConnectHandler handler, 
 				const boost::system::error_code &err);
 
- public:
   TorTunnel(boost::asio::io_service &io_service, 
 	    boost::shared_ptr<ServerListing> serverListing, 
 	    TorTunnelErrorHandler errorHandler);
 
+  static void release(TorTunnel *tunnel);
+  static void destroy(TorTunnel *tunnel);
+
+ public:
+  static boost::shared_ptr<TorTunnel> create(boost::asio::io_service &io_service, 
+					     boost::shared_ptr<ServerListing> serverListing, 
+					     TorTunnelErrorHandler errorHandler);
+
   void close();
+  void setCongestionControl(bool enabled);
+  void setOptimisticData(bool enabled);
+  void setCoalesceDelay(uint32_t milliseconds);
+  void setBuildTimeout(CircuitBuildTimeout *buildTimeout);
   void connect(TunnelConnectHandler handler);
   void openStream(std::string &host, uint16_t port, TunnelStreamHandler handler);
+  void resolve(std::string &host, CircuitResolveHandler handler);
   void handleConnectionError(const boost::system::error_code &err);    
   void handleCircuitDestroyed();
 
+  uint32_t getActiveStreams();
+  uint32_t getLostStreams();
+  uint64_t getFailedAt();
+  uint32_t getQueuedBytes();
+  uint64_t getBytesTransferred();
+
   Connection nodeConnection;
 
 };
@@ -90,32 +141,82 @@ class TorTunnel : public CircuitErrorListener {
 class TorTunnelStream : public ShuffleStream {
 
  private:
-  TorTunnel *tunnel;
+  boost::weak_ptr<TorTunnel> tunnel;
   uint16_t streamId;
+  bool closed;
+
+  boost::shared_ptr<Circuit> getCircuit() {
+    boost::shared_ptr<TorTunnel> tunnel = this->tunnel.lock();
+    return tunnel ? tunnel->circuit : boost::shared_ptr<Circuit>();
+  }
 
  public:
-  TorTunnelStream(uint16_t streamId, TorTunnel *tunnel) 
-    : streamId(streamId), tunnel(tunnel)
+  TorTunnelStream(uint16_t streamId, boost::shared_ptr<TorTunnel> tunnel) 
+    : tunnel(tunnel), streamId(streamId), closed(false)
   {}
 
   void write(unsigned char* buf, int len, StreamWriteHandler handler) {
-    tunnel->circuit->write(streamId, buf, len, handler);
+    boost::shared_ptr<Circuit> circuit = getCircuit();
+
+    if (closed || !circuit) handler(boost::asio::error::not_connected);
+    else                    circuit->write(streamId, buf, len, handler);
   }
 
   void read(StreamReadHandler handler) {
-    tunnel->circuit->read(streamId, handler);
+    boost::shared_ptr<Circuit> circuit = getCircuit();
+
+    if (closed || !circuit) handler(NULL, -1);
+    else                    circuit->read(streamId, handler);
+  }
+
+  void writev(StreamBuffers &buffers, StreamWriteHandler handler) {
+    boost::shared_ptr<Circuit> circuit = getCircuit();
+
+    if (closed || !circuit) handler(boost::asio::error::not_connected);
+    else                    circuit->writev(streamId, buffers, handler);
+  }
+
+  void readv(StreamReadvHandler handler) {
+    boost::shared_ptr<Circuit> circuit = getCircuit();
+    StreamBuffers buffers;
+
+    if (closed || !circuit) handler(buffers, -1);
+    else                    circuit->readv(streamId, handler);
+  }
+
+  void flush() {
+    boost::shared_ptr<Circuit> circuit = getCircuit();
+
+    if (!closed && circuit) circuit->flush(streamId);
   }
 
   void close() {
-    tunnel->circuit->close(streamId);
+    if (closed) return;
+
+    boost::shared_ptr<Circuit> circuit = getCircuit();
+    closed = true;
+
+    if (circuit) circuit->close(streamId);
+  }
+
+  uint32_t getBufferedBytes() {
+    boost::shared_ptr<Circuit> circuit = getCircuit();
+    return (closed || !circuit) ? 0 : circuit->getBufferedBytes(streamId);
+  }
+
+  uint64_t takeTrace() {
+    boost::shared_ptr<Circuit> circuit = getCircuit();
+    return (closed || !circuit) ? 0 : circuit->takeTrace(streamId);
   }
 
   std::string getRemoteNodeAddress() {
-    return tunnel->circuit->getRemoteNodeAddress();
+    boost::shared_ptr<Circuit> circuit = getCircuit();
+    return circuit ? circuit->getRemoteNodeAddress() : std::string();
   }
 
   ip::tcp::endpoint getLocalEndpoint() {
-    return tunnel->circuit->getLocalEndpoint();
+    boost::shared_ptr<Circuit> circuit = getCircuit();
+    return circuit ? circuit->getLocalEndpoint() : ip::tcp::endpoint();
   }
 
 };
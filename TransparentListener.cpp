@@ -0,0 +1,143 @@
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "TransparentListener.h"
+#include "util/Log.h"
+#include "util/ReusePort.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#ifdef HAVE_LINUX_NETFILTER_IPV4_H
+#include <linux/netfilter_ipv4.h>
+#endif
+
+using namespace boost::asio;
+
+// With reusePort, every worker process listens on the same port.
+
+TransparentListener::TransparentListener(boost::asio::io_service &io_service, 
+					 TunnelPool &pool, int listenPort, bool reusePort)
+  : acceptor(io_service),
+    backoff(io_service, boost::bind(&TransparentListener::acceptIncomingConnection, this)),
+    pool(pool)
+{
+  ip::tcp::endpoint endpoint(ip::tcp::v4(), listenPort);
+
+  acceptor.open(endpoint.protocol());
+  acceptor.set_option(ip::tcp::acceptor::reuse_address(true));
+
+#ifdef SO_REUSEPORT
+  if (reusePort) acceptor.set_option(reuse_port(true));
+#endif
+
+  acceptor.bind(endpoint);
+  acceptor.listen();
+  acceptIncomingConnection();
+}
+
+bool TransparentListener::isSupported() {
+#ifdef HAVE_LINUX_NETFILTER_IPV4_H
+  return true;
+#else
+  return false;
+#endif
+}
+
+void TransparentListener::acceptIncomingConnection() {
+  boost::shared_ptr<ip::tcp::socket> socket(new ip::tcp::socket(acceptor.get_io_service()));
+  acceptor.async_accept(*socket, boost::bind(&TransparentListener::handleIncomingConnection,
+					     this, socket, placeholders::error));
+}
+
+void TransparentListener::handleIncomingConnection(boost::shared_ptr<ip::tcp::socket> socket,
+						   const boost::system::error_code &err) 
+{
+  if (err) {
+    LOG(Log::WARNING) << "Error accepting transparent connection: " << err;
+    backoff.pause();
+    return;
+  }
+
+  ip::tcp::endpoint destination;
+
+  // A connection made to the listener directly, rather than redirected
+  // to it, would otherwise be sent straight back to ourselves.
+  if (!getOriginalDestination(*socket, destination) || 
+      destination == socket->local_endpoint()) 
+    {
+      LOG(Log::DEBUG) << "Transparent connection has no original destination.";
+      socket->close();
+      acceptIncomingConnection();
+      return;
+    }
+
+  std::string host = destination.address().to_string();
+
+  LOG(Log::DEBUG) << "Got transparent connection for " << host << ":" 
+		  << destination.port() << "...";
+
+  boost::shared_ptr<SocketStream> client(new SocketStream(socket));
+  pool.openStream(host, destination.port(), 
+		  boost::bind(&TransparentListener::handleStreamOpen, this, client, _1, _2));
+
+  acceptIncomingConnection();
+}
+
+bool TransparentListener::getOriginalDestination(ip::tcp::socket &socket,
+						 ip::tcp::endpoint &destination)
+{
+#ifdef HAVE_LINUX_NETFILTER_IPV4_H
+  struct sockaddr_in address;
+  socklen_t length = sizeof(address);
+
+  if (getsockopt(socket.native(), SOL_IP, SO_ORIGINAL_DST, &address, &length) != 0)
+    return false;
+
+  destination = ip::tcp::endpoint(ip::address_v4(ntohl(address.sin_addr.s_addr)), 
+				  ntohs(address.sin_port));
+  return true;
+#else
+  return false;
+#endif
+}
+
+void TransparentListener::handleStreamOpen(boost::shared_ptr<SocketStream> client,
+					   boost::shared_ptr<TorTunnelStream> stream,
+					   const boost::system::error_code &err)
+{
+  if (err) {
+    LOG(Log::DEBUG) << "Error opening stream: " << err;
+    client->close();
+    return;
+  }
+
+  boost::shared_ptr<ProxyShuffler> proxyShuffler(new ProxyShuffler(client, stream));
+  proxyShuffler->shuffle();
+}
@@ -0,0 +1,81 @@
+#ifndef __TRANSPARENT_LISTENER_H__
+#define __TRANSPARENT_LISTENER_H__
+
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <boost/shared_ptr.hpp>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <string>
+
+#include "TorTunnel.h"
+#include "TunnelPool.h"
+#include "SocketStream.h"
+#include "ProxyShuffler.h"
+#include "util/AcceptBackoff.h"
+
+using namespace boost::asio;
+
+/***********
+ *
+ * TransparentListener accepts TCP connections that have been sent to
+ * it by an iptables REDIRECT rule, recovers where each one was
+ * originally headed with SO_ORIGINAL_DST, and opens a tunnel stream
+ * there straight away.  There's no handshake with the client at all,
+ * so the stream's BEGIN goes out as soon as the connection is
+ * accepted.  This only works on Linux with netfilter.
+ *
+ **********/
+
+class TransparentListener {
+
+ private:
+  ip::tcp::acceptor acceptor;
+  AcceptBackoff backoff;
+  TunnelPool &pool;
+
+  void acceptIncomingConnection();
+  void handleIncomingConnection(boost::shared_ptr<ip::tcp::socket> socket,
+				const boost::system::error_code &err);
+
+  bool getOriginalDestination(ip::tcp::socket &socket, ip::tcp::endpoint &destination);
+
+  void handleStreamOpen(boost::shared_ptr<SocketStream> client,
+			boost::shared_ptr<TorTunnelStream> stream,
+			const boost::system::error_code &err);
+
+ public:
+  TransparentListener(boost::asio::io_service &io_service, TunnelPool &pool, 
+		      int listenPort, bool reusePort);
+
+  static bool isSupported();
+};
+
+#endif
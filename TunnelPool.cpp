@@ -0,0 +1,480 @@
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "TunnelPool.h"
+#include "util/Log.h"
+#include "util/Util.h"
+
+#include <algorithm>
+#include <cstring>
+
+const uint32_t TunnelPool::SAMPLE_INTERVAL;
+const uint32_t TunnelPool::REBUILD_DELAY_MS;
+const uint32_t TunnelPool::MAX_REBUILD_DELAY_MS;
+
+TunnelPool::TunnelPool(boost::asio::io_service &io_service, Directory &directory,
+		       std::string &exitHost, uint32_t size, TunnelPoolPolicy policy,
+		       bool congestionControl, bool optimisticData,
+		       CircuitBuildTimeout *buildTimeout)
+  : io_service(io_service), directory(directory), exitHost(exitHost), size(size),
+    policy(policy), congestionControl(congestionControl), optimisticData(optimisticData),
+    coalesceDelay(COALESCE_DELAY), standbyEnabled(false), buildTimeout(buildTimeout),
+    building(0), consecutiveFailures(0), samples(0), started(false),
+    failedAt(0), failovers(0), streamsReset(0), sampleTimer(io_service),
+    rebuildTimer(io_service), rebuildsPending(0)
+{}
+
+void TunnelPool::setCoalesceDelay(uint32_t milliseconds) {
+  coalesceDelay = milliseconds;
+}
+
+void TunnelPool::setStandby(bool enabled) {
+  standbyEnabled = enabled;
+}
+
+void TunnelPool::build(TunnelPoolHandler readyHandler, TunnelPoolHandler errorHandler) {
+  this->readyHandler = readyHandler;
+  this->errorHandler = errorHandler;
+
+  for (uint32_t i=0;i<size + (standbyEnabled ? 1 : 0);i++) {
+    building++;
+    buildTunnel(0);
+  }
+
+  scheduleSample();
+}
+
+void TunnelPool::buildTunnel(uint32_t attempts) {
+  RetrieveServerListingHandler handler = boost::bind(&TunnelPool::serverListingComplete, 
+						     this, attempts, _1, _2);
+
+  try {
+    if (exitHost.empty()) directory.getRandomServerListing(handler);
+    else                  directory.getServerListingFor(exitHost, handler);
+  } catch (ServerNotFoundException &e) {
+    LOG(Log::ERROR) << "Unable to find an exit node for tunnel pool.";
+    building--;
+    buildFailed();
+  }
+}
+
+void TunnelPool::serverListingComplete(uint32_t attempts,
+				       boost::shared_ptr<ServerListing> serverListing,
+				       const boost::system::error_code &err)
+{
+  if (err) {
+    LOG(Log::WARNING) << "Error retrieving exit node descriptor: " << err;
+    building--;
+    buildFailed();
+    return;
+  }
+
+  // Two tunnels through the same exit share its bandwidth, which is what
+  // the pool is trying to get away from, so go back for another one.
+
+  if (exitHost.empty() && isInUse(serverListing->getAddress()) && 
+      attempts < MAX_LISTING_ATTEMPTS) 
+  {
+    buildTunnel(attempts + 1);
+    return;
+  }
+
+  LOG(Log::INFO) << "Connecting to exit node: " << serverListing->getAddress() 
+		 << ":" << serverListing->getPort();
+
+  // The tunnel only holds on to its entry weakly, or the two would keep
+  // each other alive.
+  boost::shared_ptr<PooledTunnel> pooled(new PooledTunnel());
+  pooled->tunnel = TorTunnel::create(io_service, serverListing,
+				     boost::bind(&TunnelPool::tunnelError, this, 
+						 boost::weak_ptr<PooledTunnel>(pooled),
+						 placeholders::error));
+
+  pooled->tunnel->setCongestionControl(congestionControl);
+  pooled->tunnel->setOptimisticData(optimisticData);
+  pooled->tunnel->setCoalesceDelay(coalesceDelay);
+  pooled->tunnel->setBuildTimeout(buildTimeout);
+
+  tunnels.push_back(pooled);
+
+  pooled->tunnel->connect(boost::bind(&TunnelPool::tunnelConnectComplete, this,
+				      pooled, placeholders::error));
+}
+
+void TunnelPool::tunnelConnectComplete(boost::shared_ptr<PooledTunnel> pooled,
+				       const boost::system::error_code &err)
+{
+  building--;
+
+  if (err) {
+    LOG(Log::WARNING) << "Error connecting to exit node " 
+		      << pooled->tunnel->nodeConnection.getRemoteNodeAddress() 
+		      << ": " << err;
+
+    pooled->failed = true;
+    tunnels.remove(pooled);
+    retire(pooled);
+    buildFailed();
+    return;
+  }
+
+  // Whichever tunnel finishes once the pool is already at full size
+  // becomes the standby, including the replacement for one promoted.
+  pooled->standby     = standbyEnabled && getActiveCount() >= size;
+  pooled->ready       = true;
+  consecutiveFailures = 0;
+
+  LOG(Log::INFO) << "Tunnel ready"
+		 << Log::field("exit", pooled->tunnel->nodeConnection.getRemoteNodeAddress())
+		 << Log::field("standby", pooled->standby);
+
+  if (failedAt != 0 && !pooled->standby) {
+    LOG(Log::INFO) << "Recovered from tunnel failure"
+		   << Log::field("ms", (Util::getTimeMicros() - failedAt) / 1000);
+    failedAt = 0;
+  }
+
+  if (!started) {
+    started = true;
+    readyHandler(err);
+  }
+}
+
+void TunnelPool::tunnelError(boost::weak_ptr<PooledTunnel> weakPooled,
+			     const boost::system::error_code &err)
+{
+  boost::shared_ptr<PooledTunnel> pooled = weakPooled.lock();
+
+  if (!pooled || pooled->failed) return;
+
+  LOG(Log::WARNING) << "Tunnel failed, replacing it"
+		    << Log::field("exit", pooled->tunnel->nodeConnection.getRemoteNodeAddress())
+		    << Log::field("standby", pooled->standby)
+		    << Log::field("error", err);
+
+  bool serving = pooled->ready && !pooled->standby;
+
+  pooled->failed = true;
+  pooled->ready  = false;
+
+  tunnels.remove(pooled);
+
+  // The circuit notes when it saw the failure, which can be a while
+  // before word of it gets here.
+  uint64_t detectedAt = pooled->tunnel->getFailedAt();
+
+  if (detectedAt == 0)
+    detectedAt = Util::getTimeMicros();
+
+  if (serving && !failover(pooled, detectedAt) && failedAt == 0)
+    failedAt = detectedAt;
+
+  retire(pooled);
+
+  building++;
+  buildTunnel(0);
+}
+
+// Streams on the failed tunnel are lost either way, but new streams go
+// straight to the standby rather than waiting for a replacement to be
+// built.  The replacement then becomes the next standby.  By now the
+// failed circuit has already aborted its streams, so the count of those
+// lost comes from what it noted beforehand.
+
+bool TunnelPool::failover(boost::shared_ptr<PooledTunnel> failed, uint64_t detectedAt) {
+  uint32_t reset = failed->tunnel->getLostStreams();
+  std::list<boost::shared_ptr<PooledTunnel> >::iterator iter;
+
+  streamsReset += reset;
+
+  for (iter = tunnels.begin(); iter != tunnels.end(); iter++) {
+    if (!(*iter)->standby || !(*iter)->ready || (*iter)->failed) continue;
+
+    (*iter)->standby = false;
+    failovers++;
+
+    LOG(Log::INFO) << "Failed over to standby tunnel"
+		   << Log::field("exit", (*iter)->tunnel->nodeConnection.getRemoteNodeAddress())
+		   << Log::field("us", Util::getTimeMicros() - detectedAt)
+		   << Log::field("reset", reset);
+
+    return true;
+  }
+
+  LOG(Log::WARNING) << (standbyEnabled ? "No standby tunnel ready" : "Tunnel lost")
+		    << Log::field("reset", reset);
+
+  return false;
+}
+
+void TunnelPool::buildFailed() {
+  consecutiveFailures++;
+
+  if (selectTunnel() == NULL && consecutiveFailures >= size * MAX_BUILD_FAILURES) {
+    LOG(Log::ERROR) << "Unable to build any tunnels, giving up.";
+    errorHandler(boost::asio::error::not_connected);
+    return;
+  }
+
+  scheduleRebuild();
+}
+
+// Going straight back to a directory or exit that just failed would
+// only fail again, as fast as the loop can go, so each rebuild after a
+// failure waits twice as long as the last did, up to a minute, until a
+// build succeeds.  Failures that come in while one is waiting share its
+// timer.
+
+void TunnelPool::scheduleRebuild() {
+  building++;
+
+  if (rebuildsPending++ > 0) return;
+
+  uint32_t shift = std::min(consecutiveFailures - 1, (uint32_t)8);
+  uint32_t delay = std::min(REBUILD_DELAY_MS << shift, MAX_REBUILD_DELAY_MS);
+
+  LOG(Log::DEBUG) << "Rebuilding tunnel" << Log::field("ms", delay);
+
+  rebuildTimer.expires_from_now(boost::posix_time::milliseconds(delay));
+  rebuildTimer.async_wait(boost::bind(&TunnelPool::rebuild, this, placeholders::error));
+}
+
+void TunnelPool::rebuild(const boost::system::error_code &err) {
+  if (err == boost::asio::error::operation_aborted) return;
+
+  uint32_t pending = rebuildsPending;
+  rebuildsPending  = 0;
+
+  for (uint32_t i=0;i<pending;i++)
+    buildTunnel(0);
+}
+
+// Closing the tunnel fails whatever its streams were still doing.  The
+// tunnel itself goes once the last entry or stream open holding it
+// lets go, and its streams just see it closed from then on.
+
+void TunnelPool::retire(boost::shared_ptr<PooledTunnel> pooled) {
+  pooled->tunnel->close();
+}
+
+void TunnelPool::openStream(std::string &host, uint16_t port, TunnelStreamHandler handler) {
+  assignStream(host, port, handler, 0);
+}
+
+void TunnelPool::resolve(std::string &host, CircuitResolveHandler handler) {
+  boost::shared_ptr<PooledTunnel> pooled = selectTunnel();
+
+  if (!pooled) {
+    std::vector<ResolvedAnswer> answers;
+    io_service.post(boost::bind(handler, answers,
+				boost::system::error_code(boost::asio::error::not_connected)));
+    return;
+  }
+
+  pooled->tunnel->resolve(host, handler);
+}
+
+void TunnelPool::assignStream(std::string host, uint16_t port, 
+			      TunnelStreamHandler handler, uint32_t attempts)
+{
+  boost::shared_ptr<PooledTunnel> pooled = selectTunnel();
+
+  if (!pooled) {
+    io_service.post(boost::bind(handler, boost::shared_ptr<TorTunnelStream>(),
+				boost::system::error_code(boost::asio::error::not_connected)));
+    return;
+  }
+
+  pooled->streamsOpened++;
+  pooled->tunnel->openStream(host, port, boost::bind(&TunnelPool::openStreamComplete, this,
+						     pooled, host, port, handler, 
+						     attempts, _1, _2));
+}
+
+void TunnelPool::openStreamComplete(boost::shared_ptr<PooledTunnel> pooled,
+				    std::string host, uint16_t port,
+				    TunnelStreamHandler handler, uint32_t attempts,
+				    boost::shared_ptr<TorTunnelStream> stream,
+				    const boost::system::error_code &err)
+{
+  if (err && attempts < MAX_OPEN_ATTEMPTS) {
+    // The circuit aborts its streams before it reports its own failure,
+    // so wait for that to land before deciding whether to retry.
+    io_service.post(boost::bind(&TunnelPool::openStreamFailed, this, pooled, host, port,
+				handler, attempts, err));
+    return;
+  }
+
+  handler(stream, err);
+}
+
+void TunnelPool::openStreamFailed(boost::shared_ptr<PooledTunnel> pooled,
+				  std::string host, uint16_t port,
+				  TunnelStreamHandler handler, uint32_t attempts,
+				  const boost::system::error_code &err)
+{
+  if (pooled->failed) {
+    LOG(Log::DEBUG) << "Tunnel failed while opening stream, retrying on another tunnel.";
+    assignStream(host, port, handler, attempts + 1);
+    return;
+  }
+
+  handler(boost::shared_ptr<TorTunnelStream>(), err);
+}
+
+boost::shared_ptr<PooledTunnel> TunnelPool::selectTunnel() {
+  boost::shared_ptr<PooledTunnel> selected;
+  std::list<boost::shared_ptr<PooledTunnel> >::iterator iter;
+
+  for (iter = tunnels.begin(); iter != tunnels.end(); iter++) {
+    if (!(*iter)->ready || (*iter)->failed || (*iter)->standby) continue;
+
+    if (!selected || isPreferred(*iter, selected))
+      selected = *iter;
+  }
+
+  return selected;
+}
+
+bool TunnelPool::isPreferred(boost::shared_ptr<PooledTunnel> candidate,
+			     boost::shared_ptr<PooledTunnel> current)
+{
+  uint32_t candidateStreams = candidate->tunnel->getActiveStreams();
+  uint32_t currentStreams   = current->tunnel->getActiveStreams();
+  uint32_t candidateQueued  = candidate->tunnel->getQueuedBytes();
+  uint32_t currentQueued    = current->tunnel->getQueuedBytes();
+
+  switch (policy) {
+  case POLICY_LEAST_STREAMS:
+    if (candidateStreams != currentStreams) return candidateStreams < currentStreams;
+    return candidateQueued < currentQueued;
+
+  case POLICY_FASTEST:
+    // A tunnel we haven't seen move any data yet gets a chance to be
+    // measured before we settle on the fastest one we know about.
+    if (candidate->throughput != current->throughput) {
+      if (candidate->throughput == 0) return true;
+      if (current->throughput == 0)   return false;
+      return candidate->throughput > current->throughput;
+    }
+
+    return candidateStreams < currentStreams;
+
+  case POLICY_LEAST_QUEUED:
+  default:
+    if (candidateQueued != currentQueued) return candidateQueued < currentQueued;
+    return candidateStreams < currentStreams;
+  }
+}
+
+bool TunnelPool::isInUse(std::string &address) {
+  std::list<boost::shared_ptr<PooledTunnel> >::iterator iter;
+
+  for (iter = tunnels.begin(); iter != tunnels.end(); iter++)
+    if ((*iter)->tunnel->nodeConnection.getRemoteNodeAddress() == address) 
+      return true;
+
+  return false;
+}
+
+uint32_t TunnelPool::getActiveCount() {
+  std::list<boost::shared_ptr<PooledTunnel> >::iterator iter;
+  uint32_t count = 0;
+
+  for (iter = tunnels.begin(); iter != tunnels.end(); iter++)
+    if ((*iter)->ready && !(*iter)->failed && !(*iter)->standby) count++;
+
+  return count;
+}
+
+void TunnelPool::scheduleSample() {
+  sampleTimer.expires_from_now(boost::posix_time::seconds(SAMPLE_INTERVAL));
+  sampleTimer.async_wait(boost::bind(&TunnelPool::sample, this, placeholders::error));
+}
+
+void TunnelPool::sample(const boost::system::error_code &err) {
+  if (err == boost::asio::error::operation_aborted) return;
+
+  std::list<boost::shared_ptr<PooledTunnel> >::iterator iter;
+
+  for (iter = tunnels.begin(); iter != tunnels.end(); iter++) {
+    uint64_t bytes = (*iter)->tunnel->getBytesTransferred();
+    uint32_t rate  = (bytes - (*iter)->lastBytes) / SAMPLE_INTERVAL;
+
+    (*iter)->lastBytes = bytes;
+
+    // Idle intervals say nothing about how fast a tunnel can go.
+    if (rate == 0) continue;
+
+    if ((*iter)->throughput == 0) (*iter)->throughput = rate;
+    else                          (*iter)->throughput = ((*iter)->throughput * 3 + rate) / 4;
+  }
+
+  if (++samples % REPORT_SAMPLES == 0)
+    report();
+
+  scheduleSample();
+}
+
+void TunnelPool::report() {
+  std::list<boost::shared_ptr<PooledTunnel> >::iterator iter;
+  uint32_t ready = 0;
+
+  for (iter = tunnels.begin(); iter != tunnels.end(); iter++)
+    if ((*iter)->ready) ready++;
+
+  LOG(Log::INFO) << "Tunnel pool"
+		 << Log::field("ready", ready)
+		 << Log::field("size", size + (standbyEnabled ? 1 : 0))
+		 << Log::field("building", building)
+		 << Log::field("failovers", failovers)
+		 << Log::field("reset", streamsReset);
+
+  for (iter = tunnels.begin(); iter != tunnels.end(); iter++) {
+    if (!(*iter)->ready) continue;
+
+    LOG(Log::INFO) << "Tunnel"
+		   << Log::field("exit", (*iter)->tunnel->nodeConnection.getRemoteNodeAddress())
+		   << Log::field("standby", (*iter)->standby)
+		   << Log::field("streams", (*iter)->tunnel->getActiveStreams())
+		   << Log::field("opened", (*iter)->streamsOpened)
+		   << Log::field("queued", (*iter)->tunnel->getQueuedBytes())
+		   << Log::field("throughput", (*iter)->throughput)
+		   << Log::field("transferred", (*iter)->tunnel->getBytesTransferred());
+  }
+}
+
+bool TunnelPool::parsePolicy(const char *name, TunnelPoolPolicy *policy) {
+  if      (strcmp(name, "queued") == 0)  *policy = POLICY_LEAST_QUEUED;
+  else if (strcmp(name, "streams") == 0) *policy = POLICY_LEAST_STREAMS;
+  else if (strcmp(name, "fastest") == 0) *policy = POLICY_FASTEST;
+  else                                   return false;
+
+  return true;
+}
@@ -0,0 +1,171 @@
+#ifndef __TUNNEL_POOL_H__
+#define __TUNNEL_POOL_H__
+
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <string>
+#include <list>
+
+#include "TorTunnel.h"
+#include "protocol/Directory.h"
+#include "protocol/CircuitBuildTimeout.h"
+
+using namespace boost::asio;
+
+typedef boost::function<void (const boost::system::error_code &error)> TunnelPoolHandler;
+
+enum TunnelPoolPolicy {
+  POLICY_LEAST_QUEUED,
+  POLICY_LEAST_STREAMS,
+  POLICY_FASTEST
+};
+
+struct PooledTunnel {
+  boost::shared_ptr<TorTunnel> tunnel;
+  bool ready;
+  bool failed;
+  bool standby;
+  uint64_t lastBytes;
+  uint32_t throughput;
+  uint32_t streamsOpened;
+
+  PooledTunnel() 
+    : ready(false), failed(false), standby(false), lastBytes(0), 
+      throughput(0), streamsOpened(0)
+  {}
+};
+
+/***********
+ *
+ * TunnelPool keeps a set of tunnels to distinct exit nodes and hands
+ * each new stream to one of them according to a policy, so that no
+ * single exit's bandwidth or circuit window limits the whole proxy.
+ * Tunnels that fail are retired and replaced, and streams that were
+ * still opening on them are retried on a surviving tunnel.  With a
+ * standby, one extra tunnel is kept built but idle, and takes over the
+ * moment a tunnel in use fails instead of waiting on a rebuild.
+ *
+ **********/
+
+class TunnelPool {
+
+ private:
+  static const uint32_t MAX_LISTING_ATTEMPTS = 10;
+  static const uint32_t MAX_OPEN_ATTEMPTS    = 3;
+  static const uint32_t MAX_BUILD_FAILURES   = 3;
+  static const uint32_t SAMPLE_INTERVAL      = 5;
+  static const uint32_t REPORT_SAMPLES       = 6;
+  static const uint32_t REBUILD_DELAY_MS     = 250;
+  static const uint32_t MAX_REBUILD_DELAY_MS = 60000;
+
+  boost::asio::io_service &io_service;
+  Directory &directory;
+  std::string exitHost;
+  uint32_t size;
+  TunnelPoolPolicy policy;
+  bool congestionControl;
+  bool optimisticData;
+  uint32_t coalesceDelay;
+  bool standbyEnabled;
+  CircuitBuildTimeout *buildTimeout;
+
+  std::list<boost::shared_ptr<PooledTunnel> > tunnels;
+  uint32_t building;
+  uint32_t consecutiveFailures;
+  uint32_t samples;
+  bool started;
+
+  uint64_t failedAt;
+  uint32_t failovers;
+  uint32_t streamsReset;
+
+  TunnelPoolHandler readyHandler;
+  TunnelPoolHandler errorHandler;
+  deadline_timer sampleTimer;
+  deadline_timer rebuildTimer;
+  uint32_t rebuildsPending;
+
+  void buildTunnel(uint32_t attempts);
+  void serverListingComplete(uint32_t attempts,
+			     boost::shared_ptr<ServerListing> serverListing,
+			     const boost::system::error_code &err);
+  void tunnelConnectComplete(boost::shared_ptr<PooledTunnel> pooled,
+			     const boost::system::error_code &err);
+  void tunnelError(boost::weak_ptr<PooledTunnel> weakPooled,
+		   const boost::system::error_code &err);
+  void buildFailed();
+  void scheduleRebuild();
+  void rebuild(const boost::system::error_code &err);
+  void retire(boost::shared_ptr<PooledTunnel> pooled);
+  bool failover(boost::shared_ptr<PooledTunnel> failed, uint64_t detectedAt);
+
+  void assignStream(std::string host, uint16_t port, TunnelStreamHandler handler,
+		    uint32_t attempts);
+  void openStreamComplete(boost::shared_ptr<PooledTunnel> pooled,
+			  std::string host, uint16_t port, 
+			  TunnelStreamHandler handler, uint32_t attempts,
+			  boost::shared_ptr<TorTunnelStream> stream,
+			  const boost::system::error_code &err);
+  void openStreamFailed(boost::shared_ptr<PooledTunnel> pooled,
+			std::string host, uint16_t port, 
+			TunnelStreamHandler handler, uint32_t attempts,
+			const boost::system::error_code &err);
+
+  boost::shared_ptr<PooledTunnel> selectTunnel();
+  bool isPreferred(boost::shared_ptr<PooledTunnel> candidate,
+		   boost::shared_ptr<PooledTunnel> current);
+  bool isInUse(std::string &address);
+  uint32_t getActiveCount();
+
+  void scheduleSample();
+  void sample(const boost::system::error_code &err);
+  void report();
+
+ public:
+  TunnelPool(boost::asio::io_service &io_service, Directory &directory,
+	     std::string &exitHost, uint32_t size, TunnelPoolPolicy policy,
+	     bool congestionControl, bool optimisticData, 
+	     CircuitBuildTimeout *buildTimeout);
+
+  void setCoalesceDelay(uint32_t milliseconds);
+  void setStandby(bool enabled);
+  void build(TunnelPoolHandler readyHandler, TunnelPoolHandler errorHandler);
+  void openStream(std::string &host, uint16_t port, TunnelStreamHandler handler);
+  void resolve(std::string &host, CircuitResolveHandler handler);
+
+  static bool parsePolicy(const char *name, TunnelPoolPolicy *policy);
+};
+
+#endif
@@ -37,16 +37,22 @@ Cell::Cell(uint16_t id, unsigned char type) {
   Util::int16ToArrayBigEndian(buffer, id);
   buffer[2] = type;
   index     = 3;
+  traceTime = 0;
 }
 
 Cell::Cell() {
-  index = 3;
+  index     = 3;
+  traceTime = 0;
 }
 
 unsigned char Cell::getType() {
   return buffer[2];
 }
 
+uint16_t Cell::getCircuitId() {
+  return Util::bigEndianArrayToShort(buffer);
+}
+
 void Cell::append(uint16_t val) {
   Util::int16ToArrayBigEndian(buffer+index, val);
   index+=2;
@@ -47,6 +47,7 @@ class Cell {
  protected:
   unsigned char buffer[512];
   int index;
+  uint64_t traceTime;
 
  public:
   static const int PADDING_TYPE = 0;
@@ -74,9 +75,13 @@ class Cell {
   int getPayloadSize();
 
   unsigned char getType();
+  uint16_t getCircuitId();
   bool isRelayCell();
   bool isPaddingCell();
 
+  uint64_t getTraceTime()            { return traceTime; }
+  void setTraceTime(uint64_t time)   { traceTime = time; }
+
   virtual ~Cell() {}
 };
 
@@ -28,9 +28,20 @@
  */
 
 #include "CellConsumer.h" 
+#include "../util/CellTrace.h"
+#include "../util/LoopProfiler.h"
+#include "../util/Metrics.h"
+#include "../util/Probes.h"
 
 #include <cassert>
 
+static Counter cellsRead("tortunnel_cells_total", "direction=\"in\"",
+			 "Cells exchanged with exit nodes.");
+static Counter dataBytesRead("tortunnel_stream_bytes_total", "direction=\"in\"",
+			     "Stream payload bytes exchanged with exit nodes.");
+
+HANDLER_TAG(cellHandler, "circuit.cell");
+
 CellConsumer::CellConsumer(Connection &connection, 
 			   CellEncrypter &encrypter,
 			   CellListener &listener) :
@@ -45,8 +56,9 @@ void CellConsumer::consume() {
   if (closed) return;
 
   boost::shared_ptr<Cell> cell(new Cell());
-  connection.readCell(cell, boost::bind(&CellConsumer::readCellComplete, this,
-					cell, placeholders::error));
+  connection.readCell(cell, LoopProfiler::wrap(cellHandler, 
+					       boost::bind(&CellConsumer::readCellComplete, this,
+							   cell, placeholders::error)));
 }
 
 void CellConsumer::readCellComplete( boost::shared_ptr<Cell> cell,
@@ -59,6 +71,12 @@ void CellConsumer::readCellComplete( boost::shared_ptr<Cell> cell,
     return;
   }
 
+  cellsRead.increment();
+  PROBE3(cell_read, cell->getCircuitId(), cell->getType(), cell->getBufferSize());
+
+  if (CellTrace::sample())
+    cell->setTraceTime(CellTrace::advance(CellTrace::DOWN_TLS_READ, connection.getLastReadTime()));
+
   switch (cell->getType()) {
   case Cell::PADDING_TYPE: break;
   case Cell::RELAY_TYPE:
@@ -75,12 +93,17 @@ void CellConsumer::readCellComplete( boost::shared_ptr<Cell> cell,
 void CellConsumer::handleRelayCell(boost::shared_ptr<RelayCell> cell) {
   try {
     encrypter.decrypt(*cell);
-    
+    cell->setTraceTime(CellTrace::advance(CellTrace::DOWN_DECRYPT, cell->getTraceTime()));
+
     switch (cell->getRelayType()) {
     case RelayCell::DATA_TYPE:
+      dataBytesRead.increment(cell->getRelayPayloadLength());
+      listener.handleDataCell(cell);
+      break;
     case RelayCell::END_TYPE:       listener.handleDataCell(cell);    break;
     case RelayCell::CONNECTED_TYPE: listener.handleConnected(cell);   break;
     case RelayCell::SENDME_TYPE:    listener.handleSendMe(cell);      break;
+    case RelayCell::RESOLVED_TYPE:  listener.handleResolved(cell);    break;
     case RelayCell::DROP_TYPE:                                        break;
     }
   } catch (CryptoMismatchException &e) {
@@ -33,6 +33,7 @@
 #include <cassert>
 #include <openssl/sha.h>
 
+#include "../util/Probes.h"
 #include "../util/Util.h"
 
 #define TOTAL_KEY_MATERIAL (20*3+16*2)
@@ -160,6 +161,9 @@ void CellEncrypter::verifyDigestForCell(RelayCell &cell) {
 }
 
 void CellEncrypter::encrypt(RelayCell &cell) {
+  PROBE4(relay_encrypt, cell.getCircuitId(), cell.getStreamId(), cell.getRelayType(), 
+	 cell.getRelayPayloadLength());
+
   setDigestForCell(cell);
 
 //   std::cerr << "Cell Before Encryption: " << std::endl;
@@ -171,4 +175,7 @@ void CellEncrypter::encrypt(RelayCell &cell) {
 void CellEncrypter::decrypt(RelayCell &cell) {
   aesOperate(cell, &backKey, backIV, backEC, &backAesNum);
   verifyDigestForCell(cell);
+
+  PROBE4(relay_decrypt, cell.getCircuitId(), cell.getStreamId(), cell.getRelayType(), 
+	 cell.getRelayPayloadLength());
 }
@@ -46,6 +46,7 @@ class CellListener {
   virtual void handleDataCell(boost::shared_ptr<RelayCell> cell) = 0;
   virtual void handleConnected(boost::shared_ptr<RelayCell> cell) = 0;
   virtual void handleSendMe(boost::shared_ptr<RelayCell> cell) = 0;
+  virtual void handleResolved(boost::shared_ptr<RelayCell> cell) = 0;
   virtual void handleCryptoException(boost::shared_ptr<RelayCell> cell) = 0;
 
 };
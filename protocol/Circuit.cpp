@@ -28,6 +28,11 @@
  */
 
 #include "Connection.h"
+#include "../util/CellTrace.h"
+#include "../util/Log.h"
+#include "../util/LoopProfiler.h"
+#include "../util/Metrics.h"
+#include "../util/Probes.h"
 #include "Cell.h"
 #include "Circuit.h"
 #include "HybridEncryption.h"
@@ -51,14 +56,45 @@ using namespace std;
 
 #define MIN(a,b) ((a)<(b)?(a):(b))
 
+static const uint64_t BUILD_BUCKETS[] = {50, 100, 200, 400, 800, 1600, 3200, 6400, 12800};
+
+static Counter circuitsBuilt("tortunnel_circuit_builds_total", "result=\"success\"",
+			     "Circuits created with exit nodes.");
+static Counter circuitsFailed("tortunnel_circuit_builds_total", "result=\"failure\"",
+			      "Circuits created with exit nodes.");
+static Histogram circuitBuildTime("tortunnel_circuit_build_milliseconds", "",
+				  "Time from CREATE to a verified CREATED.",
+				  BUILD_BUCKETS, sizeof(BUILD_BUCKETS) / sizeof(uint64_t));
+static Counter sendMesReceived("tortunnel_sendme_total", "direction=\"in\"",
+			       "SENDME cells exchanged with exit nodes.");
+static Counter sendMesSent("tortunnel_sendme_total", "direction=\"out\"",
+			   "SENDME cells exchanged with exit nodes.");
+static Counter cryptoFailures("tortunnel_crypto_failures_total", "",
+			      "Relay cells that failed to decrypt or verify.");
+static Counter streamsOpened("tortunnel_streams_opened_total", "",
+			     "Streams allocated on circuits.");
+static Counter dataBytesWritten("tortunnel_stream_bytes_total", "direction=\"out\"",
+				"Stream payload bytes exchanged with exit nodes.");
+
+HANDLER_TAG(createdHandler, "circuit.created");
+HANDLER_TAG(coalesceHandler, "circuit.coalesce");
+
 Circuit::Circuit(Connection &conn, RSA *onionKey, uint16_t id, 
 		 CircuitErrorListener *errorListener) :
-  connection(conn), 
-  circuitId(id), 
   onionKey(onionKey), 
+  circuitId(id), 
+  circuitWindow(CIRCUIT_WINDOW_START),
+  circuitConsumedCells(0),
+  streamBufferLimit(STREAM_BUFFER_LIMIT),
+  circuitBufferLimit(CIRCUIT_BUFFER_LIMIT),
+  bytesRead(0), bytesWritten(0), createStarted(0), failedAt(0), lostStreams(0),
+  errorListener(errorListener),
+  connection(conn), 
   cellConsumer(conn, cellEncrypter, *this),
-  circuitWindow(1000),
-  errorListener(errorListener)
+  dispatcher(id, streams, *this),
+  congestionControlEnabled(false),
+  coalesceDelay(COALESCE_DELAY),
+  coalesceTimer(conn.getIoService())
 {
   assert(onionKey != NULL);
 
@@ -90,6 +126,7 @@ void Circuit::sendCreateCellComplete(CircuitConnectHandler handler,
 				     const boost::system::error_code &err) 
 {
   if (err) {
+    circuitsFailed.increment();
     handler(err);
     return;
   }
@@ -99,8 +136,9 @@ void Circuit::sendCreateCellComplete(CircuitConnectHandler handler,
 
 void Circuit::readCreatedCell(CircuitConnectHandler handler) {
   boost::shared_ptr<CreatedCell> response(new CreatedCell(dh));
-  connection.readCell(response, boost::bind(&Circuit::readCreatedCellComplete, this,
-					     handler, response, placeholders::error));
+  connection.readCell(response, LoopProfiler::wrap(createdHandler,
+						   boost::bind(&Circuit::readCreatedCellComplete, this,
+							       handler, response, placeholders::error)));
 }
 
 void Circuit::readCreatedCellComplete(CircuitConnectHandler handler, 
@@ -112,7 +150,8 @@ void Circuit::readCreatedCellComplete(CircuitConnectHandler handler,
 
   try {
     if (err || !response->isValid()) {
-      std::cerr << "Created Cell Not Valid..." << std::endl;
+      LOG(Log::WARNING) << "Created Cell Not Valid...";
+      circuitsFailed.increment();
       handler(err ? err : boost::asio::error::invalid_argument);
       return;
     }    
@@ -121,55 +160,77 @@ void Circuit::readCreatedCellComplete(CircuitConnectHandler handler,
     cellEncrypter.setKeyMaterial(keyMaterial, keyMaterialLength, verifier);
 
   } catch (CryptoMismatchException &e) {
-    std::cerr << "Got a crypto mismatch exception(" << getRemoteNodeAddress() <<"): " 
-	      << e.what() << std::endl;
+    LOG(Log::WARNING) << "Got a crypto mismatch exception(" << getRemoteNodeAddress() <<"): " 
+		      << e.what();
+    circuitsFailed.increment();
     if (keyMaterial) free(keyMaterial);
     handler(boost::asio::error::invalid_argument);
     return;
   }
 
+  circuitsBuilt.increment();
+  circuitBuildTime.observe((Util::getTimeMicros() - createStarted) / 1000);
+
   free(keyMaterial);
   cellConsumer.consume();
   handler(err);
 }
 
-void Circuit::sendBeginCell(uint16_t streamId, std::string &address, 
+void Circuit::sendBeginCell(uint16_t streamId, std::string &address, bool optimistic,
 			    CircuitConnectHandler handler) 
 {
   boost::shared_ptr<RelayBeginCell> beginCell(new RelayBeginCell(circuitId, streamId, address));
 
+  PROBE3(stream_open, circuitId, streamId, optimistic);
+
   cellEncrypter.encrypt(*beginCell);
   connection.writeCell(*beginCell, boost::bind(&Circuit::sendBeginCellComplete, this,
-						handler, streamId, beginCell, 
+						handler, streamId, optimistic, beginCell, 
 						placeholders::error));
 }
 
 void Circuit::sendBeginCellComplete(CircuitConnectHandler handler, 
-				    uint16_t streamId,
+				    uint16_t streamId, bool optimistic,
 				    boost::shared_ptr<RelayBeginCell> beginCell,
 				    const boost::system::error_code &err) 
 {
   if (err) {
-    std::cerr << "begincell write error" << std::endl;
+    LOG(Log::DEBUG) << "begincell write error";
+
+    // Nobody gets a stream to close, so the slot is given back here.
+    dispatcher.removeStreamId(streamId);
     handler(err);
     return;
   }
-  
-  dispatcher.dispatchConnectedCellRequest(streamId, handler);
+
+  if (optimistic) handler(err);
+  else            dispatcher.dispatchConnectedCellRequest(streamId, handler);
+}
+
+// The streams are aborted before the listener hears about the failure,
+// so how many were lost, and when, is noted first for it to look at.
+
+void Circuit::recordFailure() {
+  failedAt    = Util::getTimeMicros();
+  lostStreams = streams.getActiveStreams();
 }
 
 void Circuit::handleConnectionError(const boost::system::error_code &err) {
-  std::cerr << "handle connectoin error" << std::endl;
+  LOG(Log::DEBUG) << "handle connectoin error";
+  recordFailure();
+  dispatcher.abortStreams(err);
   errorListener->handleConnectionError(err);
 }
 
 void Circuit::handleDestroyCell(boost::shared_ptr<Cell> cell) {
-  std::cerr << "handle destroy cell" << std::endl;
+  LOG(Log::DEBUG) << "handle destroy cell";
+  recordFailure();
+  dispatcher.abortStreams(boost::asio::error::connection_reset);
   errorListener->handleCircuitDestroyed();
 }
 
 void Circuit::handleUnknownCell(boost::shared_ptr<Cell> cell) {
-  std::cerr << "Error: Got unexpected cell type: " << cell->getType() << std::endl;
+  LOG(Log::WARNING) << "Error: Got unexpected cell type: " << cell->getType();
 }
 
 void Circuit::handleConnected(boost::shared_ptr<RelayCell> cell) {
@@ -177,30 +238,121 @@ void Circuit::handleConnected(boost::shared_ptr<RelayCell> cell) {
 }
 
 void Circuit::handleDataCell(boost::shared_ptr<RelayCell> cell) {
-  decrementWindows(cell->getStreamId());
+  if (!cell->isRelayEnd()) {
+    decrementWindows(cell->getStreamId());
+    bytesRead += cell->getRelayPayloadLength();
+  }
+
   dispatcher.dispatchDataCell(cell);
 }
 
 void Circuit::handleSendMe(boost::shared_ptr<RelayCell> cell) {
-  std::cerr << "Got SendMe, ignoring..." << std::endl;
+  sendMesReceived.increment();
+
+  if (!congestionControlEnabled) {
+    LOG(Log::DEBUG) << "Got SendMe, ignoring...";
+    return;
+  }
+
+  // Stream-level SENDMEs don't tell us anything about the circuit.
+  if (cell->getStreamId() == 0 && congestionControl.sendMeReceived())
+    flushPendingCells();
+}
+
+void Circuit::handleResolved(boost::shared_ptr<RelayCell> cell) {
+  dispatcher.dispatchResolvedCell(cell);
 }
 
 void Circuit::handleCryptoException(boost::shared_ptr<RelayCell> cell) {
-  std::cerr << "Got crypto exception!  Continuing with hope..." << std::endl;
+  LOG(Log::WARNING) << "Got crypto exception!  Continuing with hope...";
+  cryptoFailures.increment();
 }
 
 void Circuit::decrementWindows(uint16_t streamId) {
-  if (--circuitWindow <= 900) {
-    sendWindowUpdate(0);
-    circuitWindow += 100;
-  }
+  if (circuitWindow == 0) LOG(Log::WARNING) << "Exit overran the circuit window!";
+  else                    circuitWindow--;
 
-  streamWindows[streamId] = streamWindows[streamId] - 1;
+  StreamSlot *slot = streams.get(streamId);
 
-  if (streamWindows[streamId] <= 450) {
-    sendWindowUpdate(streamId);
-    streamWindows[streamId] = 500;
-  }
+  if (slot == NULL) return;
+
+  if (slot->deliverWindow == 0) LOG(Log::WARNING) << "Exit overran stream window: " << streamId;
+  else                          slot->deliverWindow--;
+}
+
+// SENDMEs only go out for cells that have actually been handed to a
+// reader, and not at all while too much is still sitting in the buffers,
+// so a slow SOCKS client holds the exit back instead of our memory.
+
+void Circuit::handleCellsConsumed(uint16_t streamId, uint32_t cells) {
+  circuitConsumedCells += cells;
+
+  StreamSlot *slot = streams.get(streamId);
+
+  if (slot != NULL)
+    slot->consumedCells += cells;
+
+  sendWindowUpdates(streamId);
+}
+
+void Circuit::sendWindowUpdates(uint16_t streamId) {
+  while (circuitConsumedCells >= CIRCUIT_WINDOW_INCREMENT &&
+	 dispatcher.getBufferedBytes() <= circuitBufferLimit)
+    {
+      sendWindowUpdate(0);
+      circuitConsumedCells -= CIRCUIT_WINDOW_INCREMENT;
+      circuitWindow        += CIRCUIT_WINDOW_INCREMENT;
+    }
+
+  StreamSlot *slot = streams.get(streamId);
+
+  if (slot == NULL) return;
+
+  while (slot->consumedCells >= STREAM_WINDOW_INCREMENT &&
+	 slot->bufferedBytes <= streamBufferLimit)
+    {
+      sendWindowUpdate(streamId);
+      slot->consumedCells -= STREAM_WINDOW_INCREMENT;
+      slot->deliverWindow += STREAM_WINDOW_INCREMENT;
+    }
+}
+
+void Circuit::setBufferLimits(uint32_t streamLimit, uint32_t circuitLimit) {
+  streamBufferLimit  = streamLimit;
+  circuitBufferLimit = circuitLimit;
+}
+
+uint32_t Circuit::getBufferedBytes(uint16_t streamId) {
+  StreamSlot *slot = streams.get(streamId);
+
+  return slot == NULL ? 0 : slot->bufferedBytes;
+}
+
+// When the last traced cell handed to this stream's reader was delivered,
+// or zero if there isn't one that hasn't already been asked about.
+
+uint64_t Circuit::takeTrace(uint16_t streamId) {
+  return dispatcher.takeTrace(streamId);
+}
+
+uint32_t Circuit::getBufferedBytes() {
+  return dispatcher.getBufferedBytes();
+}
+
+// Everything we're holding for this circuit in either direction: data the
+// exit sent that nobody has read yet, plus cells still waiting on the
+// congestion window.
+
+uint32_t Circuit::getQueuedBytes() {
+  return dispatcher.getBufferedBytes() + (pendingCells.size() * (MAX_PAYLOAD_LENGTH));
+}
+
+uint64_t Circuit::getBytesRead() {
+  return bytesRead;
+}
+
+uint64_t Circuit::getBytesWritten() {
+  return bytesWritten;
 }
 
 void Circuit::sendWindowUpdateComplete(boost::shared_ptr<RelaySendMeCell> cell,
@@ -209,6 +361,7 @@ void Circuit::sendWindowUpdateComplete(boost::shared_ptr<RelaySendMeCell> cell,
 
 void Circuit::sendWindowUpdate(uint16_t streamId) {
   boost::shared_ptr<RelaySendMeCell> cell(new RelaySendMeCell(circuitId, streamId));
+  sendMesSent.increment();
   cellEncrypter.encrypt(*cell);
   connection.writeCell(*cell, boost::bind(&Circuit::sendWindowUpdateComplete,
 					   this, cell, placeholders::error));
@@ -220,12 +373,37 @@ void Circuit::closeComplete(boost::shared_ptr<RelayEndCell> cell,
 
 void Circuit::close() {
   cellConsumer.close();
+  dispatcher.abortStreams(boost::asio::error::operation_aborted);
 }
 
 void Circuit::close(uint16_t streamId) {
-  std::cerr << "CIRCUIT: Close called..." << std::endl;
+  LOG(Log::DEBUG) << "CIRCUIT: Close called...";
+
+  StreamSlot *slot = streams.get(streamId);
+
+  if (slot != NULL)
+    PROBE4(stream_close, circuitId, streamId, slot->bytesRead, slot->bytesWritten);
+
+  // Any read or connect request still pending on the stream is the
+  // closer's own, so it's dropped rather than called back.
+  bool remoteClosed = dispatcher.isRemoteClosed(streamId);
+
+  if (!remoteClosed)
+    flush(streamId);
+
+  dispatcher.removeStreamId(streamId);
+
+  if (remoteClosed) return;
 
   boost::shared_ptr<RelayEndCell> relayEnd(new RelayEndCell(circuitId, streamId));
+
+  // Don't let the END overtake data that's still waiting on the window.
+  if (congestionControlEnabled) {
+    pendingCells.push_back(PendingCell(relayEnd, CircuitWriteHandler(), false));
+    flushPendingCells();
+    return;
+  }
+
   cellEncrypter.encrypt(*relayEnd);
   connection.writeCell(*relayEnd, boost::bind(&Circuit::closeComplete, this,
 					       relayEnd, placeholders::error));
@@ -233,41 +411,276 @@ void Circuit::close(uint16_t streamId) {
 
 // Public
 
+uint16_t Circuit::allocateStream() {
+  uint16_t streamId = dispatcher.addStream();
+
+  if (streamId != 0) 
+    streamsOpened.increment();
+
+  return streamId;
+}
+
 void Circuit::connect(uint16_t streamId, std::string &address, CircuitConnectHandler handler) {
-  dispatcher.addStreamId(streamId);
-  streamWindows[streamId] = 500;
-  sendBeginCell(streamId, address, handler);
+  sendBeginCell(streamId, address, false, handler);
+}
+
+// Completes as soon as BEGIN has been written rather than when CONNECTED
+// comes back, so the caller can start writing data immediately.  Cells
+// go out in the order they're written, so that data lands behind BEGIN.
+
+void Circuit::connectOptimistic(uint16_t streamId, std::string &address, 
+				CircuitConnectHandler handler) 
+{
+  StreamSlot *slot = streams.get(streamId);
+
+  if (slot != NULL)
+    slot->optimistic = true;
+
+  sendBeginCell(streamId, address, true, handler);
+}
+
+void Circuit::resolve(uint16_t streamId, std::string &hostname, 
+		      CircuitResolveHandler handler) 
+{
+  boost::shared_ptr<RelayResolveCell> resolveCell(new RelayResolveCell(circuitId, streamId, 
+									 hostname));
+
+  dispatcher.dispatchResolvedCellRequest(streamId, handler);
+
+  cellEncrypter.encrypt(*resolveCell);
+  connection.writeCell(*resolveCell, boost::bind(&Circuit::sendResolveCellComplete, this,
+						  resolveCell, placeholders::error));
+}
+
+void Circuit::sendResolveCellComplete(boost::shared_ptr<RelayResolveCell> cell,
+				      const boost::system::error_code &err)
+{
+  if (err)
+    LOG(Log::DEBUG) << "resolvecell write error";
 }
 
 void Circuit::create(CircuitConnectHandler handler) {
-  circuitWindow = 1000;
+  circuitWindow = CIRCUIT_WINDOW_START;
+  createStarted = Util::getTimeMicros();
   sendCreateCell(onionKey, handler);
 }
 
+void Circuit::enableCongestionControl() {
+  congestionControlEnabled = true;
+}
+
+CongestionControl& Circuit::getCongestionControl() {
+  return congestionControl;
+}
+
 void Circuit::writeComplete(boost::shared_ptr<RelayDataCell> dataCell,
 			    const boost::system::error_code &err) {}
 
+void Circuit::pendingWriteComplete(boost::shared_ptr<RelayCell> cell,
+				   CircuitWriteHandler handler,
+				   const boost::system::error_code &err)
+{
+  if (handler) handler(err);
+}
+
+void Circuit::flushPendingCells() {
+  while (!pendingCells.empty()) {
+    PendingCell &pending = pendingCells.front();
+
+    if (pending.windowed) {
+      if (!congestionControl.canSend()) break;
+      congestionControl.cellSent();
+    }
+
+    pending.cell->setTraceTime(CellTrace::advance(CellTrace::UP_WINDOW, 
+						  pending.cell->getTraceTime()));
+
+    // Cells are encrypted in the order they hit the wire, not the order
+    // they were queued in, or the relay crypto state falls out of sync.
+    cellEncrypter.encrypt(*pending.cell);
+    pending.cell->setTraceTime(CellTrace::advance(CellTrace::UP_ENCRYPT, 
+						  pending.cell->getTraceTime()));
+    connection.writeCell(*pending.cell, boost::bind(&Circuit::pendingWriteComplete, this,
+						     pending.cell, pending.handler,
+						     placeholders::error));
+    pendingCells.pop_front();
+  }
+}
+
 void Circuit::write(uint16_t streamId, 
 		    unsigned char* buf, int length, 
 		    CircuitWriteHandler handler) 
 {
-  int i;
+  std::vector<boost::asio::const_buffer> buffers;
+  buffers.push_back(boost::asio::const_buffer(buf, length));
+
+  writev(streamId, buffers, handler);
+}
+
+// Payload is gathered across the buffers into full cells.  Whatever is
+// left over that doesn't fill a cell is held back for a moment in case
+// more is on its way, rather than going out as a short cell right
+// behind a full one; it's sent when the stream is flushed, when the
+// coalescing delay runs out, or when more data fills it up.
+
+void Circuit::writev(uint16_t streamId, 
+		     std::vector<boost::asio::const_buffer> &buffers,
+		     CircuitWriteHandler handler) 
+{
+  StreamSlot *slot = streams.get(streamId);
+  std::vector<boost::asio::const_buffer>::iterator iter = buffers.begin();
+  unsigned char payload[MAX_PAYLOAD_LENGTH];
+  std::size_t total     = boost::asio::buffer_size(buffers);
+  std::size_t remaining = total;
+  std::size_t offset    = 0;
+  int length            = 0;
+  uint64_t traceTime    = 0;
+
+  bytesWritten += total;
+
+  if (slot != NULL) {
+    slot->bytesWritten += total;
+
+    length              = slot->partial.size();
+    traceTime           = slot->partialTraced;
+    slot->partialTraced = 0;
+
+    if (length > 0) memcpy(payload, &slot->partial[0], length);
+    slot->partial.clear();
+  }
+
+  // A traced cell starts the clock when its first byte comes in.
+  if (traceTime == 0 && CellTrace::sample())
+    traceTime = Util::getTimeMicros();
   
-  for (i=0;i<length;i+=(MAX_PAYLOAD_LENGTH)) {
-    boost::shared_ptr<RelayDataCell> dataCell(new RelayDataCell(circuitId, streamId, 
-								buf+i, 
-								MIN(MAX_PAYLOAD_LENGTH, 
-								    length-i)));
-
-    cellEncrypter.encrypt(*dataCell);
-    connection.writeCell(*dataCell, ((length-i <= MAX_PAYLOAD_LENGTH) ? handler : boost::bind(&Circuit::writeComplete, this, dataCell, placeholders::error)));
+  while (remaining > 0) {
+    while (length < (MAX_PAYLOAD_LENGTH) && iter != buffers.end()) {
+      std::size_t available = boost::asio::buffer_size(*iter) - offset;
+      std::size_t copied    = MIN(available, (std::size_t)((MAX_PAYLOAD_LENGTH) - length));
+
+      memcpy(payload + length, boost::asio::buffer_cast<const unsigned char*>(*iter) + offset, 
+	     copied);
+
+      length    += copied;
+      offset    += copied;
+      remaining -= copied;
+
+      if (offset == boost::asio::buffer_size(*iter)) {
+	iter++;
+	offset = 0;
+      }
+    }
+
+    if (length < (MAX_PAYLOAD_LENGTH) && slot != NULL && coalesceDelay > 0) 
+      break;
+
+    sendDataCell(streamId, slot, payload, length, traceTime,
+		 (remaining == 0 ? handler : CircuitWriteHandler()));
+    length    = 0;
+    traceTime = 0;
+  }
+
+  if (length > 0) {
+    if (slot->partial.capacity() == 0) slot->partial.reserve(MAX_PAYLOAD_LENGTH);
+    slot->partial.assign(payload, payload + length);
+    slot->partialTraced = traceTime;
+
+    if (partialStreams.empty()) {
+      coalesceTimer.expires_from_now(boost::posix_time::milliseconds(coalesceDelay));
+      coalesceTimer.async_wait(LoopProfiler::wrap(coalesceHandler,
+						  boost::bind(&Circuit::coalesceTimerExpired, this,
+							      placeholders::error)));
+    }
+
+    partialStreams.push_back(streamId);
+  }
+
+  // If the last of this write is being held back, the caller has been
+  // told nothing yet, but as far as it's concerned the data is ours now.
+  if (length > 0 || total == 0)
+    connection.getIoService().post(boost::bind(&Circuit::writeAccepted, this, handler));
+}
+
+void Circuit::writeAccepted(CircuitWriteHandler handler) {
+  handler(boost::system::error_code());
+}
+
+void Circuit::sendDataCell(uint16_t streamId, StreamSlot *slot, 
+			   unsigned char *payload, int length, uint64_t traceTime,
+			   CircuitWriteHandler handler)
+{
+  boost::shared_ptr<RelayDataCell> dataCell(new RelayDataCell(circuitId, streamId, 
+							      payload, length));
+
+  dataCell->setTraceTime(CellTrace::advance(CellTrace::UP_COALESCE, traceTime));
+
+  if (slot != NULL)
+    slot->cellsWritten++;
+
+  dataBytesWritten.increment(length);
+
+  if (congestionControlEnabled) {
+    pendingCells.push_back(PendingCell(dataCell, handler, true));
+    flushPendingCells();
+    return;
   }
+
+  cellEncrypter.encrypt(*dataCell);
+  dataCell->setTraceTime(CellTrace::advance(CellTrace::UP_ENCRYPT, dataCell->getTraceTime()));
+
+  if (handler) connection.writeCell(*dataCell, handler);
+  else         connection.writeCell(*dataCell, boost::bind(&Circuit::writeComplete, this, 
+							    dataCell, placeholders::error));
+}
+
+void Circuit::flush(uint16_t streamId) {
+  StreamSlot *slot = streams.get(streamId);
+
+  if (slot == NULL || slot->partial.empty()) return;
+
+  std::vector<unsigned char> partial;
+  partial.swap(slot->partial);
+
+  uint64_t traceTime  = slot->partialTraced;
+  slot->partialTraced = 0;
+
+  sendDataCell(streamId, slot, &partial[0], partial.size(), traceTime, CircuitWriteHandler());
+}
+
+void Circuit::coalesceTimerExpired(const boost::system::error_code &err) {
+  if (err == boost::asio::error::operation_aborted) return;
+
+  std::list<uint16_t> streamIds;
+  streamIds.swap(partialStreams);
+
+  for (std::list<uint16_t>::iterator iter = streamIds.begin(); iter != streamIds.end(); iter++)
+    flush(*iter);
+}
+
+void Circuit::setCoalesceDelay(uint32_t milliseconds) {
+  coalesceDelay = milliseconds;
 }
 
 void Circuit::read(uint16_t streamId, CircuitReadHandler handler) {
   dispatcher.dispatchDataCellRequest(streamId, handler);
 }
 
+void Circuit::readv(uint16_t streamId, CircuitReadvHandler handler) {
+  dispatcher.dispatchDataBuffersRequest(streamId, handler);
+}
+
+uint64_t Circuit::getFailedAt() {
+  return failedAt;
+}
+
+uint32_t Circuit::getLostStreams() {
+  return lostStreams;
+}
+
+StreamTable& Circuit::getStreams() {
+  return streams;
+}
+
 std::string& Circuit::getRemoteNodeAddress() {
   return connection.getRemoteNodeAddress();
 }
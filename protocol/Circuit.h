@@ -42,16 +42,20 @@
 #include <boost/function.hpp>
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
+#include <deque>
 
 #include "RelayDataCell.h"
 #include "RelayBeginCell.h"
+#include "RelayResolveCell.h"
 #include "RelayEndCell.h"
 #include "RelaySendMeCell.h"
 #include "CreateCell.h"
 #include "CreatedCell.h"
 #include "CellEncrypter.h"
+#include "CongestionControl.h"
 #include "Cell.h"
 
+#include "StreamTable.h"
 #include "RelayCellDispatcher.h"
 #include "CellConsumer.h"
 #include "CellListener.h"
@@ -60,6 +64,14 @@
  * This class implements a Tor Circuit.
  */
 
+#define CIRCUIT_WINDOW_START 1000
+#define CIRCUIT_WINDOW_INCREMENT 100
+
+#define STREAM_BUFFER_LIMIT (128 * 1024)
+#define CIRCUIT_BUFFER_LIMIT (384 * 1024)
+
+#define COALESCE_DELAY 5
+
 typedef boost::function<void (const boost::system::error_code &error)> CircuitWriteHandler;
 
 class CircuitErrorListener {
@@ -69,7 +81,17 @@ class CircuitErrorListener {
   virtual void handleCircuitDestroyed() = 0;
 };
 
-class Circuit : public CellListener {
+struct PendingCell {
+  boost::shared_ptr<RelayCell> cell;
+  CircuitWriteHandler handler;
+  bool windowed;
+
+  PendingCell(boost::shared_ptr<RelayCell> cell, CircuitWriteHandler handler, bool windowed)
+    : cell(cell), handler(handler), windowed(windowed)
+  {}
+};
+
+class Circuit : public CellListener, public StreamConsumptionListener {
 
  private:
   BIGNUM *p;
@@ -78,14 +100,29 @@ class Circuit : public CellListener {
   RSA *onionKey;
   uint16_t circuitId;
   uint32_t circuitWindow;
+  uint32_t circuitConsumedCells;
+  uint32_t streamBufferLimit;
+  uint32_t circuitBufferLimit;
+  uint64_t bytesRead;
+  uint64_t bytesWritten;
+  uint64_t createStarted;
+  uint64_t failedAt;
+  uint32_t lostStreams;
 
   CircuitErrorListener *errorListener;
   Connection &connection;
   CellEncrypter cellEncrypter;
   CellConsumer cellConsumer;
+  StreamTable streams;
   RelayCellDispatcher dispatcher;
-  std::map<uint16_t, uint32_t> streamWindows;
-  
+
+  bool congestionControlEnabled;
+  CongestionControl congestionControl;
+  std::deque<PendingCell> pendingCells;
+
+  uint32_t coalesceDelay;
+  deadline_timer coalesceTimer;
+  std::list<uint16_t> partialStreams;
 
   void initializeDhParameters();
 
@@ -101,26 +138,37 @@ class Circuit : public CellListener {
 			       const boost::system::error_code &err);
 
 
-  void sendBeginCell(uint16_t streamId, std::string &address, CircuitConnectHandler handler);
+  void sendBeginCell(uint16_t streamId, std::string &address, bool optimistic,
+		     CircuitConnectHandler handler);
   void sendBeginCellComplete(CircuitConnectHandler handler,
-			     uint16_t streamId, 
+			     uint16_t streamId, bool optimistic,
 			     boost::shared_ptr<RelayBeginCell> beginCell,
 			     const boost::system::error_code &err);
 
   void handleConnectionError(const boost::system::error_code &err);
   void handleDestroyCell(boost::shared_ptr<Cell> cell);
   void handleUnknownCell(boost::shared_ptr<Cell> cell);
+  void recordFailure();
   void handleConnected(boost::shared_ptr<RelayCell> cell);
   void handleDataCell(boost::shared_ptr<RelayCell> cell);
   void handleSendMe(boost::shared_ptr<RelayCell> cell);
+  void handleResolved(boost::shared_ptr<RelayCell> cell);
   void handleCryptoException(boost::shared_ptr<RelayCell> cell);
 
   void writeComplete(boost::shared_ptr<RelayDataCell> dataCell,
 		     const boost::system::error_code &err);
-  void readComplete(CircuitReadHandler handler, 
-		    boost::shared_ptr<RelayDataCell> dataCell,
-		    uint16_t streamId, unsigned char* buf,
-		    const boost::system::error_code &err);
+  void pendingWriteComplete(boost::shared_ptr<RelayCell> cell,
+			    CircuitWriteHandler handler,
+			    const boost::system::error_code &err);
+  void flushPendingCells();
+
+  void sendDataCell(uint16_t streamId, StreamSlot *slot, unsigned char *payload, 
+		    int length, uint64_t traceTime, CircuitWriteHandler handler);
+  void writeAccepted(CircuitWriteHandler handler);
+  void coalesceTimerExpired(const boost::system::error_code &err);
+
+  void sendResolveCellComplete(boost::shared_ptr<RelayResolveCell> cell,
+			       const boost::system::error_code &err);
 
   void closeComplete(boost::shared_ptr<RelayEndCell> cell,
 		     const boost::system::error_code &err);
@@ -128,20 +176,43 @@ class Circuit : public CellListener {
   void sendWindowUpdateComplete(boost::shared_ptr<RelaySendMeCell> cell,
 				const boost::system::error_code &err);
   void sendWindowUpdate(uint16_t streamId);
+  void sendWindowUpdates(uint16_t streamId);
   void decrementWindows(uint16_t streamId);
 
  public:
   Circuit(Connection &connection, RSA *onionKey, uint16_t circuitId, 
 	  CircuitErrorListener *errorListener);
+  uint16_t allocateStream();
   void connect(uint16_t streamId, std::string &address, CircuitConnectHandler handler);
+  void connectOptimistic(uint16_t streamId, std::string &address, CircuitConnectHandler handler);
+  void resolve(uint16_t streamId, std::string &hostname, CircuitResolveHandler handler);
   void create(CircuitConnectHandler handler);
+  void enableCongestionControl();
+  CongestionControl& getCongestionControl();
 
   void write(uint16_t streamId, unsigned char *buf, int length, CircuitWriteHandler handler);
+  void writev(uint16_t streamId, std::vector<boost::asio::const_buffer> &buffers,
+	      CircuitWriteHandler handler);
+  void flush(uint16_t streamId);
+  void setCoalesceDelay(uint32_t milliseconds);
   void read(uint16_t streamId, CircuitReadHandler handler);
+  void readv(uint16_t streamId, CircuitReadvHandler handler);
 
   void close(uint16_t streamId);
   void close();
 
+  void handleCellsConsumed(uint16_t streamId, uint32_t cells);
+  void setBufferLimits(uint32_t streamLimit, uint32_t circuitLimit);
+  uint32_t getBufferedBytes(uint16_t streamId);
+  uint64_t takeTrace(uint16_t streamId);
+  uint32_t getBufferedBytes();
+  uint32_t getQueuedBytes();
+  uint64_t getBytesRead();
+  uint64_t getBytesWritten();
+  uint64_t getFailedAt();
+  uint32_t getLostStreams();
+
+  StreamTable& getStreams();
   std::string& getRemoteNodeAddress();
   ip::tcp::endpoint getLocalEndpoint();
   ~Circuit();
@@ -0,0 +1,260 @@
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "CircuitBuildTimeout.h"
+#include "../util/Log.h"
+
+#include <boost/lexical_cast.hpp>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <cstdlib>
+#include <cmath>
+#include <unistd.h>
+
+BuildTimeHistogram::BuildTimeHistogram() 
+  : completed(BIN_COUNT, 0), abandoned(BIN_COUNT, 0), completedCount(0), abandonedCount(0)
+{}
+
+uint32_t BuildTimeHistogram::getBin(uint32_t milliseconds) {
+  uint32_t bin = milliseconds / BIN_WIDTH;
+  return bin >= BIN_COUNT ? BIN_COUNT - 1 : bin;
+}
+
+uint32_t BuildTimeHistogram::getBinMidpoint(uint32_t bin) {
+  return (bin * BIN_WIDTH) + (BIN_WIDTH / 2);
+}
+
+void BuildTimeHistogram::addCompleted(uint32_t milliseconds) {
+  completed[getBin(milliseconds)]++;
+  completedCount++;
+  decay();
+}
+
+void BuildTimeHistogram::addAbandoned(uint32_t milliseconds) {
+  abandoned[getBin(milliseconds)]++;
+  abandonedCount++;
+  decay();
+}
+
+uint32_t BuildTimeHistogram::getCompletedCount() {
+  return completedCount;
+}
+
+// Halving everything once we're over MAX_SAMPLES keeps the shape of the
+// distribution while letting newer builds count for more than old ones.
+
+void BuildTimeHistogram::decay() {
+  if (completedCount + abandonedCount <= MAX_SAMPLES) return;
+
+  completedCount = abandonedCount = 0;
+
+  for (uint32_t i=0;i<BIN_COUNT;i++) {
+    completed[i]    /= 2;
+    abandoned[i]    /= 2;
+    completedCount  += completed[i];
+    abandonedCount  += abandoned[i];
+  }
+}
+
+// Xm is estimated as the count-weighted average of the most popular
+// bins, which is less noisy than taking the single mode.
+
+uint32_t BuildTimeHistogram::computeXm() {
+  std::vector<std::pair<uint32_t, uint32_t> > modes;
+
+  for (uint32_t i=0;i<BIN_COUNT;i++)
+    if (completed[i] > 0) modes.push_back(std::make_pair(completed[i], i));
+
+  std::sort(modes.rbegin(), modes.rend());
+
+  uint64_t weighted = 0;
+  uint64_t total    = 0;
+
+  for (uint32_t i=0;i<modes.size() && i<XM_MODES;i++) {
+    weighted += (uint64_t)getBinMidpoint(modes[i].second) * modes[i].first;
+    total    += modes[i].first;
+  }
+
+  return total == 0 ? 0 : weighted / total;
+}
+
+bool BuildTimeHistogram::computeTimeout(double quantile, uint32_t *timeout) {
+  uint32_t xm = computeXm();
+  double a    = 0;
+
+  if (xm == 0 || completedCount == 0) return false;
+
+  for (uint32_t i=0;i<BIN_COUNT;i++) {
+    double x = std::max(getBinMidpoint(i), xm);
+    double l = log(x / xm);
+
+    a += completed[i] * l;
+    a += abandoned[i] * l;
+  }
+
+  if (a <= 0) return false;
+
+  double alpha = completedCount / a;
+  *timeout     = (uint32_t)(xm / pow(1.0 - quantile, 1.0 / alpha));
+
+  return true;
+}
+
+void BuildTimeHistogram::save(const char *name, std::string &out) {
+  std::ostringstream stream;
+
+  for (uint32_t i=0;i<BIN_COUNT;i++)
+    if (completed[i] > 0 || abandoned[i] > 0)
+      stream << name << " " << i << " " << completed[i] << " " << abandoned[i] << "\n";
+
+  out.append(stream.str());
+}
+
+void BuildTimeHistogram::load(std::string &type, uint32_t bin, 
+			      uint32_t completedSamples, uint32_t abandonedSamples) 
+{
+  if (bin >= BIN_COUNT) return;
+
+  completed[bin] += completedSamples;
+  abandoned[bin] += abandonedSamples;
+  completedCount += completedSamples;
+  abandonedCount += abandonedSamples;
+}
+
+CircuitBuildTimeout::CircuitBuildTimeout(std::string statePath, double quantile) 
+  : statePath(statePath), quantile(quantile), unsavedSamples(0)
+{
+  loadState();
+}
+
+uint32_t CircuitBuildTimeout::getTimeout(BuildTimeHistogram &histogram) {
+  uint32_t timeout;
+
+  if (histogram.getCompletedCount() < MIN_SAMPLES)     return DEFAULT_TIMEOUT;
+  if (!histogram.computeTimeout(quantile, &timeout))  return DEFAULT_TIMEOUT;
+
+  if (timeout < MIN_TIMEOUT)     return MIN_TIMEOUT;
+  if (timeout > DEFAULT_TIMEOUT) return DEFAULT_TIMEOUT;
+
+  return timeout;
+}
+
+uint32_t CircuitBuildTimeout::getCreateTimeout() {
+  boost::mutex::scoped_lock guard(lock);
+  return getTimeout(createTimes);
+}
+
+uint32_t CircuitBuildTimeout::getSetupTimeout() {
+  boost::mutex::scoped_lock guard(lock);
+  return getTimeout(setupTimes);
+}
+
+void CircuitBuildTimeout::recordCreateTime(uint32_t milliseconds) {
+  boost::mutex::scoped_lock guard(lock);
+  createTimes.addCompleted(milliseconds);
+  sampleAdded();
+}
+
+void CircuitBuildTimeout::recordSetupTime(uint32_t milliseconds) {
+  boost::mutex::scoped_lock guard(lock);
+  setupTimes.addCompleted(milliseconds);
+  sampleAdded();
+}
+
+void CircuitBuildTimeout::recordCreateAbandoned(uint32_t milliseconds) {
+  boost::mutex::scoped_lock guard(lock);
+  createTimes.addAbandoned(milliseconds);
+  sampleAdded();
+}
+
+void CircuitBuildTimeout::recordSetupAbandoned(uint32_t milliseconds) {
+  boost::mutex::scoped_lock guard(lock);
+  setupTimes.addAbandoned(milliseconds);
+  sampleAdded();
+}
+
+void CircuitBuildTimeout::sampleAdded() {
+  if (++unsavedSamples >= SAVE_INTERVAL) {
+    saveState();
+    unsavedSamples = 0;
+  }
+}
+
+void CircuitBuildTimeout::loadState() {
+  if (statePath.empty()) return;
+
+  std::ifstream file(statePath.c_str());
+  std::string line;
+
+  while (std::getline(file, line)) {
+    std::istringstream tokens(line);
+    std::string type;
+    uint32_t bin, completedSamples, abandonedSamples;
+
+    if (!(tokens >> type >> bin >> completedSamples >> abandonedSamples)) continue;
+
+    if      (type == "create") createTimes.load(type, bin, completedSamples, abandonedSamples);
+    else if (type == "setup")  setupTimes.load(type, bin, completedSamples, abandonedSamples);
+  }
+}
+
+void CircuitBuildTimeout::saveState() {
+  if (statePath.empty()) return;
+
+  std::string state("# tortunnel circuit build times: <type> <bin> <completed> <abandoned>\n");
+  createTimes.save("create", state);
+  setupTimes.save("setup", state);
+
+  // Worker processes share the state file, so each writes its own
+  // temporary copy before renaming it into place.
+  std::string temporaryPath(statePath);
+  temporaryPath.append(".");
+  temporaryPath.append(boost::lexical_cast<std::string>(getpid()));
+  temporaryPath.append(".tmp");
+
+  std::ofstream file(temporaryPath.c_str());
+  file << state;
+  file.close();
+
+  if (!file || rename(temporaryPath.c_str(), statePath.c_str()) != 0)
+    LOG(Log::WARNING) << "Unable to save circuit build times to " << statePath;
+}
+
+std::string CircuitBuildTimeout::getDefaultStatePath() {
+  const char *home = getenv("HOME");
+
+  if (home == NULL) return std::string();
+
+  std::string path(home);
+  path.append("/.tortunnel_build_times");
+
+  return path;
+}
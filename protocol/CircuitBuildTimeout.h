@@ -0,0 +1,122 @@
+#ifndef __CIRCUIT_BUILD_TIMEOUT_H__
+#define __CIRCUIT_BUILD_TIMEOUT_H__
+
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <boost/thread/mutex.hpp>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+ * This class keeps a histogram of how long something took to build,
+ * along with the builds we gave up on, and fits a Pareto distribution
+ * to it the way Tor's circuit build timeout code does.  Abandoned builds
+ * are right-censored samples: they tell us a build took at least that
+ * long, so they pull the fit out without counting as completions.
+ */
+
+class BuildTimeHistogram {
+
+ private:
+  std::vector<uint32_t> completed;
+  std::vector<uint32_t> abandoned;
+  uint32_t completedCount;
+  uint32_t abandonedCount;
+
+  uint32_t getBin(uint32_t milliseconds);
+  uint32_t getBinMidpoint(uint32_t bin);
+  uint32_t computeXm();
+  void decay();
+
+ public:
+  static const uint32_t BIN_WIDTH       = 50;
+  static const uint32_t BIN_COUNT       = 2400;
+  static const uint32_t MAX_SAMPLES     = 1000;
+  static const uint32_t XM_MODES        = 10;
+
+  BuildTimeHistogram();
+
+  void addCompleted(uint32_t milliseconds);
+  void addAbandoned(uint32_t milliseconds);
+  uint32_t getCompletedCount();
+  bool computeTimeout(double quantile, uint32_t *timeout);
+
+  void save(const char *name, std::string &out);
+  void load(std::string &type, uint32_t bin, uint32_t completedCount, uint32_t abandonedCount);
+};
+
+/*
+ * This class learns how long circuits to relays usually take to set up,
+ * both for the CREATE->CREATED exchange alone and for the whole tunnel
+ * (TLS, versions, netinfo and CREATE), and tells callers when a build
+ * has taken long enough that it should be abandoned.  What it has
+ * learned is kept in a small state file so it survives restarts.
+ * Every proxy shard's tunnels share one, so it's safe to call from
+ * any thread.
+ */
+
+class CircuitBuildTimeout {
+
+ private:
+  std::string statePath;
+  double quantile;
+  uint32_t unsavedSamples;
+  boost::mutex lock;
+
+  BuildTimeHistogram createTimes;
+  BuildTimeHistogram setupTimes;
+
+  uint32_t getTimeout(BuildTimeHistogram &histogram);
+  void sampleAdded();
+  void loadState();
+  void saveState();
+
+ public:
+  static const uint32_t DEFAULT_TIMEOUT = 60000;
+  static const uint32_t MIN_TIMEOUT     = 1500;
+  static const uint32_t MIN_SAMPLES     = 20;
+  static const uint32_t SAVE_INTERVAL   = 10;
+
+  CircuitBuildTimeout(std::string statePath, double quantile = 0.8);
+
+  void recordCreateTime(uint32_t milliseconds);
+  void recordSetupTime(uint32_t milliseconds);
+  void recordCreateAbandoned(uint32_t milliseconds);
+  void recordSetupAbandoned(uint32_t milliseconds);
+
+  uint32_t getCreateTimeout();
+  uint32_t getSetupTimeout();
+
+  static std::string getDefaultStatePath();
+};
+
+
+#endif
@@ -0,0 +1,128 @@
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "CongestionControl.h"
+#include "../util/Log.h"
+#include "../util/Util.h"
+
+#include <iostream>
+
+CongestionControl::CongestionControl() :
+  congestionWindow(CWND_INITIAL), inflight(0), packagedCells(0),
+  ackedSinceUpdate(0), slowStart(true), minRtt(0), lastRtt(0), periodRtt(0)
+{}
+
+bool CongestionControl::canSend() {
+  return inflight < congestionWindow;
+}
+
+void CongestionControl::cellSent() {
+  cellSent(Util::getTimeMicros());
+}
+
+// The timed versions take the clock from the caller, so the window can be
+// driven through synthetic RTTs without a circuit underneath it.
+
+void CongestionControl::cellSent(uint64_t now) {
+  inflight++;
+
+  // The exit answers the cell that empties each SENDME_INCREMENT of its
+  // window with a SENDME, so that's the one we time.
+  if ((++packagedCells % SENDME_INCREMENT) == 0)
+    sendMeTimestamps.push_back(now);
+}
+
+bool CongestionControl::sendMeReceived() {
+  return sendMeReceived(Util::getTimeMicros());
+}
+
+bool CongestionControl::sendMeReceived(uint64_t now) {
+  if (sendMeTimestamps.empty()) {
+    LOG(Log::WARNING) << "Got unexpected circuit SENDME, ignoring...";
+    return false;
+  }
+
+  uint64_t rtt = now - sendMeTimestamps.front();
+  sendMeTimestamps.pop_front();
+
+  inflight = (inflight > SENDME_INCREMENT) ? inflight - SENDME_INCREMENT : 0;
+  lastRtt  = rtt;
+
+  if (minRtt == 0 || rtt < minRtt)            minRtt    = rtt;
+  if (periodRtt == 0 || rtt < periodRtt)      periodRtt = rtt;
+
+  // Vegas only adjusts once per congestion window's worth of acks.
+  if ((ackedSinceUpdate += SENDME_INCREMENT) >= congestionWindow)
+    updateCongestionWindow();
+
+  return true;
+}
+
+void CongestionControl::updateCongestionWindow() {
+  uint64_t queueUse = 0;
+
+  if (periodRtt > minRtt)
+    queueUse = (congestionWindow * (periodRtt - minRtt)) / periodRtt;
+
+  if (slowStart) {
+    if (queueUse < VEGAS_GAMMA) congestionWindow *= 2;
+    else                        slowStart = false;
+  }
+
+  if (!slowStart) {
+    if      (queueUse < VEGAS_ALPHA) congestionWindow += CWND_INCREMENT;
+    else if (queueUse > VEGAS_BETA)  congestionWindow -= CWND_INCREMENT;
+  }
+
+  if (congestionWindow < CWND_MIN) congestionWindow = CWND_MIN;
+  if (congestionWindow > CWND_MAX) congestionWindow = CWND_MAX;
+
+  ackedSinceUpdate = 0;
+  periodRtt        = 0;
+}
+
+uint32_t CongestionControl::getCongestionWindow() {
+  return congestionWindow;
+}
+
+uint32_t CongestionControl::getInflight() {
+  return inflight;
+}
+
+uint64_t CongestionControl::getMinRtt() {
+  return minRtt;
+}
+
+uint64_t CongestionControl::getLastRtt() {
+  return lastRtt;
+}
+
+bool CongestionControl::isSlowStart() {
+  return slowStart;
+}
@@ -0,0 +1,89 @@
+#ifndef __CONGESTION_CONTROL_H__
+#define __CONGESTION_CONTROL_H__
+
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <deque>
+
+/*
+ * This class implements RTT-based congestion control for the cells we
+ * package onto a circuit, modeled after Tor's TOR_VEGAS algorithm.  The
+ * exit acknowledges every SENDME_INCREMENT cells with a circuit-level
+ * SENDME, which gives us an RTT sample.  The congestion window grows
+ * while the measured queueing delay is small and shrinks when it isn't,
+ * and never exceeds the 1000 cell window the exit enforces on us.
+ */
+
+class CongestionControl {
+
+ private:
+  uint32_t congestionWindow;
+  uint32_t inflight;
+  uint32_t packagedCells;
+  uint32_t ackedSinceUpdate;
+  bool slowStart;
+
+  uint64_t minRtt;
+  uint64_t lastRtt;
+  uint64_t periodRtt;
+
+  std::deque<uint64_t> sendMeTimestamps;
+
+  void updateCongestionWindow();
+
+ public:
+  static const uint32_t SENDME_INCREMENT = 100;
+  static const uint32_t CWND_INITIAL     = 124;
+  static const uint32_t CWND_MIN         = SENDME_INCREMENT;
+  static const uint32_t CWND_MAX         = 1000;
+  static const uint32_t CWND_INCREMENT   = 31;
+
+  static const uint32_t VEGAS_ALPHA      = 186;
+  static const uint32_t VEGAS_BETA       = 248;
+  static const uint32_t VEGAS_GAMMA      = 186;
+
+  CongestionControl();
+
+  bool canSend();
+  void cellSent();
+  void cellSent(uint64_t now);
+  bool sendMeReceived();
+  bool sendMeReceived(uint64_t now);
+
+  uint32_t getCongestionWindow();
+  uint32_t getInflight();
+  uint64_t getMinRtt();
+  uint64_t getLastRtt();
+  bool isSlowStart();
+};
+
+
+#endif
@@ -28,6 +28,11 @@
  */
 
 #include "Connection.h"
+#include "../util/CellTrace.h"
+#include "../util/Log.h"
+#include "../util/LoopProfiler.h"
+#include "../util/Metrics.h"
+#include "../util/Probes.h"
 #include "../util/Util.h"
 #include "Cell.h"
 
@@ -46,8 +51,17 @@
 
 using namespace boost::asio;
 
+static Counter cellsWritten("tortunnel_cells_total", "direction=\"out\"",
+			    "Cells exchanged with exit nodes.");
+static Counter tlsBytesRead("tortunnel_tls_bytes_total", "direction=\"in\"",
+			    "TLS bytes exchanged with exit nodes.");
+static Counter tlsBytesWritten("tortunnel_tls_bytes_total", "direction=\"out\"",
+			       "TLS bytes exchanged with exit nodes.");
+
+HANDLER_TAG(tlsReadHandler, "connection.tls_read");
+
 Connection::Connection(io_service &io_service, string &host, string &port) 
-  : socket(io_service), host(host), port(port)
+  : host(host), port(port), socket(io_service), lastReadTime(0)
 {}
 
 void Connection::connect(ConnectHandler handler) {
@@ -77,7 +91,9 @@ void Connection::writeCell(Cell &cell, ConnectHandler handler) {
 //   std::cerr << "Writing Cell: " << std::endl;
 //   Util::hexDump(buffer, len);
 
-  writeFully(buffer, len, handler, boost::system::error_code());
+  cellsWritten.increment();
+  PROBE3(cell_write, cell.getCircuitId(), cell.getType(), len);
+  writeFully(buffer, len, cell.getTraceTime(), handler, boost::system::error_code());
 }
 
 void Connection::readCell(boost::shared_ptr<Cell> cell, ConnectHandler handler) {
@@ -125,8 +141,8 @@ void Connection::readFully(unsigned char *buf, int len,
   socket.get_io_service().post(boost::bind(handler, err));
 }
 
-void Connection::writeFully(unsigned char *buf, int len, ConnectHandler handler, 
-			    const boost::system::error_code &err) 
+void Connection::writeFully(unsigned char *buf, int len, uint64_t traceTime,
+			    ConnectHandler handler, const boost::system::error_code &err) 
 {
 
   if (err) {
@@ -144,7 +160,7 @@ void Connection::writeFully(unsigned char *buf, int len, ConnectHandler handler,
       break;
     case SSL_ERROR_WANT_READ:
       readIntoBuffer(boost::bind(&Connection::writeFully, this, buf, len, 
-				 handler, placeholders::error));
+				 traceTime, handler, placeholders::error));
       return;
     case SSL_ERROR_WANT_WRITE:
       writeFromBuffer(boost::bind(&Connection::readFully, this, buf, len,
@@ -156,7 +172,12 @@ void Connection::writeFully(unsigned char *buf, int len, ConnectHandler handler,
     }
   }
 
-  writeFromBuffer(boost::bind(&Connection::dummyWrite, this, placeholders::error));
+  // A traced cell's last stage ends when the socket has taken its bytes.
+  if (traceTime != 0)
+    writeFromBuffer(boost::bind(&Connection::tracedWrite, this, traceTime, placeholders::error));
+  else
+    writeFromBuffer(boost::bind(&Connection::dummyWrite, this, placeholders::error));
+
   socket.get_io_service().post(boost::bind(handler, err));
 }
 
@@ -221,11 +242,16 @@ void Connection::handshake(ConnectHandler handler, const boost::system::error_co
 
 void Connection::dummyWrite(const boost::system::error_code &error) {}
 
+void Connection::tracedWrite(uint64_t traceTime, const boost::system::error_code &error) {
+  if (!error) CellTrace::advance(CellTrace::UP_TLS_WRITE, traceTime);
+}
+
 void Connection::readIntoBuffer(ConnectHandler handler) {
   socket.async_read_some(boost::asio::buffer(readBuffer, sizeof(readBuffer)),
-			 boost::bind(&Connection::readIntoBufferComplete,
-				     this, handler, placeholders::error, 
-				     placeholders::bytes_transferred));
+			 LoopProfiler::wrap(tlsReadHandler, 
+					    boost::bind(&Connection::readIntoBufferComplete,
+							this, handler, placeholders::error, 
+							placeholders::bytes_transferred)));
 }
 
 void Connection::readIntoBufferComplete(ConnectHandler handler, 
@@ -237,6 +263,11 @@ void Connection::readIntoBufferComplete(ConnectHandler handler,
     return;
   }
 
+  tlsBytesRead.increment(bytesRead);
+
+  if (CellTrace::isEnabled())
+    lastReadTime = Util::getTimeMicros();
+
   BIO_write(readBio, readBuffer, bytesRead);
   socket.get_io_service().post(boost::bind(handler, err));
 }
@@ -247,6 +278,8 @@ void Connection::writeFromBuffer(ConnectHandler handler) {
   while ((pending = BIO_ctrl_pending(writeBio)) > 0) {
     unsigned char buf[512];
     int bytesToSend = BIO_read(writeBio, buf, sizeof(buf));
+
+    tlsBytesWritten.increment(bytesToSend);
     
     if (pending - bytesToSend == 0)
       async_write(socket, boost::asio::buffer(buf, bytesToSend), 
@@ -267,7 +300,7 @@ void Connection::exchangeVersions(ConnectHandler handler, const boost::system::e
     return;
   }
 
-  writeFully(versionBytes, sizeof(versionBytes), 
+  writeFully(versionBytes, sizeof(versionBytes), 0, 
 	     boost::bind(&Connection::dummyWrite, this, placeholders::error),
 	     err);
 
@@ -292,7 +325,7 @@ void Connection::sentVersionComplete(ConnectHandler handler,
   unsigned char *versionResponsePayload = (unsigned char*)malloc(24);
 
   if (versionResponseHeader[2] != 0x07) {
-    std::cerr << "Warning: received strange version response cell." << std::endl;
+    LOG(Log::WARNING) << "Warning: received strange version response cell.";
     free(versionResponseHeader);
     socket.get_io_service().post(boost::bind(handler, boost::asio::error::bad_descriptor));
     return;
@@ -301,7 +334,7 @@ void Connection::sentVersionComplete(ConnectHandler handler,
   uint16_t length = Util::bigEndianArrayToShort(versionResponseHeader + 3);
 
   if (length > sizeof(versionResponsePayload)) {
-    std::cerr << "Warning: version response length is strangely long." << std::endl;
+    LOG(Log::WARNING) << "Warning: version response length is strangely long.";
     free(versionResponseHeader);
     socket.get_io_service().post(boost::bind(handler, boost::asio::error::bad_descriptor));
     return;
@@ -395,10 +428,22 @@ std::string& Connection::getRemoteNodeAddress() {
   return host;
 }
 
+boost::asio::io_service& Connection::getIoService() {
+  return socket.get_io_service();
+}
+
 ip::tcp::endpoint Connection::getLocalEndpoint() {
   return socket.local_endpoint();
 }
 
+// Only kept while cell tracing is on.  Bytes for the cell being read may
+// have arrived in an earlier read than the last one, so this is a lower
+// bound on how long they sat in the TLS buffers.
+
+uint64_t Connection::getLastReadTime() {
+  return lastReadTime;
+}
+
 Connection::~Connection() {
   SSL_CTX_free(ctx);
   SSL_free(ssl);
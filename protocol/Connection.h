@@ -64,12 +64,13 @@ class Connection {
   ip::tcp::socket socket;
 
   unsigned char readBuffer[1024];
+  uint64_t lastReadTime;
 
   void readFully(unsigned char *buf, int len, 
 		 ConnectHandler handler, 
 		 const boost::system::error_code err);
     
-  void writeFully(unsigned char *buf, int len, ConnectHandler handler, 
+  void writeFully(unsigned char *buf, int len, uint64_t traceTime, ConnectHandler handler, 
 		  const boost::system::error_code &err);
 
   void initiateConnection(std::string &host, int port, ConnectHandler handler);
@@ -80,6 +81,7 @@ class Connection {
 
   void handshake(ConnectHandler handler, const boost::system::error_code& err);
   void dummyWrite(const boost::system::error_code &error);
+  void tracedWrite(uint64_t traceTime, const boost::system::error_code &error);
 
   void readIntoBuffer(ConnectHandler handler);
 
@@ -111,6 +113,8 @@ class Connection {
 
   std::string& getRemoteNodeAddress();
   ip::tcp::endpoint getLocalEndpoint();
+  uint64_t getLastReadTime();
+  boost::asio::io_service& getIoService();
 
   void connect(ConnectHandler handler);
   void close();
@@ -30,13 +30,40 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "Directory.h"
+#include "../util/Log.h"
+#include "../util/LoopProfiler.h"
 
 #include <openssl/rsa.h>
+#include <boost/lexical_cast.hpp>
+#include <unistd.h>
+#include <string.h>
+#include <fstream>
 #include <iostream>
+#include <sstream>
 
 using namespace boost::asio;
 
-Directory::Directory(boost::asio::io_service &io_service) : io_service(io_service) {}
+HANDLER_TAG(listingHandler, "directory.listing");
+HANDLER_TAG(descriptorHandler, "directory.descriptor");
+HANDLER_TAG(refreshHandler, "directory.refresh");
+
+const time_t Directory::FRESH_LIFETIME;
+const time_t Directory::VALID_LIFETIME;
+
+Directory::Directory(boost::asio::io_service &io_service) 
+  : io_service(io_service), retrieveStarted(0), cached(false)
+{}
+
+// Server listings fetch their descriptors on the directory's io_service,
+// so a thread with its own io_service gets its own copy of the directory
+// rather than sharing listings with another thread.
+
+Directory::Directory(boost::asio::io_service &io_service, Directory &source) 
+  : io_service(io_service), directoryList(source.directoryList), 
+    retrieveStarted(0), cached(false)
+{
+  parseDirectoryListing();
+}
 
 void Directory::getServerListingComplete(boost::shared_ptr<ServerListing> serverListing,
 					 RetrieveServerListingHandler handler,
@@ -50,15 +77,16 @@ void Directory::getRandomServerListing(RetrieveServerListingHandler handler)
   int count = 0;
   int index = Util::getRandom() % serverListings.size();
 
-  std::cerr << "Choosing exit node at index: " << index << " out of " << serverListings.size() << " listings..." << std::endl;
+  LOG(Log::DEBUG) << "Choosing exit node at index: " << index << " out of " << serverListings.size() << " listings...";
 
   std::list<boost::shared_ptr<ServerListing> >::iterator serverListingIterator = serverListings.begin();
 
   while (serverListingIterator != serverListings.end()) {
     if (count++ == index) {
-      (*serverListingIterator)->getDescriptorList(boost::bind(&Directory::getServerListingComplete,
-							      this, *serverListingIterator, handler, 
-							      placeholders::error)); 
+      (*serverListingIterator)->getDescriptorList(LoopProfiler::wrap(descriptorHandler,
+								     boost::bind(&Directory::getServerListingComplete,
+										 this, *serverListingIterator, 
+										 handler, placeholders::error)));
       return;
     }
 
@@ -89,9 +117,10 @@ void Directory::getServerListingFor(std::string &server, RetrieveServerListingHa
 
   std::string serverString = directoryList.substr(position, end-position);
   boost::shared_ptr<ServerListing> serverListing(new ServerListing(io_service, serverString));
-  serverListing->getDescriptorList(boost::bind(&Directory::getServerListingComplete,
-					       this, serverListing, handler, 
-					       placeholders::error));
+  serverListing->getDescriptorList(LoopProfiler::wrap(descriptorHandler,
+						      boost::bind(&Directory::getServerListingComplete,
+								  this, serverListing, handler, 
+								  placeholders::error)));
 }
 
 void Directory::retrieveDirectoryListingComplete(DirectoryHandler handler, 
@@ -102,6 +131,11 @@ void Directory::retrieveDirectoryListingComplete(DirectoryHandler handler,
     return;
   }
 
+  parseDirectoryListing();
+  handler(err);
+}
+
+void Directory::parseDirectoryListing() {
   FastExitNodeIterator iterator(*this);
   boost::shared_ptr<ServerListing> exitNode = iterator.next();
 
@@ -110,20 +144,265 @@ void Directory::retrieveDirectoryListingComplete(DirectoryHandler handler,
     // std::cerr << "Added: " << exitNode->getAddress() << std::endl;
     exitNode = iterator.next();
   }
-
-  handler(err);
 }
 
-void Directory::retrieveDirectoryListing(DirectoryHandler handler) {
+void Directory::requestDirectoryListing(const std::string &headers, std::string *result,
+					SocketSuckHandler handler)
+{
   boost::shared_ptr<std::string> 
-    request(new std::string("GET /tor/status/all HTTP/1.0\r\nConnection: close\r\n\r\n"));
+    request(new std::string("GET /tor/status/all HTTP/1.0\r\n"));
+
+  request->append(headers);
+  request->append("Connection: close\r\n\r\n");
 
   std::string ip("128.31.0.34");
 
-  Network::suckUrlToString(io_service, ip, 9031, request, &directoryList,
-			   boost::bind(&Directory::retrieveDirectoryListingComplete,
+  Network::suckUrlToString(io_service, ip, 9031, request, result, handler);
+}
+
+void Directory::retrieveDirectoryListing(DirectoryHandler handler) {
+  requestDirectoryListing(std::string(), &directoryList,
+			  LoopProfiler::wrap(listingHandler,
+					     boost::bind(&Directory::retrieveDirectoryListingComplete,
+							 this, handler, placeholders::error)));
+}
+
+// A cached listing that is still valid is handed back right away, and
+// only goes to the authority at all once it is no longer fresh.  A
+// missing, unreadable, or expired cache falls back to a full download,
+// which is then written back for the next start.
+
+void Directory::retrieveCachedDirectoryListing(const std::string &path, 
+					       DirectoryHandler handler) 
+{
+  time_t now      = time(NULL);
+  cachePath       = path;
+  retrieveStarted = Util::getTimeMicros();
+
+  if (loadDirectoryListing(path) && now < getValidUntil()) {
+    cached = true;
+    logDirectoryReady();
+
+    if (now >= getFreshUntil()) {
+      LOG(Log::INFO) << "Cached directory listing is stale, refreshing in the background."
+		     << Log::field("published", getPublished());
+      refreshDirectoryListing();
+    }
+
+    io_service.post(boost::bind(handler, boost::system::error_code()));
+    return;
+  }
+
+  cached = false;
+  directoryList.clear();
+  serverListings.clear();
+
+  retrieveDirectoryListing(boost::bind(&Directory::retrieveCachedDirectoryListingComplete,
 				       this, handler, placeholders::error));
 }
- 
 
+void Directory::retrieveCachedDirectoryListingComplete(DirectoryHandler handler,
+						       const boost::system::error_code &err)
+{
+  if (!err) {
+    logDirectoryReady();
+
+    if (!serverListings.empty() && !saveDirectoryListing(cachePath))
+      LOG(Log::WARNING) << "Unable to cache directory listing in " << cachePath;
+  }
+
+  handler(err);
+}
+
+void Directory::logDirectoryReady() {
+  LOG(Log::INFO) << "Directory listing ready."
+		 << Log::field("source", cached ? "cache" : "authority")
+		 << Log::field("listings", serverListings.size())
+		 << Log::field("ms", (Util::getTimeMicros() - retrieveStarted) / 1000);
+}
+
+// The authority answers 304 when nothing newer has been published, so a
+// refresh of an unchanged listing costs a round trip rather than the
+// whole document.  Whatever happens, the cached copy stays in use until
+// a complete replacement has arrived and parsed.
+
+void Directory::refreshDirectoryListing() {
+  std::string headers;
+  std::string lastModified = getLastModified();
+
+  if (!lastModified.empty()) {
+    headers.append("If-Modified-Since: ");
+    headers.append(lastModified);
+    headers.append("\r\n");
+  }
+
+  refreshedList.clear();
+
+  requestDirectoryListing(headers, &refreshedList,
+			  LoopProfiler::wrap(refreshHandler,
+					     boost::bind(&Directory::refreshDirectoryListingComplete,
+							 this, placeholders::error)));
+}
+
+void Directory::refreshDirectoryListingComplete(const boost::system::error_code &err) {
+  int status = getStatusCode(refreshedList);
+
+  if (status == 304) {
+    LOG(Log::INFO) << "Cached directory listing is current.";
+  } else if (err || status != 200) {
+    LOG(Log::WARNING) << "Unable to refresh directory listing, keeping cached copy."
+		      << Log::field("status", status);
+  } else {
+    directoryList.swap(refreshedList);
+    serverListings.clear();
+    parseDirectoryListing();
+
+    if (serverListings.empty()) {
+      LOG(Log::WARNING) << "Refreshed directory listing is empty, keeping cached copy.";
+      directoryList.swap(refreshedList);
+      parseDirectoryListing();
+    } else {
+      LOG(Log::INFO) << "Refreshed directory listing."
+		     << Log::field("published", getPublished())
+		     << Log::field("listings", serverListings.size());
+
+      if (!saveDirectoryListing(cachePath))
+	LOG(Log::WARNING) << "Unable to cache directory listing in " << cachePath;
+    }
+  }
+
+  std::string().swap(refreshedList);
+}
+
+// Conditional requests go out with the Last-Modified time the authority
+// sent along with the cached copy, or failing that, its publication time.
+
+std::string Directory::getLastModified() {
+  const std::string token("\r\nLast-Modified: ");
+  std::string::size_type headersEnd = directoryList.find("\r\n\r\n");
+  std::string::size_type index      = directoryList.find(token);
+
+  if (index != std::string::npos && index < headersEnd) {
+    index += token.size();
+    return directoryList.substr(index, directoryList.find("\r\n", index) - index);
+  }
+
+  time_t published = getPublished();
+  struct tm date;
+  char formatted[64];
+
+  if (published == 0 || gmtime_r(&published, &date) == NULL) 
+    return std::string();
+
+  strftime(formatted, sizeof(formatted), "%a, %d %b %Y %H:%M:%S GMT", &date);
+
+  return std::string(formatted);
+}
+
+int Directory::getStatusCode(const std::string &response) {
+  int status = 0;
+
+  if (sscanf(response.c_str(), "HTTP/%*d.%*d %d", &status) != 1)
+    return 0;
+
+  return status;
+}
+
+time_t Directory::parseTime(const std::string &document, const char *keyword) {
+  std::string token("\n");
+  token.append(keyword);
+  token.append(" ");
+
+  std::string::size_type index = document.find(token);
+  struct tm date;
+
+  if (index == std::string::npos) return 0;
+
+  memset(&date, 0, sizeof(date));
+
+  if (strptime(document.c_str() + index + token.size(), "%Y-%m-%d %H:%M:%S", &date) == NULL)
+    return 0;
+
+  return timegm(&date);
+}
+
+// A v2 network status only says when it was published, so it's taken to
+// be fresh for FRESH_LIFETIME and usable for VALID_LIFETIME after that.
+// Documents that carry their own fresh-until and valid-until are held to
+// those instead.
+
+time_t Directory::getPublished() {
+  time_t published = parseTime(directoryList, "published");
+
+  if (published == 0) 
+    published = parseTime(directoryList, "valid-after");
+
+  return published;
+}
 
+time_t Directory::getFreshUntil() {
+  time_t freshUntil = parseTime(directoryList, "fresh-until");
+  time_t published  = getPublished();
+
+  if (freshUntil != 0 || published == 0) return freshUntil;
+  else                                   return published + FRESH_LIFETIME;
+}
+
+time_t Directory::getValidUntil() {
+  time_t validUntil = parseTime(directoryList, "valid-until");
+  time_t published  = getPublished();
+
+  if (validUntil != 0 || published == 0) return validUntil;
+  else                                   return published + VALID_LIFETIME;
+}
+
+bool Directory::isCached() {
+  return cached;
+}
+
+// A directory saved by one process can be picked up by others, so they
+// don't each have to download it themselves.
+
+bool Directory::loadDirectoryListing(const std::string &path) {
+  std::ifstream file(path.c_str());
+  std::ostringstream contents;
+
+  if (!file) return false;
+
+  contents << file.rdbuf();
+  directoryList = contents.str();
+
+  serverListings.clear();
+  parseDirectoryListing();
+
+  return !serverListings.empty();
+}
+
+bool Directory::saveDirectoryListing(const std::string &path) {
+  std::string temporaryPath(path);
+  temporaryPath.append(".");
+  temporaryPath.append(boost::lexical_cast<std::string>(getpid()));
+  temporaryPath.append(".tmp");
+
+  std::ofstream file(temporaryPath.c_str());
+  file << directoryList;
+  file.close();
+
+  if (!file || rename(temporaryPath.c_str(), path.c_str()) != 0) {
+    unlink(temporaryPath.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+std::string Directory::getDefaultCachePath() {
+  const char *home = getenv("HOME");
+
+  if (home == NULL) return std::string("/tmp/.tortunnel_directory");
+
+  std::string path(home);
+  path.append("/.tortunnel_directory");
+
+  return path;
+}
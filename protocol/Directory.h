@@ -37,6 +37,7 @@
 #include <list>
 #include <string>
 #include <stdio.h>
+#include <time.h>
 
 #include <openssl/rsa.h>
 
@@ -46,6 +47,13 @@
 /*
  * This class implements the Tor Directory functionality.
  *
+ * A listing retrieved through retrieveCachedDirectoryListing() is kept
+ * on disk along with the HTTP headers it arrived with.  The network
+ * status says when it was published, so a later start can use the
+ * cached copy straight away while it is fresh, and a copy that is stale
+ * but still valid is used while a conditional request for a newer one
+ * goes out in the background.
+ *
  */
 
 
@@ -72,13 +80,44 @@ class Directory {
  private:
   boost::asio::io_service &io_service;
   std::string directoryList;
+  std::string refreshedList;
+  std::string cachePath;
   std::list<boost::shared_ptr<ServerListing> > serverListings;  
+  uint64_t retrieveStarted;
+  bool cached;
+
+  void parseDirectoryListing();
+  void requestDirectoryListing(const std::string &headers, std::string *result,
+			       SocketSuckHandler handler);
+  void refreshDirectoryListing();
+  void refreshDirectoryListingComplete(const boost::system::error_code &err);
+  void retrieveCachedDirectoryListingComplete(DirectoryHandler handler,
+					      const boost::system::error_code &err);
+  void logDirectoryReady();
+  std::string getLastModified();
+
+  static time_t parseTime(const std::string &document, const char *keyword);
+  static int getStatusCode(const std::string &response);
 
  public:
+  static const time_t FRESH_LIFETIME = 60 * 60;
+  static const time_t VALID_LIFETIME = 24 * 60 * 60;
+
   Directory(boost::asio::io_service &io_service);
+  Directory(boost::asio::io_service &io_service, Directory &source);
+
+  bool loadDirectoryListing(const std::string &path);
+  bool saveDirectoryListing(const std::string &path);
+  static std::string getDefaultCachePath();
   void retrieveDirectoryListing(DirectoryHandler handler);
   void retrieveDirectoryListingComplete(DirectoryHandler handler, 
 					const boost::system::error_code &err);
+  void retrieveCachedDirectoryListing(const std::string &path, DirectoryHandler handler);
+
+  time_t getPublished();
+  time_t getFreshUntil();
+  time_t getValidUntil();
+  bool isCached();
 
   void getRandomServerListing(RetrieveServerListingHandler handler); 
   void getServerListingFor(std::string &server, RetrieveServerListingHandler handler);
@@ -96,7 +135,7 @@ class ExitNodeIterator {
 
  public:
   
- ExitNodeIterator(Directory &directory) : directory(directory), index(0) {}
+ ExitNodeIterator(Directory &directory) : index(0), directory(directory) {}
 
   virtual const char* getExitNodeToken() {
     return "s Exit ";
@@ -36,6 +36,7 @@ class RelayCell : public Cell {
   static const int CONNECTED_TYPE = 4;
   static const int SENDME_TYPE    = 5;
   static const int DROP_TYPE      = 10;
+  static const int RESOLVED_TYPE  = 12;
   
  RelayCell() : Cell() {}
   
@@ -72,6 +73,7 @@ class RelayCell : public Cell {
  RelayCell(Cell &cell) : Cell()
     {
       memcpy(getBuffer(), cell.getBuffer(), getBufferSize());
+      setTraceTime(cell.getTraceTime());
     }
 
   void setDigest(unsigned char* digest) {
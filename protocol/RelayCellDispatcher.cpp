@@ -1,72 +1,382 @@
 
 #include "RelayCellDispatcher.h"
+#include "../util/CellTrace.h"
+#include "../util/Log.h"
+#include "../util/Probes.h"
 #include <cassert>
 
-void RelayCellDispatcher::addStreamId(uint16_t streamId) {
-  dataCells[streamId] =   std::list<boost::shared_ptr<RelayCell> >();
+RelayCellDispatcher::RelayCellDispatcher(uint16_t circuitId, StreamTable &streams, 
+					 StreamConsumptionListener &listener) 
+  : circuitId(circuitId), streams(streams), listener(listener), bufferedBytes(0)
+{}
+
+uint16_t RelayCellDispatcher::addStream() {
+  return streams.allocate();
 }
 
 void RelayCellDispatcher::removeStreamId(uint16_t streamId) {
-  dataCells.erase(streamId);
-  connectedListeners.erase(streamId);
-  dataListeners.erase(streamId);
+  releaseStream(streamId);
+}
+
+void RelayCellDispatcher::releaseStream(uint16_t streamId) {
+  StreamSlot *slot = streams.get(streamId);
+
+  if (slot == NULL) return;
+
+  uint32_t discarded = slot->unreadCells;
+
+  bufferedBytes -= slot->bufferedBytes;
+  streams.release(streamId);
+
+  // Whatever was still queued counts as consumed, or the circuit window
+  // would never get those cells back.
+  if (discarded > 0)
+    listener.handleCellsConsumed(streamId, discarded);
+}
+
+// Bytes handed to a reader are only its own until the handler returns,
+// so they're consumed right after, unless the handler closed the stream
+// first.  A reader that wants them longer copies them out.  Window
+// credit goes by bytes: a cell's worth of consumed payload earns back a
+// cell, and draining the buffer earns back everything, since cells from
+// the exit aren't always full.
+
+void RelayCellDispatcher::consumeDelivered(StreamSlot *slot) {
+  if (slot->deliveredBytes == 0) return;
+
+  slot->buffer.consume(slot->deliveredBytes);
+
+  if (slot->traceQueued != 0)
+    slot->traceOffset -= slot->deliveredBytes;
+
+  slot->bufferedBytes -= slot->deliveredBytes;
+  slot->readBytes     += slot->deliveredBytes;
+  bufferedBytes       -= slot->deliveredBytes;
+  slot->deliveredBytes = 0;
+
+  uint32_t credit = slot->readBytes / (MAX_PAYLOAD_LENGTH);
+
+  if (slot->buffer.empty() || credit > slot->unreadCells)
+    credit = slot->unreadCells;
+
+  slot->unreadCells -= credit;
+  slot->readBytes    = slot->buffer.empty() ? 0 : slot->readBytes - credit * (MAX_PAYLOAD_LENGTH);
+
+  if (credit > 0)
+    listener.handleCellsConsumed(slot->streamId, credit);
+}
+
+// A stream only follows one traced cell at a time, and the cell's time in
+// the queue is up once the delivery reaches its last byte.
+
+void RelayCellDispatcher::traceDelivery(StreamSlot *slot) {
+  if (slot->traceQueued == 0 || slot->deliveredBytes < slot->traceOffset) return;
+
+  slot->traceDelivered = CellTrace::advance(CellTrace::DOWN_STREAM_QUEUE, slot->traceQueued);
+  slot->traceQueued    = 0;
+}
+
+uint64_t RelayCellDispatcher::takeTrace(uint16_t streamId) {
+  StreamSlot *slot = streams.get(streamId);
+
+  if (slot == NULL) return 0;
+
+  uint64_t traceTime   = slot->traceDelivered;
+  slot->traceDelivered = 0;
+
+  return traceTime;
+}
+
+void RelayCellDispatcher::deliverBytes(StreamSlot *slot, CircuitReadHandler handler) {
+  unsigned char *buf;
+  int length = slot->buffer.peek(&buf, MAX_READ_LENGTH);
+
+  slot->deliveredBytes = length;
+  traceDelivery(slot);
+  PROBE3(stream_deliver, circuitId, slot->streamId, length);
+
+  uint16_t streamId = slot->streamId;
+  handler(buf, length);
+  deliveryComplete(streamId);
+}
+
+// Hands over everything that's buffered, which is at most two runs since
+// the ring only ever wraps once.
+
+void RelayCellDispatcher::deliverBuffers(StreamSlot *slot, CircuitReadvHandler handler) {
+  std::vector<boost::asio::const_buffer> buffers;
+  unsigned char *buf;
+  size_t length;
+  size_t offset = 0;
+
+  while ((length = slot->buffer.peek(&buf, slot->buffer.size(), offset)) > 0) {
+    buffers.push_back(boost::asio::const_buffer(buf, length));
+    offset += length;
+  }
+
+  slot->deliveredBytes = offset;
+  traceDelivery(slot);
+  PROBE3(stream_deliver, circuitId, slot->streamId, offset);
+
+  uint16_t streamId = slot->streamId;
+  handler(buffers, offset);
+  deliveryComplete(streamId);
+}
+
+// The handler may have read again, or closed the stream and let its ID
+// go to a new one, so the slot is looked up again rather than trusted.
+
+void RelayCellDispatcher::deliveryComplete(uint16_t streamId) {
+  StreamSlot *slot = streams.get(streamId);
+
+  if (slot != NULL) consumeDelivered(slot);
+}
+
+void RelayCellDispatcher::deliverPending(StreamSlot *slot) {
+  if (slot->readHandler) {
+    CircuitReadHandler handler = slot->readHandler;
+    slot->readHandler.clear();
+    deliverBytes(slot, handler);
+  } else if (slot->readvHandler) {
+    CircuitReadvHandler handler = slot->readvHandler;
+    slot->readvHandler.clear();
+    deliverBuffers(slot, handler);
+  }
+}
+
+void RelayCellDispatcher::failPendingRead(StreamSlot *slot) {
+  std::vector<boost::asio::const_buffer> buffers;
+
+  if (slot->readHandler) {
+    CircuitReadHandler handler = slot->readHandler;
+    slot->readHandler.clear();
+    handler(NULL, -1);
+  } else if (slot->readvHandler) {
+    CircuitReadvHandler handler = slot->readvHandler;
+    slot->readvHandler.clear();
+    handler(buffers, -1);
+  }
+}
+
+void RelayCellDispatcher::abortStreams(const boost::system::error_code &err) {
+  uint32_t streamId;
+
+  for (streamId = 1; streamId <= streams.getCapacity(); streamId++) {
+    StreamSlot *slot = streams.get(streamId);
+
+    if (slot == NULL) continue;
+
+    CircuitConnectHandler connectHandler = slot->connectHandler;
+    CircuitReadHandler readHandler       = slot->readHandler;
+    CircuitReadvHandler readvHandler     = slot->readvHandler;
+    CircuitResolveHandler resolveHandler = slot->resolveHandler;
+    std::vector<boost::asio::const_buffer> buffers;
+
+    releaseStream(streamId);
+
+    if      (connectHandler) connectHandler(err);
+    else if (readHandler)    readHandler(NULL, -1);
+    else if (readvHandler)   readvHandler(buffers, -1);
+    else if (resolveHandler) {
+      std::vector<ResolvedAnswer> answers;
+      resolveHandler(answers, err);
+    }
+  }
 }
 
 void RelayCellDispatcher::dispatchConnectedCell(boost::shared_ptr<RelayCell> cell) {
-  uint16_t streamId = cell->getStreamId();
+  StreamSlot *slot = streams.get(cell->getStreamId());
 
-  std::map<uint16_t, CircuitConnectHandler>::iterator iter = connectedListeners.find(streamId);
-  
-  if (iter != connectedListeners.end()) iter->second(boost::system::error_code());
-  else                                  dataCells[streamId].push_back(cell);
+  if (slot == NULL) {
+    LOG(Log::WARNING) << "Got CONNECTED for unknown stream: " << cell->getStreamId();
+    return;
+  }
+
+  if (slot->state != STREAM_OPENING) {
+    LOG(Log::WARNING) << "Got CONNECTED for stream that isn't opening: " << cell->getStreamId();
+    return;
+  }
+
+  slot->state = STREAM_OPEN;
+  PROBE2(stream_connected, cell->getCircuitId(), slot->streamId);
+
+  // Optimistic streams were handed to their owner right after BEGIN went
+  // out, so there's nobody waiting on the CONNECTED cell.
+  if (slot->optimistic) return;
+
+  if (slot->connectHandler) {
+    CircuitConnectHandler handler = slot->connectHandler;
+    slot->connectHandler.clear();
+    handler(boost::system::error_code());
+  }
 }
 
 void RelayCellDispatcher::dispatchConnectedCellRequest(uint16_t streamId,
 						       CircuitConnectHandler handler)
 {
-  std::map<uint16_t, std::list<boost::shared_ptr<RelayCell> > >::iterator iter =
-    dataCells.find(streamId);
+  StreamSlot *slot = streams.get(streamId);
 
-  if (iter != dataCells.end() && !(iter->second.empty())) {
-    boost::shared_ptr<RelayCell> cell = iter->second.front();    
-    assert(cell->isConnected() || cell->isRelayEnd());
-    
-    if (cell->isConnected()) handler(boost::system::error_code());
-    else                     handler(boost::asio::error::connection_refused);
+  if (slot == NULL) {
+    handler(boost::asio::error::not_connected);
+    return;
+  }
 
-    iter->second.erase(iter->second.begin());
+  if (slot->state != STREAM_OPENING) {
+    handler(boost::system::error_code());
+  } else if (slot->endReceived) {
+    releaseStream(streamId);
+    handler(boost::asio::error::connection_refused);
   } else {
-    connectedListeners[streamId] = handler;
+    slot->connectHandler = handler;
   }
-
 }
 
 void RelayCellDispatcher::dispatchDataCell(boost::shared_ptr<RelayCell> cell) {
   uint16_t streamId = cell->getStreamId();
+  StreamSlot *slot  = streams.get(streamId);
+
+  // Data can still be on its way after we've closed a stream, and it
+  // already came out of the circuit window, so it's credited back here
+  // or the window would shrink with every stream closed that way.
+  if (slot == NULL) {
+    LOG(Log::DEBUG) << "Got data for unknown stream: " << streamId;
+    if (!cell->isRelayEnd()) listener.handleCellsConsumed(streamId, 1);
+    return;
+  }
 
-  std::map<uint16_t, CircuitReadHandler>::iterator dataIter       = dataListeners.find(streamId);
-  std::map<uint16_t, CircuitConnectHandler>::iterator connectIter = connectedListeners.find(streamId);
+  slot->cellsRead++;
 
-  if (dataIter != dataListeners.end()) {
-    dataIter->second(cell->getRelayPayload(), cell->getRelayPayloadLength());
-  } else if (connectIter != connectedListeners.end()) {
-    connectIter->second(boost::asio::error::connection_refused);
-  } else {
-    dataCells[streamId].push_back(cell);
+  if (cell->isRelayEnd()) {
+    dispatchEnd(slot);
+    return;
+  }
+
+  int length = cell->getRelayPayloadLength();
+
+  if (length > (MAX_PAYLOAD_LENGTH) || slot->endReceived) {
+    LOG(Log::WARNING) << "Dropping bad data cell for stream: " << streamId;
+    listener.handleCellsConsumed(streamId, 1);
+    return;
+  }
+
+  slot->bytesRead     += length;
+  slot->bufferedBytes += length;
+  bufferedBytes       += length;
+  slot->unreadCells++;
+
+  slot->buffer.append(cell->getRelayPayload(), length);
+  PROBE4(stream_dispatch, cell->getCircuitId(), streamId, length, slot->bufferedBytes);
+
+  if (cell->getTraceTime() != 0 && slot->traceQueued == 0) {
+    slot->traceQueued = cell->getTraceTime();
+    slot->traceOffset = slot->bufferedBytes;
+  }
+
+  deliverPending(slot);
+}
+
+void RelayCellDispatcher::dispatchEnd(StreamSlot *slot) {
+  slot->endReceived = true;
+
+  if (slot->state == STREAM_OPEN) {
+    slot->state = STREAM_HALF_CLOSED;
+  } else if (slot->state == STREAM_OPENING && slot->optimistic) {
+    // We've already told the client this stream was open and may have
+    // sent its data, so a refusal now can only be reported as EOF.
+    LOG(Log::DEBUG) << "Exit refused optimistic stream: " << slot->streamId;
+    slot->state = STREAM_HALF_CLOSED;
+  }
+
+  if ((slot->readHandler || slot->readvHandler) && slot->buffer.empty()) {
+    failPendingRead(slot);
+  } else if (slot->connectHandler) {
+    CircuitConnectHandler handler = slot->connectHandler;
+    releaseStream(slot->streamId);
+    handler(boost::asio::error::connection_refused);
+  } else if (slot->resolveHandler) {
+    CircuitResolveHandler handler = slot->resolveHandler;
+    std::vector<ResolvedAnswer> answers;
+    releaseStream(slot->streamId);
+    handler(answers, boost::asio::error::host_not_found);
   }
 }
 
 void RelayCellDispatcher::dispatchDataCellRequest(uint16_t streamId, 
 						  CircuitReadHandler handler) 
 {
-  std::map<uint16_t, std::list<boost::shared_ptr<RelayCell> > >::iterator iter = 
-    dataCells.find(streamId);
-  
-  if (iter != dataCells.end() && !(iter->second.empty())) {
-    boost::shared_ptr<RelayCell> cell = iter->second.front();
-    handler(cell->getRelayPayload(), cell->getRelayPayloadLength());
-    iter->second.erase(iter->second.begin());
-  } else {
-    dataListeners[streamId] = handler;
+  StreamSlot *slot = streams.get(streamId);
+
+  if (slot == NULL) {
+    handler(NULL, -1);
+    return;
   }
+
+  consumeDelivered(slot);
+
+  if      (!slot->buffer.empty()) deliverBytes(slot, handler);
+  else if (slot->endReceived)     handler(NULL, -1);
+  else                            slot->readHandler = handler;
+}
+
+void RelayCellDispatcher::dispatchDataBuffersRequest(uint16_t streamId, 
+						     CircuitReadvHandler handler) 
+{
+  StreamSlot *slot = streams.get(streamId);
+  std::vector<boost::asio::const_buffer> buffers;
+
+  if (slot == NULL) {
+    handler(buffers, -1);
+    return;
+  }
+
+  consumeDelivered(slot);
+
+  if      (!slot->buffer.empty()) deliverBuffers(slot, handler);
+  else if (slot->endReceived)     handler(buffers, -1);
+  else                            slot->readvHandler = handler;
+}
+
+bool RelayCellDispatcher::isRemoteClosed(uint16_t streamId) {
+  StreamSlot *slot = streams.get(streamId);
+
+  return slot == NULL || slot->endReceived;
+}
+
+uint32_t RelayCellDispatcher::getBufferedBytes() {
+  return bufferedBytes;
+}
+
+// A RESOLVE uses up a stream ID but never opens a stream, so the slot is
+// done with as soon as its answer comes back.
+
+void RelayCellDispatcher::dispatchResolvedCell(boost::shared_ptr<RelayCell> cell) {
+  uint16_t streamId = cell->getStreamId();
+  StreamSlot *slot  = streams.get(streamId);
+
+  if (slot == NULL || !slot->resolveHandler) {
+    LOG(Log::DEBUG) << "Got RESOLVED for unknown request: " << streamId;
+    return;
+  }
+
+  CircuitResolveHandler handler = slot->resolveHandler;
+  std::vector<ResolvedAnswer> answers;
+
+  RelayResolvedCell(*cell).getAnswers(answers);
+  releaseStream(streamId);
+
+  handler(answers, boost::system::error_code());
+}
+
+void RelayCellDispatcher::dispatchResolvedCellRequest(uint16_t streamId,
+						      CircuitResolveHandler handler)
+{
+  StreamSlot *slot = streams.get(streamId);
+
+  if (slot == NULL) {
+    std::vector<ResolvedAnswer> answers;
+    handler(answers, boost::asio::error::not_connected);
+    return;
+  }
+
+  slot->resolveHandler = handler;
 }
@@ -7,29 +7,61 @@
 #include <boost/function.hpp>
 #include <iostream>
 #include <string>
-#include <map>
-#include <list>
 
 #include "RelayCell.h"
+#include "StreamTable.h"
 
-typedef boost::function<void (const boost::system::error_code &error)> CircuitConnectHandler;
-typedef boost::function<void (unsigned char* buf, int read)> CircuitReadHandler;
+#define MAX_READ_LENGTH (16 * 1024)
+
+/*
+ * Told whenever queued data cells leave the dispatcher, either because
+ * a reader took them or because their stream went away, so that window
+ * updates can follow what's actually been consumed.
+ */
+
+class StreamConsumptionListener {
+
+ public:
+  virtual void handleCellsConsumed(uint16_t streamId, uint32_t cells) = 0;
+};
 
 class RelayCellDispatcher {
 
  private:
-  std::map<uint16_t, std::list<boost::shared_ptr<RelayCell> > > dataCells;
-  std::map<uint16_t, CircuitConnectHandler> connectedListeners;
-  std::map<uint16_t, CircuitReadHandler> dataListeners;
+  uint16_t circuitId;
+  StreamTable &streams;
+  StreamConsumptionListener &listener;
+  uint32_t bufferedBytes;
+
+  void releaseStream(uint16_t streamId);
+  void consumeDelivered(StreamSlot *slot);
+  void deliverBytes(StreamSlot *slot, CircuitReadHandler handler);
+  void deliverBuffers(StreamSlot *slot, CircuitReadvHandler handler);
+  void deliveryComplete(uint16_t streamId);
+  void deliverPending(StreamSlot *slot);
+  void traceDelivery(StreamSlot *slot);
+  void failPendingRead(StreamSlot *slot);
+  void dispatchEnd(StreamSlot *slot);
 
  public:
-  void addStreamId(uint16_t streamId);
+  RelayCellDispatcher(uint16_t circuitId, StreamTable &streams, 
+		      StreamConsumptionListener &listener);
+
+  uint16_t addStream();
   void removeStreamId(uint16_t streamId);
+  void abortStreams(const boost::system::error_code &err);
+  bool isRemoteClosed(uint16_t streamId);
+  uint32_t getBufferedBytes();
+  uint64_t takeTrace(uint16_t streamId);
+
   void dispatchConnectedCell(boost::shared_ptr<RelayCell> cell);
 
   void dispatchConnectedCellRequest(uint16_t streamId, CircuitConnectHandler handler);
   void dispatchDataCell(boost::shared_ptr<RelayCell> cell);
   void dispatchDataCellRequest(uint16_t streamId, CircuitReadHandler handler);
+  void dispatchDataBuffersRequest(uint16_t streamId, CircuitReadvHandler handler);
+  void dispatchResolvedCell(boost::shared_ptr<RelayCell> cell);
+  void dispatchResolvedCellRequest(uint16_t streamId, CircuitResolveHandler handler);
 
 };
 
@@ -0,0 +1,102 @@
+#ifndef __RELAY_RESOLVED_CELL_H__
+#define __RELAY_RESOLVED_CELL_H__
+
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "RelayCell.h"
+#include "../util/Util.h"
+
+#include <boost/asio.hpp>
+#include <boost/array.hpp>
+#include <string>
+#include <vector>
+
+struct ResolvedAnswer {
+  static const unsigned char HOSTNAME_TYPE           = 0x00;
+  static const unsigned char IPV4_TYPE               = 0x04;
+  static const unsigned char IPV6_TYPE               = 0x06;
+  static const unsigned char TRANSIENT_ERROR_TYPE    = 0xF0;
+  static const unsigned char NONTRANSIENT_ERROR_TYPE = 0xF1;
+
+  unsigned char type;
+  std::string value;
+  uint32_t ttl;
+
+  ResolvedAnswer(unsigned char type, std::string value, uint32_t ttl)
+    : type(type), value(value), ttl(ttl)
+  {}
+};
+
+/*
+ * A RELAY_RESOLVED cell carries a list of (type, length, value, TTL)
+ * answers.  Addresses come back as raw bytes, which are turned into the
+ * usual string form here so nothing downstream has to care.
+ */
+
+class RelayResolvedCell : public RelayCell {
+
+ public:
+  RelayResolvedCell(RelayCell &cell) : RelayCell(cell) {}
+
+  void getAnswers(std::vector<ResolvedAnswer> &answers) {
+    unsigned char *payload = getRelayPayload();
+    int length             = getRelayPayloadLength();
+    int offset             = 0;
+
+    if (length > (MAX_PAYLOAD_LENGTH)) return;
+
+    while (offset + 2 <= length) {
+      unsigned char type        = payload[offset];
+      unsigned char valueLength = payload[offset+1];
+
+      if (offset + 2 + valueLength + 4 > length) return;
+
+      unsigned char *value = payload + offset + 2;
+      uint32_t ttl         = Util::bigEndianArrayToInt(value + valueLength);
+
+      if (type == ResolvedAnswer::IPV4_TYPE && valueLength == 4) {
+	boost::array<unsigned char, 4> bytes = {{value[0], value[1], value[2], value[3]}};
+	answers.push_back(ResolvedAnswer(type, boost::asio::ip::address_v4(bytes).to_string(), ttl));
+      } else if (type == ResolvedAnswer::IPV6_TYPE && valueLength == 16) {
+	boost::array<unsigned char, 16> bytes;
+	memcpy(bytes.data(), value, 16);
+	answers.push_back(ResolvedAnswer(type, boost::asio::ip::address_v6(bytes).to_string(), ttl));
+      } else if (type != ResolvedAnswer::IPV4_TYPE && type != ResolvedAnswer::IPV6_TYPE) {
+	answers.push_back(ResolvedAnswer(type, std::string((char*)value, valueLength), ttl));
+      }
+
+      offset += 2 + valueLength + 4;
+    }
+  }
+
+};
+
+
+#endif
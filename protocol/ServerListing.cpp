@@ -28,6 +28,7 @@
  */
 
 #include "ServerListing.h"
+#include "../util/Log.h"
 
 #include <openssl/pem.h>
 #include <openssl/rsa.h>
@@ -52,7 +53,7 @@ ServerListing::ServerListing(boost::asio::io_service &io_service,
 			     bool isFullDescriptor)
   : io_service(io_service), descriptorList(descriptorList)
 {
-  std::cerr << "Full descriptor: " << std::endl << descriptorList << std::endl;
+  LOG(Log::DEBUG) << "Full descriptor:\n" << descriptorList;
   
   int endOfFirstLine    = descriptorList.find("\n");
   std::string firstLine = descriptorList.substr(0, endOfFirstLine);
@@ -33,7 +33,7 @@
 
 ServerListingGroup::ServerListingGroup(boost::asio::io_service &io_service,
 				       std::list<std::string> &groupList) 
-  : io_service(io_service), groupList(groupList)
+  : groupList(groupList), io_service(io_service)
 {
 }
 
@@ -69,7 +69,7 @@ class ServerListingIterator {
 
  public:
   
- ServerListingIterator(ServerListingGroup &group) : group(group), index(0) {}
+ ServerListingIterator(ServerListingGroup &group) : index(0), group(group) {}
   
   boost::shared_ptr<ServerListing> next() {
     int listingStart, listingEnd;
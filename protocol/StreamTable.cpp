@@ -0,0 +1,96 @@
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "StreamTable.h"
+#include "../util/Metrics.h"
+
+static Gauge streamsActive("tortunnel_streams_active", "",
+			   "Streams currently allocated on circuits.");
+
+StreamTable::StreamTable() : activeStreams(0) {}
+
+uint16_t StreamTable::allocate() {
+  uint16_t index;
+
+  if (freeSlots.size() >= REUSE_DELAY || 
+      (!freeSlots.empty() && slots.size() >= MAX_STREAMS)) 
+  {
+    index = freeSlots.front();
+    freeSlots.pop_front();
+  } else if (slots.size() < MAX_STREAMS) {
+    index = slots.size();
+    slots.push_back(StreamSlot());
+  } else {
+    return 0;
+  }
+
+  StreamSlot &slot   = slots[index];
+  slot               = StreamSlot();
+  slot.used          = true;
+  slot.streamId      = index + 1;
+  slot.state         = STREAM_OPENING;
+  slot.deliverWindow = STREAM_WINDOW_START;
+  slot.cellsRead     = 0;
+  slot.cellsWritten  = 0;
+  slot.bytesRead     = 0;
+  slot.bytesWritten  = 0;
+
+  activeStreams++;
+  streamsActive.increment();
+
+  return slot.streamId;
+}
+
+void StreamTable::release(uint16_t streamId) {
+  StreamSlot *slot = get(streamId);
+
+  if (slot == NULL) return;
+
+  slot->buffer.clear();
+  *slot = StreamSlot();
+  freeSlots.push_back(streamId - 1);
+  activeStreams--;
+  streamsActive.decrement();
+}
+
+StreamSlot* StreamTable::get(uint16_t streamId) {
+  if (streamId == 0 || streamId > slots.size()) return NULL;
+
+  StreamSlot *slot = &slots[streamId - 1];
+
+  return slot->used ? slot : NULL;
+}
+
+uint32_t StreamTable::getActiveStreams() {
+  return activeStreams;
+}
+
+uint32_t StreamTable::getCapacity() {
+  return slots.size();
+}
@@ -0,0 +1,147 @@
+#ifndef __STREAM_TABLE_H__
+#define __STREAM_TABLE_H__
+
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/asio.hpp>
+#include <stdint.h>
+#include <vector>
+#include <deque>
+#include <list>
+
+#include "RelayCell.h"
+#include "RelayResolvedCell.h"
+#include "../util/RingBuffer.h"
+
+#define STREAM_WINDOW_START 500
+#define STREAM_WINDOW_INCREMENT 50
+
+typedef boost::function<void (const boost::system::error_code &error)> CircuitConnectHandler;
+typedef boost::function<void (unsigned char* buf, int read)> CircuitReadHandler;
+typedef boost::function<void (std::vector<boost::asio::const_buffer> &buffers, 
+			      int read)> CircuitReadvHandler;
+typedef boost::function<void (std::vector<ResolvedAnswer> &answers, 
+			      const boost::system::error_code &error)> CircuitResolveHandler;
+
+/*
+ * A stream is OPENING until the exit answers our BEGIN, and OPEN after
+ * it answers with CONNECTED.  It's HALF_CLOSED once the exit has sent
+ * END but our side hasn't closed it yet, since there may still be data
+ * queued for the reader.  It's CLOSED, and its slot free, as soon as
+ * both sides are done with it, or the exit refuses it, or the circuit
+ * goes away.
+ */
+
+enum StreamState {
+  STREAM_CLOSED,
+  STREAM_OPENING,
+  STREAM_OPEN,
+  STREAM_HALF_CLOSED
+};
+
+/*
+ * Everything a circuit knows about one of its streams, kept together
+ * so that a cell only costs a single lookup.
+ */
+
+struct StreamSlot {
+  bool used;
+  uint16_t streamId;
+  StreamState state;
+  uint32_t deliverWindow;
+  bool optimistic;
+  bool endReceived;
+
+  RingBuffer buffer;
+  std::vector<unsigned char> partial;
+  CircuitConnectHandler connectHandler;
+  CircuitReadHandler readHandler;
+  CircuitReadvHandler readvHandler;
+  CircuitResolveHandler resolveHandler;
+
+  uint32_t bufferedBytes;
+  uint32_t deliveredBytes;
+  uint32_t readBytes;
+  uint32_t unreadCells;
+  uint32_t consumedCells;
+
+  uint32_t cellsRead;
+  uint32_t cellsWritten;
+  uint64_t bytesRead;
+  uint64_t bytesWritten;
+
+  uint64_t traceQueued;
+  uint32_t traceOffset;
+  uint64_t traceDelivered;
+  uint64_t partialTraced;
+
+  StreamSlot() : used(false), streamId(0), state(STREAM_CLOSED), optimistic(false),
+		 endReceived(false), bufferedBytes(0), deliveredBytes(0), readBytes(0),
+		 unreadCells(0), consumedCells(0), traceQueued(0), traceOffset(0),
+		 traceDelivered(0), partialTraced(0)
+  {}
+};
+
+/*
+ * This class implements a circuit's stream table.  Stream IDs map
+ * directly onto slots in a dense array, so lookups are O(1) and IDs are
+ * never handed out twice while a stream is alive.  The array is a deque,
+ * so growing it never moves a slot: a StreamSlot pointer, and the ring
+ * its data sits in, stay put for as long as the stream does.  Freed
+ * slots are recycled in FIFO order, and only once enough of them have
+ * accumulated, so that a late cell for a closed stream is unlikely to
+ * land on a new stream that happens to reuse its ID.
+ */
+
+class StreamTable {
+
+ private:
+  std::deque<StreamSlot> slots;
+  std::deque<uint16_t> freeSlots;
+  uint32_t activeStreams;
+
+ public:
+  static const uint32_t MAX_STREAMS = 65535;
+  static const uint32_t REUSE_DELAY = 32;
+
+  StreamTable();
+
+  uint16_t allocate();
+  void release(uint16_t streamId);
+  StreamSlot* get(uint16_t streamId);
+
+  uint32_t getActiveStreams();
+  uint32_t getCapacity();
+};
+
+
+#endif
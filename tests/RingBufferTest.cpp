@@ -0,0 +1,193 @@
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "Test.h"
+#include "../util/RingBuffer.h"
+
+#include <cstring>
+#include <string>
+
+/*
+ * Checks that the ring wraps, grows while wrapped without scrambling
+ * what it holds, and hands back the right runs from peek() at an
+ * offset, across consume() and clear().
+ */
+
+static void fill(unsigned char *buf, size_t len, unsigned char start) {
+  for (size_t i=0;i<len;i++)
+    buf[i] = (unsigned char)(start + i);
+}
+
+// Reads the whole ring out through peek(), without consuming it.
+
+static std::string contents(RingBuffer &ring) {
+  std::string result;
+  unsigned char *buf;
+  size_t length;
+  size_t offset = 0;
+
+  while ((length = ring.peek(&buf, ring.size(), offset)) > 0) {
+    result.append((char*)buf, length);
+    offset += length;
+  }
+
+  return result;
+}
+
+static std::string expected(size_t len, unsigned char start) {
+  std::string result;
+
+  for (size_t i=0;i<len;i++)
+    result.push_back((char)(unsigned char)(start + i));
+
+  return result;
+}
+
+static void testEmpty() {
+  RingBuffer ring;
+  unsigned char *buf;
+
+  CHECK(ring.empty());
+  CHECK(ring.size() == 0);
+  CHECK(ring.capacity() == 0);
+  CHECK(ring.peek(&buf, 100) == 0);
+
+  ring.append(NULL, 0);
+  CHECK(ring.capacity() == 0);
+}
+
+static void testWrap() {
+  RingBuffer ring;
+  unsigned char data[4096];
+  unsigned char *buf;
+
+  fill(data, sizeof(data), 0);
+  ring.append(data, 3000);
+  ring.consume(2000);
+
+  // 1000 bytes sit near the end of the storage, so of 2000 more, 1096
+  // fill it out and the rest wrap around to the front without growing it.
+  fill(data, 2000, 200);
+  ring.append(data, 2000);
+
+  CHECK(ring.capacity() == 4096);
+  CHECK(ring.size() == 3000);
+  CHECK(ring.peek(&buf, 4096) == 2096);
+  CHECK(buf[0] == (unsigned char)2000);
+  CHECK(ring.peek(&buf, 4096, 2096) == 904);
+  CHECK(buf[0] == (unsigned char)(200 + 1096));
+  CHECK(ring.peek(&buf, 10, 1500) == 10);
+  CHECK(buf[0] == (unsigned char)(200 + 500));
+  CHECK(ring.peek(&buf, 4096, 3000) == 0);
+
+  CHECK(contents(ring) == expected(1000, 2000 % 256) + expected(2000, 200));
+
+  // Consuming past the wrap moves the head round to the front.
+  ring.consume(2500);
+  CHECK(ring.size() == 500);
+  CHECK(ring.peek(&buf, 4096) == 500);
+  CHECK(buf[0] == (unsigned char)(200 + 1500));
+}
+
+static void testGrowWhileWrapped() {
+  RingBuffer ring;
+  unsigned char data[8192];
+
+  fill(data, 4000, 0);
+  ring.append(data, 4000);
+  ring.consume(3000);
+  fill(data, 2000, 50);
+  ring.append(data, 2000);
+
+  // Wrapped with 3000 held, and 5000 more don't fit in 4096.
+  fill(data, 5000, 100);
+  ring.append(data, 5000);
+
+  CHECK(ring.capacity() == 8192);
+  CHECK(ring.size() == 8000);
+  CHECK(contents(ring) == expected(1000, 3000 % 256) + expected(2000, 50) + 
+	expected(5000, 100));
+
+  // A grown ring is straightened out, so all of it peeks in one run.
+  unsigned char *buf;
+  CHECK(ring.peek(&buf, 8192) == 8000);
+
+  // Growing again, past several doublings at once.
+  std::string big(40000, 'x');
+  ring.append((const unsigned char*)big.data(), big.size());
+
+  CHECK(ring.capacity() == 65536);
+  CHECK(ring.size() == 48000);
+  CHECK(contents(ring).substr(8000) == big);
+}
+
+static void testConsumeAll() {
+  RingBuffer ring;
+  unsigned char data[1000];
+  unsigned char *buf;
+
+  fill(data, sizeof(data), 7);
+  ring.append(data, sizeof(data));
+  ring.consume(600);
+  ring.consume(400);
+
+  // Draining it puts the head back at the start, so the next append
+  // doesn't wrap needlessly.
+  CHECK(ring.empty());
+  ring.append(data, sizeof(data));
+  CHECK(ring.capacity() == 4096);
+  CHECK(ring.peek(&buf, 4096) == 1000);
+  CHECK(memcmp(buf, data, sizeof(data)) == 0);
+}
+
+static void testClear() {
+  RingBuffer ring;
+  unsigned char data[5000];
+
+  fill(data, sizeof(data), 0);
+  ring.append(data, sizeof(data));
+  ring.clear();
+
+  CHECK(ring.empty());
+  CHECK(ring.capacity() == 0);
+
+  ring.append(data, 10);
+  CHECK(ring.capacity() == 4096);
+  CHECK(contents(ring) == expected(10, 0));
+}
+
+int main(int argc, char **argv) {
+  testEmpty();
+  testWrap();
+  testGrowWhileWrapped();
+  testConsumeAll();
+  testClear();
+
+  return Test::result();
+}
@@ -0,0 +1,212 @@
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "Test.h"
+#include "../protocol/RelayCellDispatcher.h"
+#include "../protocol/RelayEndCell.h"
+#include "../protocol/StreamTable.h"
+#include "../util/Log.h"
+
+#include <boost/bind.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <unistd.h>
+
+/*
+ * Runs millions of streams through a circuit's dispatcher and stream
+ * table, a thousand or so at a time, taking each one down a different
+ * path: closed by us after reading, closed by the exit with data still
+ * buffered, refused before CONNECTED, and torn down with the rest of
+ * the circuit.  Every path has to give back its slot, its ring, and its
+ * window credit, and resident memory has to stay flat once the first
+ * batches have warmed up the allocator.
+ */
+
+static const uint16_t CIRCUIT_ID  = 1;
+static const uint32_t CONCURRENT  = 1000;
+
+class CountingListener : public StreamConsumptionListener {
+ public:
+  uint64_t consumed;
+
+  CountingListener() : consumed(0) {}
+
+  void handleCellsConsumed(uint16_t streamId, uint32_t cells) {
+    consumed += cells;
+  }
+};
+
+static uint64_t cellsDelivered = 0;
+static uint64_t bytesRead      = 0;
+static uint64_t refused        = 0;
+static uint64_t aborted        = 0;
+
+static void connectComplete(const boost::system::error_code &err) {
+  if (err == boost::asio::error::connection_refused) refused++;
+  else if (err)                                      aborted++;
+}
+
+static void readComplete(std::vector<boost::asio::const_buffer> &buffers, int read) {
+  if (read > 0) bytesRead += read;
+}
+
+static long getResidentKilobytes() {
+  long pages = 0, resident = 0;
+  FILE *statm = fopen("/proc/self/statm", "r");
+
+  if (statm == NULL) return 0;
+
+  if (fscanf(statm, "%ld %ld", &pages, &resident) != 2) resident = 0;
+  fclose(statm);
+
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void sendData(RelayCellDispatcher &dispatcher, uint16_t streamId, int cells) {
+  unsigned char payload[MAX_PAYLOAD_LENGTH];
+
+  memset(payload, streamId & 0xff, sizeof(payload));
+
+  for (int i=0;i<cells;i++) {
+    boost::shared_ptr<RelayCell> cell(new RelayCell(CIRCUIT_ID, streamId, RelayCell::DATA_TYPE,
+						    payload, sizeof(payload)));
+    dispatcher.dispatchDataCell(cell);
+    cellsDelivered++;
+  }
+}
+
+static void sendConnected(RelayCellDispatcher &dispatcher, uint16_t streamId) {
+  boost::shared_ptr<RelayCell> cell(new RelayCell(CIRCUIT_ID, streamId, 
+						  RelayCell::CONNECTED_TYPE, (unsigned char)0));
+  dispatcher.dispatchConnectedCell(cell);
+}
+
+static void sendEnd(RelayCellDispatcher &dispatcher, uint16_t streamId) {
+  boost::shared_ptr<RelayCell> cell(new RelayEndCell(CIRCUIT_ID, streamId));
+  dispatcher.dispatchDataCell(cell);
+}
+
+// One batch of concurrent streams, each taking the path its position
+// in the batch picks for it.
+
+static void runBatch(StreamTable &table, CountingListener &listener,
+		     RelayCellDispatcher &dispatcher) 
+{
+  uint16_t streamIds[CONCURRENT];
+
+  for (uint32_t i=0;i<CONCURRENT;i++) {
+    streamIds[i] = dispatcher.addStream();
+    dispatcher.dispatchConnectedCellRequest(streamIds[i], connectComplete);
+  }
+
+  for (uint32_t i=0;i<CONCURRENT;i++) {
+    uint16_t streamId = streamIds[i];
+
+    switch (i % 4) {
+    case 0:
+      // Read everything, then closed by us.
+      sendConnected(dispatcher, streamId);
+      sendData(dispatcher, streamId, 3);
+      dispatcher.dispatchDataBuffersRequest(streamId, readComplete);
+      // What the reader was handed is gone once its handler returns.
+      CHECK(table.get(streamId)->bufferedBytes == 0);
+      dispatcher.dispatchDataBuffersRequest(streamId, readComplete);
+      dispatcher.removeStreamId(streamId);
+      break;
+
+    case 1: {
+      // Closed by the exit with data nobody read, then closed by us while
+      // one more cell was still on its way, which counts as consumed too.
+      sendConnected(dispatcher, streamId);
+      sendData(dispatcher, streamId, 2);
+      sendEnd(dispatcher, streamId);
+      dispatcher.removeStreamId(streamId);
+
+      uint64_t consumed = listener.consumed;
+      sendData(dispatcher, streamId, 1);
+      CHECK(listener.consumed == consumed + 1);
+      break;
+    }
+
+    case 2:
+      // Refused before it ever connected.
+      sendEnd(dispatcher, streamId);
+      break;
+
+    case 3:
+      // Still open, with a read pending, when the circuit goes away.
+      sendConnected(dispatcher, streamId);
+      sendData(dispatcher, streamId, 1);
+      dispatcher.dispatchDataBuffersRequest(streamId, readComplete);
+      dispatcher.dispatchDataBuffersRequest(streamId, readComplete);
+      break;
+    }
+  }
+
+  dispatcher.abortStreams(boost::asio::error::connection_reset);
+}
+
+int main(int argc, char **argv) {
+  uint64_t streams = argc > 1 ? strtoull(argv[1], NULL, 10) : 2000000;
+  uint64_t batches = streams / CONCURRENT;
+  long warmResident = 0;
+
+  Log::setLevel(Log::ERROR);
+
+  StreamTable table;
+  CountingListener listener;
+  RelayCellDispatcher dispatcher(CIRCUIT_ID, table, listener);
+
+  for (uint64_t batch=0;batch<batches;batch++) {
+    runBatch(table, listener, dispatcher);
+
+    if (batch == batches / 10)
+      warmResident = getResidentKilobytes();
+  }
+
+  long finalResident = getResidentKilobytes();
+
+  std::cout << "streams=" << batches * CONCURRENT
+	    << " cells=" << cellsDelivered
+	    << " refused=" << refused
+	    << " warm_rss_kb=" << warmResident
+	    << " final_rss_kb=" << finalResident << std::endl;
+
+  CHECK(table.getActiveStreams() == 0);
+  CHECK(table.getCapacity() <= StreamTable::MAX_STREAMS);
+  CHECK(dispatcher.getBufferedBytes() == 0);
+  CHECK(listener.consumed == cellsDelivered);
+  CHECK(refused == batches * (CONCURRENT / 4));
+  CHECK(aborted == 0);
+  CHECK(bytesRead == batches * (CONCURRENT / 4) * 4 * (MAX_PAYLOAD_LENGTH));
+  CHECK(finalResident <= warmResident + 1024);
+
+  return Test::result();
+}
@@ -0,0 +1,151 @@
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "Test.h"
+#include "../protocol/StreamTable.h"
+#include "../util/Log.h"
+#include "../util/Util.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <set>
+
+/*
+ * Checks that the stream table hands out collision-free IDs, holds
+ * freed IDs back before reusing them, and never moves a live slot or
+ * its ring as it grows, then times lookups and churn with thousands of
+ * concurrent streams on one circuit.
+ */
+
+static void testUniqueIds() {
+  StreamTable table;
+  std::set<uint16_t> live;
+
+  for (uint32_t i=0;i<StreamTable::MAX_STREAMS;i++) {
+    uint16_t streamId = table.allocate();
+
+    CHECK(streamId != 0);
+    CHECK(live.insert(streamId).second);
+  }
+
+  CHECK(table.getActiveStreams() == StreamTable::MAX_STREAMS);
+  CHECK(table.allocate() == 0);
+
+  // A full table reuses a freed ID right away rather than failing.
+  table.release(1000);
+  CHECK(table.get(1000) == NULL);
+  CHECK(table.allocate() == 1000);
+}
+
+static void testReuseDelay() {
+  StreamTable table;
+  uint16_t first = table.allocate();
+
+  table.release(first);
+
+  for (uint32_t i=0;i<StreamTable::REUSE_DELAY - 1;i++) {
+    uint16_t streamId = table.allocate();
+
+    CHECK(streamId != first);
+    table.release(streamId);
+  }
+
+  // Once REUSE_DELAY IDs are waiting, the oldest one goes out first.
+  CHECK(table.allocate() == first);
+}
+
+static void testStableSlots() {
+  StreamTable table;
+  uint16_t streamId = table.allocate();
+  StreamSlot *slot  = table.get(streamId);
+  unsigned char data[1024];
+  unsigned char *before, *after;
+
+  memset(data, 'x', sizeof(data));
+  slot->buffer.append(data, sizeof(data));
+  slot->buffer.peek(&before, sizeof(data));
+
+  for (int i=0;i<20000;i++)
+    table.allocate();
+
+  CHECK(table.get(streamId) == slot);
+
+  slot->buffer.peek(&after, sizeof(data));
+  CHECK(after == before);
+  CHECK(after[0] == 'x' && after[sizeof(data) - 1] == 'x');
+}
+
+static void benchmark(uint32_t streams) {
+  StreamTable table;
+  uint64_t found = 0;
+
+  for (uint32_t i=0;i<streams;i++)
+    table.allocate();
+
+  uint64_t start = Util::getTimeMicros();
+
+  for (uint32_t i=0;i<10000000;i++)
+    if (table.get((i * 7919) % streams + 1) != NULL) found++;
+
+  uint64_t lookups = Util::getTimeMicros() - start;
+  start            = Util::getTimeMicros();
+
+  for (uint32_t i=0;i<1000000;i++) {
+    table.release((i * 7919) % streams + 1);
+    table.allocate();
+  }
+
+  uint64_t churn = Util::getTimeMicros() - start;
+
+  CHECK(found == 10000000);
+  CHECK(table.getActiveStreams() == streams);
+
+  std::cout << std::setw(8) << streams 
+	    << std::setw(14) << (lookups * 1000) / 10000000
+	    << std::setw(14) << (churn * 1000) / 1000000 << std::endl;
+}
+
+int main(int argc, char **argv) {
+  Log::setLevel(Log::ERROR);
+
+  testUniqueIds();
+  testReuseDelay();
+  testStableSlots();
+
+  std::cout << std::setw(8) << "streams" << std::setw(14) << "lookup_ns" 
+	    << std::setw(14) << "churn_ns" << std::endl;
+
+  benchmark(1000);
+  benchmark(10000);
+  benchmark(60000);
+
+  return Test::result();
+}
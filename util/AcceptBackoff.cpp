@@ -0,0 +1,56 @@
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "AcceptBackoff.h"
+
+#include <boost/bind.hpp>
+
+const uint32_t AcceptBackoff::RETRY_DELAY_MS;
+
+AcceptBackoff::AcceptBackoff(boost::asio::io_service &io_service, AcceptResumeHandler resume)
+  : timer(io_service), resume(resume), paused(0)
+{}
+
+void AcceptBackoff::pause() {
+  if (paused++ > 0) return;
+
+  timer.expires_from_now(boost::posix_time::milliseconds(RETRY_DELAY_MS));
+  timer.async_wait(boost::bind(&AcceptBackoff::timerExpired, this, 
+			       boost::asio::placeholders::error));
+}
+
+void AcceptBackoff::timerExpired(const boost::system::error_code &err) {
+  if (err == boost::asio::error::operation_aborted) return;
+
+  uint32_t resumed = paused;
+  paused           = 0;
+
+  for (uint32_t i=0;i<resumed;i++)
+    resume();
+}
@@ -0,0 +1,67 @@
+#ifndef __ACCEPT_BACKOFF_H__
+#define __ACCEPT_BACKOFF_H__
+
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <boost/asio.hpp>
+#include <boost/function.hpp>
+#include <stdint.h>
+
+typedef boost::function<void ()> AcceptResumeHandler;
+
+/***********
+ *
+ * AcceptBackoff holds back accepts that failed.  A failed accept usually
+ * means we're out of descriptors (EMFILE or ENFILE), and a listener
+ * stays readable until some are freed, so going straight back to it
+ * would spin.  Each pause() is instead answered by one call to the
+ * resume handler once RETRY_DELAY_MS is up, with all the accepts that
+ * failed in the meantime waiting on the same timer.
+ *
+ **********/
+
+class AcceptBackoff {
+
+ private:
+  static const uint32_t RETRY_DELAY_MS = 100;
+
+  boost::asio::deadline_timer timer;
+  AcceptResumeHandler resume;
+  uint32_t paused;
+
+  void timerExpired(const boost::system::error_code &err);
+
+ public:
+  AcceptBackoff(boost::asio::io_service &io_service, AcceptResumeHandler resume);
+
+  void pause();
+};
+
+#endif
@@ -0,0 +1,103 @@
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "CellTrace.h"
+#include "Util.h"
+
+#include <iomanip>
+
+volatile int CellTrace::interval = 0;
+__thread int CellTrace::countdown = 0;
+
+static const char *STAGE_NAMES[] = {
+  "downstream tls_read", "downstream decrypt", "downstream stream_queue",
+  "downstream client_write", "upstream coalesce", "upstream window",
+  "upstream encrypt", "upstream tls_write"
+};
+
+static const uint64_t STAGE_BUCKETS[] = {10, 50, 100, 500, 1000, 5000, 10000,
+					 50000, 100000, 500000, 1000000};
+
+#define STAGE_HISTOGRAM(name, direction, stage)					\
+  static Histogram name("tortunnel_cell_stage_microseconds",			\
+			"direction=\"" direction "\",stage=\"" stage "\"",	\
+			"Time sampled cells spent in each pipeline stage.",	\
+			STAGE_BUCKETS, sizeof(STAGE_BUCKETS) / sizeof(uint64_t))
+
+STAGE_HISTOGRAM(downTlsRead,     "downstream", "tls_read");
+STAGE_HISTOGRAM(downDecrypt,     "downstream", "decrypt");
+STAGE_HISTOGRAM(downStreamQueue, "downstream", "stream_queue");
+STAGE_HISTOGRAM(downClientWrite, "downstream", "client_write");
+STAGE_HISTOGRAM(upCoalesce,      "upstream",   "coalesce");
+STAGE_HISTOGRAM(upWindow,        "upstream",   "window");
+STAGE_HISTOGRAM(upEncrypt,       "upstream",   "encrypt");
+STAGE_HISTOGRAM(upTlsWrite,      "upstream",   "tls_write");
+
+Histogram* CellTrace::getHistogram(Stage stage) {
+  static Histogram* histograms[STAGES] = {
+    &downTlsRead, &downDecrypt, &downStreamQueue, &downClientWrite,
+    &upCoalesce, &upWindow, &upEncrypt, &upTlsWrite
+  };
+
+  return histograms[stage];
+}
+
+void CellTrace::setInterval(int interval) {
+  CellTrace::interval = interval;
+}
+
+void CellTrace::record(Stage stage, uint64_t started, uint64_t finished) {
+  if (started == 0) return;
+
+  getHistogram(stage)->observe(finished > started ? finished - started : 0);
+}
+
+// Closes out a stage that began at started, and returns the time the
+// next stage begins, or zero if the cell isn't being traced.
+
+uint64_t CellTrace::advance(Stage stage, uint64_t started) {
+  if (started == 0) return 0;
+
+  uint64_t now = Util::getTimeMicros();
+  record(stage, started, now);
+
+  return now;
+}
+
+void CellTrace::dump(std::ostream &out) {
+  out << "stage                      samples     mean      p50      p90      p99\n";
+
+  for (int stage=0;stage<STAGES;stage++) {
+    out << std::left << std::setw(26) << STAGE_NAMES[stage] << std::right;
+    getHistogram((Stage)stage)->summarize(out);
+    out << "\n";
+  }
+
+  out << "(microseconds)\n";
+}
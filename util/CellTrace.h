@@ -0,0 +1,98 @@
+#ifndef __CELL_TRACE_H__
+#define __CELL_TRACE_H__
+
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <ostream>
+#include <stdint.h>
+
+#include "Metrics.h"
+
+/***********
+ *
+ * CellTrace follows a sample of cells through each stage between the
+ * exit's TLS connection and the client's socket, and records how long
+ * each stage took in a per-stage histogram.  A sampled cell carries
+ * the time its current stage began, and each stage that sees it
+ * records the difference and stamps the time again for the next.  A
+ * timestamp of zero means the cell isn't being traced.
+ *
+ * Downstream, a cell goes from its bytes arriving on the TLS socket,
+ * through relay decryption, into its stream's buffer until the client
+ * side reads it, and out to the client's socket.  Upstream, client
+ * data may wait to fill a cell, wait for circuit window, get
+ * encrypted, and then wait on the TLS socket.
+ *
+ * Sampling is off unless setInterval() is given a non-zero interval,
+ * in which case one cell in every interval is traced on each thread.
+ *
+ **********/
+
+class CellTrace {
+
+ public:
+  enum Stage {
+    DOWN_TLS_READ,
+    DOWN_DECRYPT,
+    DOWN_STREAM_QUEUE,
+    DOWN_CLIENT_WRITE,
+    UP_COALESCE,
+    UP_WINDOW,
+    UP_ENCRYPT,
+    UP_TLS_WRITE,
+    STAGES
+  };
+
+ private:
+  static volatile int interval;
+  static __thread int countdown;
+
+  static Histogram* getHistogram(Stage stage);
+
+ public:
+  static void setInterval(int interval);
+
+  static bool isEnabled() {
+    return interval != 0;
+  }
+
+  static bool sample() {
+    if (interval == 0 || --countdown > 0) return false;
+
+    countdown = interval;
+    return true;
+  }
+
+  static void record(Stage stage, uint64_t started, uint64_t finished);
+  static uint64_t advance(Stage stage, uint64_t started);
+  static void dump(std::ostream &out);
+};
+
+#endif
@@ -0,0 +1,148 @@
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "Log.h"
+#include "Util.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+Log::Entry * volatile Log::pending = NULL;
+volatile int Log::threshold        = Log::INFO;
+volatile bool Log::running         = false;
+boost::thread *Log::writer         = NULL;
+
+const uint32_t Log::FLUSH_INTERVAL;
+
+void Log::start() {
+  static bool registered = false;
+
+  if (running) return;
+
+  running = true;
+  writer  = new boost::thread(&Log::run);
+
+  if (!registered) {
+    registered = true;
+    atexit(&Log::stop);
+  }
+}
+
+void Log::stop() {
+  if (!running) return;
+
+  running = false;
+  writer->interrupt();
+  writer->join();
+
+  delete writer;
+  writer = NULL;
+
+  flush();
+}
+
+void Log::setLevel(Level level) {
+  threshold = level;
+}
+
+void Log::submit(Level level, const std::string &message) {
+  Entry *entry   = new Entry();
+  entry->level   = level;
+  entry->time    = Util::getTimeMicros();
+  entry->message = message;
+
+  if (!running) {
+    write(entry);
+    fflush(stderr);
+    delete entry;
+    return;
+  }
+
+  Entry *head;
+
+  do {
+    head        = pending;
+    entry->next = head;
+  } while (__sync_val_compare_and_swap(&pending, head, entry) != head);
+}
+
+void Log::run() {
+  try {
+    while (running) {
+      flush();
+      boost::this_thread::sleep(boost::posix_time::milliseconds(FLUSH_INTERVAL));
+    }
+  } catch (boost::thread_interrupted &e) {}
+}
+
+// Producers only ever push, and this takes the whole list at once, so
+// there's no ABA to worry about.  The list comes off newest first.
+
+void Log::flush() {
+  Entry *head;
+
+  do {
+    head = pending;
+  } while (head != NULL && __sync_val_compare_and_swap(&pending, head, (Entry*)NULL) != head);
+
+  if (head == NULL) return;
+
+  Entry *ordered = NULL;
+
+  while (head != NULL) {
+    Entry *next = head->next;
+    head->next  = ordered;
+    ordered     = head;
+    head        = next;
+  }
+
+  while (ordered != NULL) {
+    Entry *next = ordered->next;
+    write(ordered);
+    delete ordered;
+    ordered = next;
+  }
+
+  fflush(stderr);
+}
+
+void Log::write(Entry *entry) {
+  static const char *names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+  time_t seconds = entry->time / 1000000;
+  struct tm local;
+  char timestamp[32];
+
+  localtime_r(&seconds, &local);
+  strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", &local);
+
+  fprintf(stderr, "%s.%03u %-5s %s\n", timestamp, (unsigned int)((entry->time / 1000) % 1000),
+	  names[entry->level], entry->message.c_str());
+}
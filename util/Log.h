@@ -0,0 +1,140 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <boost/thread.hpp>
+#include <sstream>
+#include <string>
+#include <stdint.h>
+
+// Levels below this are compiled out entirely, e.g. -DLOG_MINIMUM_LEVEL=1
+// drops every debug statement from the binary.
+#ifndef LOG_MINIMUM_LEVEL
+#define LOG_MINIMUM_LEVEL 0
+#endif
+
+/***********
+ *
+ * Log hands formatted lines to a background writer thread, so that the
+ * io threads never wait on stderr.  Producers push onto a lock-free
+ * list and the writer takes the whole list at once every few
+ * milliseconds.  Statements go through the LOG() macro, which doesn't
+ * evaluate its arguments at all when the level is disabled:
+ *
+ *   LOG(Log::INFO) << "Tunnel ready" << Log::field("exit", address);
+ *
+ * Until start() is called, and after stop(), lines are written
+ * synchronously.  The writer thread doesn't survive a fork, and could
+ * be holding stderr's lock when it happens, so anything that forks
+ * calls stop() first and start() again on both sides.
+ *
+ **********/
+
+class Log {
+
+ public:
+  enum Level {
+    DEBUG   = 0,
+    INFO    = 1,
+    WARNING = 2,
+    ERROR   = 3
+  };
+
+  template <class T>
+  struct Field {
+    const char *key;
+    const T &value;
+
+    Field(const char *key, const T &value) : key(key), value(value) {}
+  };
+
+ private:
+  static const uint32_t FLUSH_INTERVAL = 10;
+
+  struct Entry {
+    Entry *next;
+    Level level;
+    uint64_t time;
+    std::string message;
+  };
+
+  static Entry * volatile pending;
+  static volatile int threshold;
+  static volatile bool running;
+  static boost::thread *writer;
+
+  static void run();
+  static void flush();
+  static void write(Entry *entry);
+
+ public:
+  static void start();
+  static void stop();
+
+  static void setLevel(Level level);
+  static void submit(Level level, const std::string &message);
+
+  static bool isEnabled(Level level) {
+    return level >= LOG_MINIMUM_LEVEL && level >= threshold;
+  }
+
+  template <class T>
+  static Field<T> field(const char *key, const T &value) {
+    return Field<T>(key, value);
+  }
+};
+
+template <class T>
+std::ostream& operator<<(std::ostream &out, const Log::Field<T> &field) {
+  return out << ' ' << field.key << '=' << field.value;
+}
+
+class LogLine {
+
+ private:
+  Log::Level level;
+  std::ostringstream buffer;
+
+ public:
+  LogLine(Log::Level level) : level(level) {}
+  ~LogLine() { Log::submit(level, buffer.str()); }
+
+  std::ostream& stream() { return buffer; }
+};
+
+struct LogVoidify {
+  void operator&(std::ostream &) {}
+};
+
+#define LOG(level) \
+  !Log::isEnabled(level) ? (void) 0 : LogVoidify() & LogLine(level).stream()
+
+#endif
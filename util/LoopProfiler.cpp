@@ -0,0 +1,177 @@
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "LoopProfiler.h"
+#include "Log.h"
+
+#include <boost/bind.hpp>
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <signal.h>
+#include <sstream>
+
+volatile bool LoopProfiler::enabled        = false;
+volatile int LoopProfiler::reportRequested = 0;
+uint32_t LoopProfiler::interval            = 0;
+
+static const uint32_t REPORT_TAGS = 10;
+
+static const uint64_t HANDLER_BUCKETS[] = {10, 50, 100, 500, 1000, 5000, 10000, 
+					   50000, 100000, 500000, 1000000};
+
+static Histogram loopLag("tortunnel_loop_lag_microseconds", "",
+			 "How late event loops ran their probe timers.",
+			 HANDLER_BUCKETS, sizeof(HANDLER_BUCKETS) / sizeof(uint64_t));
+
+HandlerTag::HandlerTag(const char *name, const char *labels)
+  : name(name), 
+    histogram("tortunnel_handler_microseconds", labels, 
+	      "Time spent running tagged completion handlers.",
+	      HANDLER_BUCKETS, sizeof(HANDLER_BUCKETS) / sizeof(uint64_t)),
+    maxMicros(0)
+{
+  LoopProfiler::add(this);
+}
+
+void HandlerTag::record(uint64_t micros) {
+  uint64_t max;
+
+  histogram.observe(micros);
+
+  while (micros > (max = maxMicros) && 
+	 !__sync_bool_compare_and_swap(&maxMicros, max, micros));
+}
+
+LoopProfiler::LoopProfiler(boost::asio::io_service &io_service) 
+  : timer(io_service), expected(0)
+{}
+
+// Like the metrics registry, the tags are kept in a function-local so
+// static tags in other files can register in any order.
+
+std::vector<HandlerTag*>& LoopProfiler::getTags() {
+  static std::vector<HandlerTag*> tags;
+  return tags;
+}
+
+void LoopProfiler::add(HandlerTag *tag) {
+  getTags().push_back(tag);
+}
+
+void LoopProfiler::start(uint32_t milliseconds) {
+  struct sigaction action;
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = &LoopProfiler::handleSignal;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGUSR1, &action, NULL);
+
+  interval = milliseconds;
+  enabled  = true;
+}
+
+// Each io_service gets a probe of its own, which lives as long as the
+// process does.
+
+void LoopProfiler::watch(boost::asio::io_service &io_service) {
+  if (!enabled) return;
+
+  LoopProfiler *probe = new LoopProfiler(io_service);
+  probe->scheduleProbe();
+}
+
+void LoopProfiler::scheduleProbe() {
+  expected = Util::getTimeMicros() + interval * 1000;
+
+  timer.expires_from_now(boost::posix_time::milliseconds(interval));
+  timer.async_wait(boost::bind(&LoopProfiler::probeExpired, this, 
+			       boost::asio::placeholders::error));
+}
+
+// The report can't be written from the signal handler itself, so the
+// first probe to come around after a signal writes it.
+
+void LoopProfiler::probeExpired(const boost::system::error_code &err) {
+  if (err) return;
+
+  uint64_t now = Util::getTimeMicros();
+  loopLag.observe(now > expected ? now - expected : 0);
+
+  if (__sync_bool_compare_and_swap(&reportRequested, 1, 0))
+    logReport();
+
+  scheduleProbe();
+}
+
+void LoopProfiler::handleSignal(int signal) {
+  reportRequested = 1;
+}
+
+static bool compareWorst(HandlerTag *a, HandlerTag *b) {
+  return a->getMaxMicros() > b->getMaxMicros();
+}
+
+// The handlers that have held a loop up the longest in a single run,
+// since a single long stall is what delays everything queued behind it.
+
+void LoopProfiler::report(std::ostream &out) {
+  std::vector<HandlerTag*> tags(getTags());
+  std::sort(tags.begin(), tags.end(), compareWorst);
+
+  out << "handler                   runs     mean      p50      p90      p99      max\n";
+
+  for (uint32_t i=0;i<tags.size() && i<REPORT_TAGS;i++) {
+    if (tags[i]->getMaxMicros() == 0) break;
+
+    out << std::left << std::setw(22) << tags[i]->getName() << std::right;
+    tags[i]->getHistogram().summarize(out);
+    out << " " << std::setw(8) << tags[i]->getMaxMicros() << "\n";
+  }
+
+  out << "\n"
+      << "loop lag                probes     mean      p50      p90      p99\n"
+      << std::left << std::setw(22) << "all loops" << std::right;
+
+  loopLag.summarize(out);
+
+  out << "\n(microseconds)\n";
+}
+
+void LoopProfiler::logReport() {
+  std::ostringstream out;
+  std::string line;
+
+  report(out);
+
+  std::istringstream lines(out.str());
+
+  while (std::getline(lines, line))
+    if (!line.empty()) LOG(Log::INFO) << line;
+}
@@ -0,0 +1,240 @@
+#ifndef __LOOP_PROFILER_H__
+#define __LOOP_PROFILER_H__
+
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <boost/asio.hpp>
+#include <ostream>
+#include <vector>
+#include <stdint.h>
+
+#include "Metrics.h"
+#include "Util.h"
+
+/***********
+ *
+ * LoopProfiler finds what's holding up an io_service.  Handlers that
+ * are worth watching are wrapped at their call sites with a static
+ * HandlerTag, and each run of one is timed into that tag's histogram.
+ * A probe timer on each watched io_service measures how late it fires,
+ * which is how long anything at all has been kept waiting.
+ *
+ * Everything is off until start() is called, at which point the
+ * wrappers cost a clock read on either side of the handler.  The top
+ * offenders and the lag histogram are written to the log on SIGUSR1,
+ * and are available from report() for the metrics port.
+ *
+ **********/
+
+class HandlerTag {
+
+ private:
+  const char *name;
+  Histogram histogram;
+  volatile uint64_t maxMicros;
+
+ public:
+  HandlerTag(const char *name, const char *labels);
+
+  void record(uint64_t micros);
+
+  const char* getName()     { return name;      }
+  uint64_t getMaxMicros()   { return maxMicros; }
+  Histogram& getHistogram() { return histogram; }
+};
+
+#define HANDLER_TAG(variable, name) \
+  static HandlerTag variable(name, "handler=\"" name "\"")
+
+template <typename Handler>
+class ProfiledHandler;
+
+class LoopProfiler {
+
+ private:
+  static volatile bool enabled;
+  static volatile int reportRequested;
+  static uint32_t interval;
+
+  boost::asio::deadline_timer timer;
+  uint64_t expected;
+
+  LoopProfiler(boost::asio::io_service &io_service);
+
+  void scheduleProbe();
+  void probeExpired(const boost::system::error_code &err);
+
+  static std::vector<HandlerTag*>& getTags();
+  static void handleSignal(int signal);
+  static void logReport();
+
+ public:
+  static void start(uint32_t milliseconds);
+  static void watch(boost::asio::io_service &io_service);
+
+  static void add(HandlerTag *tag);
+  static void report(std::ostream &out);
+
+  static uint64_t begin() {
+    return enabled ? Util::getTimeMicros() : 0;
+  }
+
+  static void end(HandlerTag &tag, uint64_t started) {
+    if (started != 0) tag.record(Util::getTimeMicros() - started);
+  }
+
+  template <typename Handler>
+  static ProfiledHandler<Handler> wrap(HandlerTag &tag, Handler handler) {
+    return ProfiledHandler<Handler>(tag, handler);
+  }
+};
+
+// Arguments are passed through by reference, so a handler that changes
+// one (a readv handler's buffer list) still can.  Callers may also hand
+// over temporaries, such as a literal -1 or a narrowed port, so there
+// are const overloads too, as boost::bind has, for every mix of const
+// and non-const arguments so that each is passed on as what it is.
+
+template <typename Handler>
+class ProfiledHandler {
+
+ private:
+  HandlerTag *tag;
+  Handler handler;
+
+ public:
+  ProfiledHandler(HandlerTag &tag, Handler handler) : tag(&tag), handler(handler) {}
+
+  void operator()() {
+    uint64_t started = LoopProfiler::begin();
+    handler();
+    LoopProfiler::end(*tag, started);
+  }
+
+  template <typename A1>
+  void operator()(A1 &a1) {
+    uint64_t started = LoopProfiler::begin();
+    handler(a1);
+    LoopProfiler::end(*tag, started);
+  }
+
+  template <typename A1>
+  void operator()(const A1 &a1) {
+    uint64_t started = LoopProfiler::begin();
+    handler(a1);
+    LoopProfiler::end(*tag, started);
+  }
+
+  template <typename A1, typename A2>
+  void operator()(A1 &a1, A2 &a2) {
+    uint64_t started = LoopProfiler::begin();
+    handler(a1, a2);
+    LoopProfiler::end(*tag, started);
+  }
+
+  template <typename A1, typename A2>
+  void operator()(const A1 &a1, A2 &a2) {
+    uint64_t started = LoopProfiler::begin();
+    handler(a1, a2);
+    LoopProfiler::end(*tag, started);
+  }
+
+  template <typename A1, typename A2>
+  void operator()(A1 &a1, const A2 &a2) {
+    uint64_t started = LoopProfiler::begin();
+    handler(a1, a2);
+    LoopProfiler::end(*tag, started);
+  }
+
+  template <typename A1, typename A2>
+  void operator()(const A1 &a1, const A2 &a2) {
+    uint64_t started = LoopProfiler::begin();
+    handler(a1, a2);
+    LoopProfiler::end(*tag, started);
+  }
+
+  template <typename A1, typename A2, typename A3>
+  void operator()(A1 &a1, A2 &a2, A3 &a3) {
+    uint64_t started = LoopProfiler::begin();
+    handler(a1, a2, a3);
+    LoopProfiler::end(*tag, started);
+  }
+
+  template <typename A1, typename A2, typename A3>
+  void operator()(A1 &a1, A2 &a2, const A3 &a3) {
+    uint64_t started = LoopProfiler::begin();
+    handler(a1, a2, a3);
+    LoopProfiler::end(*tag, started);
+  }
+
+  template <typename A1, typename A2, typename A3>
+  void operator()(A1 &a1, const A2 &a2, A3 &a3) {
+    uint64_t started = LoopProfiler::begin();
+    handler(a1, a2, a3);
+    LoopProfiler::end(*tag, started);
+  }
+
+  template <typename A1, typename A2, typename A3>
+  void operator()(A1 &a1, const A2 &a2, const A3 &a3) {
+    uint64_t started = LoopProfiler::begin();
+    handler(a1, a2, a3);
+    LoopProfiler::end(*tag, started);
+  }
+
+  template <typename A1, typename A2, typename A3>
+  void operator()(const A1 &a1, A2 &a2, A3 &a3) {
+    uint64_t started = LoopProfiler::begin();
+    handler(a1, a2, a3);
+    LoopProfiler::end(*tag, started);
+  }
+
+  template <typename A1, typename A2, typename A3>
+  void operator()(const A1 &a1, A2 &a2, const A3 &a3) {
+    uint64_t started = LoopProfiler::begin();
+    handler(a1, a2, a3);
+    LoopProfiler::end(*tag, started);
+  }
+
+  template <typename A1, typename A2, typename A3>
+  void operator()(const A1 &a1, const A2 &a2, A3 &a3) {
+    uint64_t started = LoopProfiler::begin();
+    handler(a1, a2, a3);
+    LoopProfiler::end(*tag, started);
+  }
+
+  template <typename A1, typename A2, typename A3>
+  void operator()(const A1 &a1, const A2 &a2, const A3 &a3) {
+    uint64_t started = LoopProfiler::begin();
+    handler(a1, a2, a3);
+    LoopProfiler::end(*tag, started);
+  }
+};
+
+#endif
@@ -0,0 +1,218 @@
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "Metrics.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+
+__thread int Metrics::threadShard       = -1;
+volatile uint32_t Metrics::nextShard    = 0;
+
+const uint32_t Metrics::SHARDS;
+const uint32_t Histogram::MAX_BUCKETS;
+
+// A function-local registry can't be used before it's constructed,
+// whatever order the static metrics in other files are set up in.
+
+std::vector<Metric*>& Metrics::getRegistry() {
+  static std::vector<Metric*> registry;
+  return registry;
+}
+
+uint32_t Metrics::assignShard() {
+  return __sync_fetch_and_add(&nextShard, 1) % SHARDS;
+}
+
+void Metrics::add(Metric *metric) {
+  getRegistry().push_back(metric);
+}
+
+static bool compareNames(Metric *a, Metric *b) {
+  return a->getName() < b->getName();
+}
+
+// Metrics that share a name with different labels are one family in
+// the exposition format, with a single HELP and TYPE.
+
+void Metrics::render(std::ostream &out) {
+  std::vector<Metric*> sorted(getRegistry());
+  std::stable_sort(sorted.begin(), sorted.end(), compareNames);
+
+  for (uint32_t i=0;i<sorted.size();i++) {
+    if (i == 0 || sorted[i]->getName() != sorted[i-1]->getName()) {
+      out << "# HELP " << sorted[i]->getName() << " " << sorted[i]->getHelp() << "\n"
+	  << "# TYPE " << sorted[i]->getName() << " " << sorted[i]->getType() << "\n";
+    }
+
+    sorted[i]->render(out);
+  }
+}
+
+Metric::Metric(const char *name, const char *labels, const char *help)
+  : name(name), labels(labels), help(help)
+{
+  Metrics::add(this);
+}
+
+void Metric::renderName(std::ostream &out, const char *suffix, const std::string &extra) {
+  out << name << suffix;
+
+  if (labels.empty() && extra.empty()) return;
+
+  out << "{" << labels;
+  if (!labels.empty() && !extra.empty()) out << ",";
+  out << extra << "}";
+}
+
+Counter::Counter(const char *name, const char *labels, const char *help)
+  : Metric(name, labels, help)
+{
+  memset((void*)shards, 0, sizeof(shards));
+}
+
+uint64_t Counter::getValue() {
+  uint64_t value = 0;
+
+  for (uint32_t i=0;i<Metrics::SHARDS;i++)
+    value += shards[i].value;
+
+  return value;
+}
+
+void Counter::render(std::ostream &out) {
+  renderName(out, "", "");
+  out << " " << getValue() << "\n";
+}
+
+Gauge::Gauge(const char *name, const char *labels, const char *help)
+  : Metric(name, labels, help)
+{
+  memset((void*)shards, 0, sizeof(shards));
+}
+
+int64_t Gauge::getValue() {
+  int64_t value = 0;
+
+  for (uint32_t i=0;i<Metrics::SHARDS;i++)
+    value += shards[i].value;
+
+  return value;
+}
+
+void Gauge::render(std::ostream &out) {
+  renderName(out, "", "");
+  out << " " << getValue() << "\n";
+}
+
+Histogram::Histogram(const char *name, const char *labels, const char *help,
+		     const uint64_t *bounds, uint32_t buckets)
+  : Metric(name, labels, help), buckets(std::min(buckets, MAX_BUCKETS))
+{
+  memcpy(this->bounds, bounds, this->buckets * sizeof(uint64_t));
+  memset((void*)shards, 0, sizeof(shards));
+}
+
+// Fills in the per-bucket counts (not cumulative), the last being +Inf,
+// and returns the number of bounded buckets.
+
+uint32_t Histogram::getCounts(uint64_t *counts, uint64_t *sum) {
+  memset(counts, 0, (buckets + 1) * sizeof(uint64_t));
+  *sum = 0;
+
+  for (uint32_t i=0;i<Metrics::SHARDS;i++) {
+    for (uint32_t j=0;j<=buckets;j++)
+      counts[j] += shards[i].counts[j];
+
+    *sum += shards[i].sum;
+  }
+
+  return buckets;
+}
+
+// Writes count, mean, p50, p90 and p99 as fixed-width columns, for
+// people rather than Prometheus.  Percentiles are read off the bucket
+// bounds, so they're upper limits to within a bucket's width.
+
+void Histogram::summarize(std::ostream &out) {
+  static const uint32_t percentiles[] = {50, 90, 99};
+
+  uint64_t counts[MAX_BUCKETS + 1];
+  uint64_t sum, total = 0;
+
+  getCounts(counts, &sum);
+
+  for (uint32_t i=0;i<=buckets;i++)
+    total += counts[i];
+
+  out << std::setw(8) << total << " " << std::setw(8) << (total == 0 ? 0 : sum / total);
+
+  for (uint32_t p=0;p<sizeof(percentiles) / sizeof(uint32_t);p++) {
+    uint64_t seen = 0;
+    uint32_t i;
+
+    for (i=0;i<buckets;i++) {
+      seen += counts[i];
+      if (seen * 100 >= total * percentiles[p]) break;
+    }
+
+    out << " " << std::setw(8);
+
+    if      (total == 0)  out << "-";
+    else if (i < buckets) out << bounds[i];
+    else                  out << "inf";
+  }
+}
+
+void Histogram::render(std::ostream &out) {
+  uint64_t counts[MAX_BUCKETS + 1];
+  uint64_t sum;
+
+  getCounts(counts, &sum);
+
+  uint64_t cumulative = 0;
+
+  for (uint32_t i=0;i<=buckets;i++) {
+    std::ostringstream bound;
+    cumulative += counts[i];
+
+    if (i < buckets) bound << "le=\"" << bounds[i] << "\"";
+    else             bound << "le=\"+Inf\"";
+
+    renderName(out, "_bucket", bound.str());
+    out << " " << cumulative << "\n";
+  }
+
+  renderName(out, "_sum", "");
+  out << " " << sum << "\n";
+  renderName(out, "_count", "");
+  out << " " << cumulative << "\n";
+}
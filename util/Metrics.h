@@ -0,0 +1,178 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <ostream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/***********
+ *
+ * Metrics keeps the process-wide registry of counters, gauges, and
+ * histograms, and renders them in the Prometheus text format.  Each
+ * metric is a static object in the file that updates it, and
+ * registers itself on construction.  Updates land in one of a fixed
+ * set of cache-line sized shards picked per thread, so the io threads
+ * of different proxy shards never contend on the same line.  Reading
+ * a metric sums its shards.
+ *
+ **********/
+
+class Metric {
+
+ protected:
+  std::string name;
+  std::string labels;
+  std::string help;
+
+  void renderName(std::ostream &out, const char *suffix, const std::string &extra);
+
+ public:
+  Metric(const char *name, const char *labels, const char *help);
+  virtual ~Metric() {}
+
+  const std::string& getName() { return name; }
+  const std::string& getHelp() { return help; }
+
+  virtual const char* getType() = 0;
+  virtual void render(std::ostream &out) = 0;
+};
+
+class Metrics {
+
+ public:
+  static const uint32_t SHARDS = 16;
+
+ private:
+  static __thread int threadShard;
+  static volatile uint32_t nextShard;
+
+  static std::vector<Metric*>& getRegistry();
+  static uint32_t assignShard();
+
+ public:
+  static uint32_t shard() {
+    if (threadShard < 0) threadShard = assignShard();
+    return threadShard;
+  }
+
+  static void add(Metric *metric);
+  static void render(std::ostream &out);
+};
+
+class Counter : public Metric {
+
+ private:
+  struct Shard {
+    volatile uint64_t value;
+  } __attribute__((aligned(64)));
+
+  Shard shards[Metrics::SHARDS];
+
+ public:
+  Counter(const char *name, const char *labels, const char *help);
+
+  void increment(uint64_t amount = 1) {
+    __sync_fetch_and_add(&shards[Metrics::shard()].value, amount);
+  }
+
+  uint64_t getValue();
+
+  const char* getType() { return "counter"; }
+  void render(std::ostream &out);
+};
+
+class Gauge : public Metric {
+
+ private:
+  struct Shard {
+    volatile int64_t value;
+  } __attribute__((aligned(64)));
+
+  Shard shards[Metrics::SHARDS];
+
+ public:
+  Gauge(const char *name, const char *labels, const char *help);
+
+  void add(int64_t amount) {
+    __sync_fetch_and_add(&shards[Metrics::shard()].value, amount);
+  }
+
+  void increment() { add(1);  }
+  void decrement() { add(-1); }
+
+  int64_t getValue();
+
+  const char* getType() { return "gauge"; }
+  void render(std::ostream &out);
+};
+
+// Bucket bounds are inclusive upper limits in whatever unit the name
+// says, in increasing order, with +Inf added implicitly.
+
+class Histogram : public Metric {
+
+ public:
+  static const uint32_t MAX_BUCKETS = 16;
+
+ private:
+  struct Shard {
+    volatile uint64_t counts[MAX_BUCKETS + 1];
+    volatile uint64_t sum;
+  } __attribute__((aligned(64)));
+
+  uint64_t bounds[MAX_BUCKETS];
+  uint32_t buckets;
+  Shard shards[Metrics::SHARDS];
+
+ public:
+  Histogram(const char *name, const char *labels, const char *help,
+	    const uint64_t *bounds, uint32_t buckets);
+
+  void observe(uint64_t value) {
+    Shard &shard = shards[Metrics::shard()];
+    uint32_t i   = 0;
+
+    while (i < buckets && value > bounds[i]) i++;
+
+    __sync_fetch_and_add(&shard.counts[i], 1);
+    __sync_fetch_and_add(&shard.sum, value);
+  }
+
+  uint32_t getCounts(uint64_t *counts, uint64_t *sum);
+  void summarize(std::ostream &out);
+
+  const char* getType() { return "histogram"; }
+  void render(std::ostream &out);
+};
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef __OBJECT_POOL_H__
+#define __OBJECT_POOL_H__
+
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <boost/thread/mutex.hpp>
+#include <vector>
+
+/***********
+ *
+ * ObjectPool keeps up to a fixed number of released objects around for
+ * reuse, so that objects which come and go with every connection don't
+ * each cost an allocation.  acquire() returns NULL when the pool is
+ * empty, and it's up to the caller to construct a new object and to
+ * put a reused one back into a fresh state.  Objects may be released
+ * on a different thread from the one that acquires them.
+ *
+ **********/
+
+template <class T>
+class ObjectPool {
+
+ private:
+  boost::mutex lock;
+  std::vector<T*> available;
+  std::size_t limit;
+
+ public:
+  ObjectPool(std::size_t limit) : limit(limit) {
+    available.reserve(limit);
+  }
+
+  ~ObjectPool() {
+    for (std::size_t i=0;i<available.size();i++)
+      delete available[i];
+  }
+
+  T* acquire() {
+    boost::mutex::scoped_lock guard(lock);
+
+    if (available.empty()) return NULL;
+
+    T *object = available.back();
+    available.pop_back();
+
+    return object;
+  }
+
+  void release(T *object) {
+    {
+      boost::mutex::scoped_lock guard(lock);
+
+      if (available.size() < limit) {
+	available.push_back(object);
+	return;
+      }
+    }
+
+    delete object;
+  }
+
+  std::size_t size() {
+    boost::mutex::scoped_lock guard(lock);
+    return available.size();
+  }
+};
+
+#endif
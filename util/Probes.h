@@ -0,0 +1,61 @@
+#ifndef __PROBES_H__
+#define __PROBES_H__
+
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Static tracepoints for bpftrace, perf and SystemTap, under the
+ * "tortunnel" provider.  Where <sys/sdt.h> is available each probe is a
+ * single nop in the instruction stream plus a note describing where its
+ * arguments live, so it costs nothing until a tracer attaches; without
+ * it the probes compile away entirely.  Arguments are evaluated whenever
+ * probes are compiled in, so they should stay cheap.  The scripts in
+ * probes/ show how to use them.
+ */
+
+#ifdef HAVE_SYS_SDT_H
+
+#include <sys/sdt.h>
+
+#define PROBE1(name, a)             DTRACE_PROBE1(tortunnel, name, a)
+#define PROBE2(name, a, b)          DTRACE_PROBE2(tortunnel, name, a, b)
+#define PROBE3(name, a, b, c)       DTRACE_PROBE3(tortunnel, name, a, b, c)
+#define PROBE4(name, a, b, c, d)    DTRACE_PROBE4(tortunnel, name, a, b, c, d)
+
+#else
+
+#define PROBE1(name, a)             do {} while (0)
+#define PROBE2(name, a, b)          do {} while (0)
+#define PROBE3(name, a, b, c)       do {} while (0)
+#define PROBE4(name, a, b, c, d)    do {} while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,106 @@
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "RingBuffer.h"
+
+#include <string.h>
+#include <cassert>
+
+RingBuffer::RingBuffer() : head(0), length(0) {}
+
+void RingBuffer::grow(size_t required) {
+  size_t newCapacity = storage.empty() ? INITIAL_CAPACITY : storage.size();
+
+  while (newCapacity < required)
+    newCapacity *= 2;
+
+  std::vector<unsigned char> grown(newCapacity);
+  size_t first = storage.size() - head < length ? storage.size() - head : length;
+
+  if (length > 0) {
+    memcpy(&grown[0], &storage[head], first);
+    memcpy(&grown[first], &storage[0], length - first);
+  }
+
+  storage.swap(grown);
+  head = 0;
+}
+
+void RingBuffer::append(const unsigned char *buf, size_t len) {
+  if (len == 0) return;
+
+  if (length + len > storage.size())
+    grow(length + len);
+
+  size_t tail  = (head + length) % storage.size();
+  size_t first = storage.size() - tail < len ? storage.size() - tail : len;
+
+  memcpy(&storage[tail], buf, first);
+  memcpy(&storage[0], buf + first, len - first);
+
+  length += len;
+}
+
+size_t RingBuffer::peek(unsigned char **buf, size_t maxLength, size_t offset) {
+  if (offset >= length) return 0;
+
+  size_t start      = (head + offset) % storage.size();
+  size_t available  = length - offset;
+  size_t contiguous = storage.size() - start < available ? storage.size() - start : available;
+
+  *buf = &storage[start];
+
+  return contiguous < maxLength ? contiguous : maxLength;
+}
+
+void RingBuffer::consume(size_t len) {
+  assert(len <= length);
+
+  length -= len;
+  head    = length == 0 ? 0 : (head + len) % storage.size();
+}
+
+void RingBuffer::clear() {
+  std::vector<unsigned char>().swap(storage);
+
+  head   = 0;
+  length = 0;
+}
+
+size_t RingBuffer::size() {
+  return length;
+}
+
+size_t RingBuffer::capacity() {
+  return storage.size();
+}
+
+bool RingBuffer::empty() {
+  return length == 0;
+}
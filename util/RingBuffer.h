@@ -0,0 +1,69 @@
+#ifndef __RING_BUFFER_H__
+#define __RING_BUFFER_H__
+
+/*-
+ * Copyright (c) 2009, Moxie Marlinspike
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of this program nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+/*
+ * A growable byte ring.  Data is appended at the tail and read in place:
+ * peek() hands back the longest contiguous run at the head, or at an
+ * offset into the data, without copying, and consume() lets it go.
+ * That memory is only valid until the next append(), consume() or
+ * clear(), since an append may have to grow the ring and move it.
+ */
+
+class RingBuffer {
+
+ private:
+  static const size_t INITIAL_CAPACITY = 4096;
+
+  std::vector<unsigned char> storage;
+  size_t head;
+  size_t length;
+
+  void grow(size_t required);
+
+ public:
+  RingBuffer();
+
+  void append(const unsigned char *buf, size_t len);
+  size_t peek(unsigned char **buf, size_t maxLength, size_t offset = 0);
+  void consume(size_t len);
+  void clear();
+
+  size_t size();
+  size_t capacity();
+  bool empty();
+};
+
+#endif
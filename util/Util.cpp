@@ -36,6 +36,7 @@
 
 #include <openssl/rand.h>
 #include <boost/assert.hpp>
+#include <sys/time.h>
 
 #include <openssl/sha.h>
 #include <openssl/hmac.h>
@@ -260,3 +261,10 @@ uint32_t Util::getRandom() {
 
   return bigEndianArrayToInt(bytes);
 }
+
+uint64_t Util::getTimeMicros() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+
+  return ((uint64_t)now.tv_sec * 1000000) + now.tv_usec;
+}
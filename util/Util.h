@@ -57,6 +57,7 @@ class Util {
 			     std::vector<std::string> &tokens);
   static uint16_t getRandomId();
   static uint32_t getRandom();
+  static uint64_t getTimeMicros();
 };
 
 #endif